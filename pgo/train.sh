@@ -0,0 +1,70 @@
+#!/bin/sh
+# Training workload for the TERMCALC_PGO build (see CMakeLists.txt).
+#
+#   train.sh train BIN PROFILE_DIR [LLVM_PROFDATA OUT | GCDA_FROM GCDA_TO]
+#       Run the corpus through an instrumented BIN, then merge the clang
+#       profile into OUT, or copy GCC's profile from the training object's
+#       name to the name the optimised object looks for.
+#   train.sh bench PLAIN PGO
+#       Time the same workload on both binaries and print the speedup.
+set -eu
+
+here=$(cd "$(dirname "$0")" && pwd)
+work=$(mktemp -d)
+trap 'rm -rf "$work"' EXIT
+grep -v '^#' "$here/corpus.txt" | grep . > "$work/corpus"
+
+# Keep the user's history and constant libraries out of it
+export HOME="$work"
+
+# One-shot, REPL/batch, output formatting and extended precision paths
+workload() {
+    bin=$1 repeat=$2
+    while IFS= read -r expr; do
+        "$bin" "$expr" > /dev/null 2>&1 || true
+    done < "$work/corpus"
+    i=0
+    while [ "$i" -lt "$repeat" ]; do
+        "$bin" < "$work/corpus" > /dev/null 2>&1 || true
+        i=$((i + 1))
+    done
+    "$bin" --precision dd < "$work/corpus" > /dev/null 2>&1 || true
+    "$bin" --precision qd 'sqrt(2) * pi' > /dev/null 2>&1 || true
+    "$bin" --mc 2e5 --seed 1 'rps * latency' rps='normal(1200, 150)' latency='lognormal(-3, 0.4)' \
+        > /dev/null 2>&1 || true
+}
+
+now_ms() {
+    echo $(($(date +%s%N) / 1000000))
+}
+
+case $1 in
+    train)
+        bin=$2 dir=$3
+        mkdir -p "$dir"
+        workload "$bin" 20
+        if [ $# -eq 5 ] && [ -x "$4" ]; then
+            "$4" merge -o "$5" "$dir"/*.profraw
+        elif [ $# -eq 5 ]; then
+            from=$(printf '%s' "$4" | tr / '#')
+            to=$(printf '%s' "$5" | tr / '#')
+            cp "$dir/$from" "$dir/$to"
+        fi
+        ;;
+    bench)
+        workload "$2" 1      # warm the page cache
+        best_plain='' best_pgo=''
+        for round in 1 2 3; do
+            t0=$(now_ms); workload "$2" 100; t1=$(now_ms); workload "$3" 100; t2=$(now_ms)
+            plain=$((t1 - t0)) pgo=$((t2 - t1))
+            [ -z "$best_plain" ] || [ "$plain" -lt "$best_plain" ] && best_plain=$plain
+            [ -z "$best_pgo" ] || [ "$pgo" -lt "$best_pgo" ] && best_pgo=$pgo
+        done
+        echo "PGO training workload: Release ${best_plain} ms, PGO ${best_pgo} ms," \
+             "speedup $(awk "BEGIN { printf \"%.2f\", $best_plain / ($best_pgo > 0 ? $best_pgo : 1) }")x"
+        ;;
+    *)
+        echo "usage: $0 train BIN PROFILE_DIR [...] | bench PLAIN PGO" >&2
+        exit 2
+        ;;
+esac
@@ -2,15 +2,47 @@
 // C23 with modern usage patterns
 // Usage: c <expr> or just 'c' for interactive mode
 
+#define _GNU_SOURCE  // POSIX/BSD/Linux APIs (pread, flock, termios, epoll) under -std=c23
+
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdarg.h>
+#include <signal.h>
 #include <string.h>
 #include <math.h>
+#include <float.h>
 #include <ctype.h>
 #include <stdint.h>
 #include <inttypes.h>
-#include <readline/readline.h>
-#include <readline/history.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/ioctl.h>
+#include <sys/time.h>
+#include <poll.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#ifdef __linux__
+#include <sys/epoll.h>
+#include <sys/prctl.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#endif
+#include <termios.h>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#elif defined(__aarch64__) && defined(__linux__)
+#include <arm_acle.h>
+#include <sys/auxv.h>
+#endif
 
 // C23: bool, true, false are keywords
 // C23: nullptr instead of NULL
@@ -39,35 +71,242 @@ constexpr double TB = 1000000000000.0;
 // Configuration
 // ============================================================================
 
-constexpr int MAX_VARS = 64;
+constexpr int MAX_VARS = 1024;
 constexpr int MAX_NAME = 32;
 constexpr int MAX_INPUT = 1024;
 
+// History file: entries are appended as they are entered; once the file
+// grows past its retention limit (HIST_MAX_BYTES, or $C_HISTORY_SIZE) it is
+// compacted down to its newest half. Startup reads only the newest
+// HIST_LOAD_BYTES, so its cost stays bounded however large the file gets.
+constexpr int HIST_MAX_LINES = 10000;
+constexpr long HIST_LOAD_BYTES = 1L << 20;
+constexpr long HIST_MAX_BYTES = 64L << 20;
+
+// Hot loops (batch evaluation, GEMM, sieve, random numbers, bignum
+// multiply) are compiled for each x86-64 level and the loader picks the
+// best for this CPU, so one binary runs anywhere and still uses AVX2 or
+// AVX-512 where present. TERMCALC_NATIVE builds for the host CPU only.
+#if defined(__x86_64__) && defined(__GLIBC__) && !defined(TERMCALC_NATIVE)
+#define HOT_LOOP [[gnu::target_clones("default", "arch=x86-64-v2", "arch=x86-64-v3", "arch=x86-64-v4")]]
+#else
+#define HOT_LOOP
+#endif
+
 // Output format for current expression
-typedef enum { FMT_DEC, FMT_HEX, FMT_BIN, FMT_OCT } OutputFormat;
+typedef enum { FMT_DEC, FMT_HEX, FMT_BIN, FMT_OCT, FMT_FACTOR } OutputFormat;
 static OutputFormat g_output_fmt = FMT_DEC;
 
+// Set by SIGINT in the REPL; long-running evaluation polls it and unwinds
+static volatile sig_atomic_t g_interrupted = 0;
+
+// Set with g_interrupted when a time limit (deadline_arm) runs out
+static volatile sig_atomic_t g_deadline_hit = 0;
+
+constexpr long DEADLINE_TICK_MS = 5;   // input check interval for deadline_arm(ms, true)
+static volatile sig_atomic_t g_deadline_ticks = 0;
+static volatile sig_atomic_t g_deadline_keys = 0;
+
+static void on_deadline(int sig) {
+    (void)sig;
+    struct pollfd pfd = {.fd = STDIN_FILENO, .events = POLLIN};
+    if (--g_deadline_ticks > 0 && !(g_deadline_keys && poll(&pfd, 1, 0) > 0)) return;
+    g_deadline_hit = 1;
+    g_interrupted = 1;
+}
+
+// Interrupt the evaluation after ms milliseconds, or with `keys` as soon as
+// a keystroke is queued, through the same polling points as Ctrl+C; 0 disarms
+static void deadline_arm(long ms, bool keys) {
+    static bool installed;
+    if (!installed) {
+        struct sigaction sa = {.sa_handler = on_deadline};
+        sigemptyset(&sa.sa_mask);
+        sigaction(SIGALRM, &sa, nullptr);
+        installed = true;
+    }
+    long tick = keys && ms > DEADLINE_TICK_MS ? DEADLINE_TICK_MS : ms;
+    g_deadline_ticks = tick ? (sig_atomic_t)((ms + tick - 1) / tick) : 0;
+    g_deadline_keys = keys;
+    struct timeval tv = {.tv_sec = tick / 1000, .tv_usec = tick % 1000 * 1000};
+    struct itimerval t = {.it_value = tv, .it_interval = tv};
+    setitimer(ITIMER_REAL, &t, nullptr);
+}
+
+// Quiet evaluation (REPL live preview): no error messages, no assignments
+static bool g_quiet = false;
+
+// Evaluating for the live preview: skip builtins that would take long
+static bool g_in_preview = false;
+
+// Serving requests from other processes: builtins may not read files
+static bool g_no_files = false;
+
+// Last evaluation error, kept even when quiet (reported by the server)
+static char g_error[128];
+
+// Progress of the running computation in thousandths, -1 when unknown.
+// Long loops (sieve, integrate, --mc) update it; between progress_begin and
+// progress_end a reporter thread shows it on a stderr status line once the
+// computation has run for PROGRESS_DELAY_MS, on terminals only.
+constexpr long PROGRESS_DELAY_MS = 500;
+constexpr long PROGRESS_TICK_MS = 100;
+
+static atomic_int g_progress = -1;
+
+static struct {
+    pthread_t tid;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    const char *what;
+    bool running, stop, shown;
+} progress = {.lock = PTHREAD_MUTEX_INITIALIZER, .wake = PTHREAD_COND_INITIALIZER};
+
+static void progress_set(uint64_t done, uint64_t total) {
+    if (total) atomic_store_explicit(&g_progress, (int)(done * 1000 / total), memory_order_relaxed);
+}
+
+static void *progress_main(void *arg) {
+    (void)arg;
+    struct timespec t;
+    clock_gettime(CLOCK_REALTIME, &t);
+    long elapsed = 0;
+    pthread_mutex_lock(&progress.lock);
+    while (!progress.stop) {
+        t.tv_nsec += PROGRESS_TICK_MS * 1000000;
+        if (t.tv_nsec >= 1000000000) { ++t.tv_sec; t.tv_nsec -= 1000000000; }
+        if (pthread_cond_timedwait(&progress.wake, &progress.lock, &t) != ETIMEDOUT) continue;
+        if ((elapsed += PROGRESS_TICK_MS) < PROGRESS_DELAY_MS) continue;
+        int p = atomic_load_explicit(&g_progress, memory_order_relaxed);
+        if (p >= 0) {
+            fprintf(stderr, "\r\x1b[2m%s %d.%d%%  (Ctrl+C cancels)\x1b[0m\x1b[K", progress.what, p / 10, p % 10);
+        } else {
+            fprintf(stderr, "\r\x1b[2m%s %.1fs  (Ctrl+C cancels)\x1b[0m\x1b[K", progress.what, (double)elapsed / 1000);
+        }
+        progress.shown = true;
+    }
+    pthread_mutex_unlock(&progress.lock);
+    return nullptr;
+}
+
+// Clear the status line before other output goes to the terminal
+static void progress_hide(void) {
+    if (!progress.running) return;
+    pthread_mutex_lock(&progress.lock);
+    if (progress.shown) fputs("\r\x1b[K", stderr);
+    progress.shown = false;
+    pthread_mutex_unlock(&progress.lock);
+}
+
+static void progress_begin(const char *what) {
+    atomic_store(&g_progress, -1);
+    if (!isatty(STDERR_FILENO)) return;
+    progress.what = what;
+    progress.stop = progress.shown = false;
+    progress.running = pthread_create(&progress.tid, nullptr, progress_main, nullptr) == 0;
+}
+
+static void progress_end(void) {
+    if (!progress.running) return;
+    pthread_mutex_lock(&progress.lock);
+    progress.stop = true;
+    pthread_cond_signal(&progress.wake);
+    pthread_mutex_unlock(&progress.lock);
+    pthread_join(progress.tid, nullptr);
+    progress_hide();
+    progress.running = false;
+}
+
+[[gnu::format(printf, 1, 2)]]
+static void eval_error(const char *fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    vsnprintf(g_error, sizeof(g_error), fmt, ap);
+    va_end(ap);
+    if (g_quiet) return;
+    progress_hide();
+    fputs(g_error, stderr);
+}
+
 // ============================================================================
 // Variable storage
 // ============================================================================
 
+// A variable either holds a plain value or is a `name := expr` binding.
+// Bindings cache their value and are recomputed lazily on read once any
+// variable they read (deps, a bitset of var indices) has changed.
+constexpr int DEP_WORDS = (MAX_VARS + 63) / 64;
+
 typedef struct {
     char name[MAX_NAME];
     double value;
+    double tail[3];    // low parts of value under --precision dd|qd
+    char *formula;     // binding expression, nullptr for plain values
+    char *exact;       // decimal digits of an integer value past 2^53, or nullptr
+    uint64_t deps[DEP_WORDS];  // vars read by the last evaluation of formula
+    bool dirty;        // value is stale and must be recomputed
+    bool busy;         // being recomputed (cycle detection)
 } Variable;
 
 static Variable vars[MAX_VARS];
 static int var_count = 0;
 
-static double get_var(const char *name) {
+// While a binding is being evaluated, collects the vars it reads
+static uint64_t *g_dep_track = nullptr;
+
+static void refresh_binding(Variable *v);
+static void mat_forget(const char *name);
+static bool lib_lookup(const char *name, double *out);
+
+static int find_var(const char *name) {
     for (int i = 0; i < var_count; ++i) {
-        if (strcmp(vars[i].name, name) == 0) {
-            return vars[i].value;
+        if (strcmp(vars[i].name, name) == 0) return i;
+    }
+    return -1;
+}
+
+// Mark every binding that (transitively) reads vars[i] for recomputation
+static void mark_dependents(int i) {
+    for (int j = 0; j < var_count; ++j) {
+        if (vars[j].formula && !vars[j].dirty && (vars[j].deps[i / 64] >> (i % 64) & 1)) {
+            vars[j].dirty = true;
+            mark_dependents(j);
+        }
+    }
+}
+
+// Find or create a variable; a new name may satisfy bindings that read it
+// while it was still undefined, so they all become stale.
+static int intern_var(const char *name) {
+    int i = find_var(name);
+    if (i >= 0 || var_count >= MAX_VARS) return i;
+
+    i = var_count++;
+    vars[i] = (Variable){};
+    strncpy(vars[i].name, name, MAX_NAME - 1);
+    for (int j = 0; j < i; ++j) {
+        if (vars[j].formula) vars[j].dirty = true;
+    }
+    return i;
+}
+
+static double get_var(const char *name) {
+    int i = find_var(name);
+    if (i >= 0) {
+        if (g_dep_track) g_dep_track[i / 64] |= 1ULL << (i % 64);
+        if (vars[i].formula && vars[i].dirty) {
+            if (vars[i].busy) {
+                eval_error("circular binding: %s\n", name);
+                return NAN;
+            }
+            refresh_binding(&vars[i]);
         }
+        return vars[i].value;
     }
     // Built-in constants
     if (strcmp(name, "pi") == 0 || strcmp(name, "PI") == 0) return PI;
     if (strcmp(name, "e") == 0 || strcmp(name, "E") == 0) return E;
+    if (strcmp(name, "inf") == 0) return INFINITY;
     if (strcmp(name, "ans") == 0) return var_count > 0 ? vars[0].value : 0.0;
 
     // Byte units
@@ -80,22 +319,105 @@ static double get_var(const char *name) {
     if (strcmp(name, "GB") == 0 || strcmp(name, "gb") == 0) return GB;
     if (strcmp(name, "TB") == 0 || strcmp(name, "tb") == 0) return TB;
 
-    fprintf(stderr, "undefined: %s\n", name);
+    // User constant libraries
+    double val;
+    if (lib_lookup(name, &val)) return val;
+
+    eval_error("undefined: %s\n", name);
     return NAN;
 }
 
 static void set_var(const char *name, double value) {
-    for (int i = 0; i < var_count; ++i) {
-        if (strcmp(vars[i].name, name) == 0) {
-            vars[i].value = value;
-            return;
-        }
+    int i = intern_var(name);
+    if (i < 0) return;
+    mat_forget(name);
+    free(vars[i].formula);
+    vars[i].formula = nullptr;
+    free(vars[i].exact);
+    vars[i].exact = nullptr;
+    vars[i].value = value;
+    memset(vars[i].tail, 0, sizeof(vars[i].tail));
+    mark_dependents(i);
+}
+
+// name := formula
+static double bind_var(const char *name, const char *formula) {
+    int i = intern_var(name);
+    if (i < 0) return NAN;
+    mat_forget(name);
+    char *copy = strdup(formula);
+    if (!copy) return NAN;
+    free(vars[i].formula);
+    vars[i].formula = copy;
+    free(vars[i].exact);
+    vars[i].exact = nullptr;
+    vars[i].dirty = true;
+    mark_dependents(i);
+    return get_var(name);
+}
+
+// ============================================================================
+// Expression trees
+// ============================================================================
+
+// Input is parsed once into a flat node array and then evaluated, so the
+// same tree can also be evaluated exactly (big integers) or repeatedly.
+// Node 0 is a NaN constant standing in for syntax errors and overflow.
+
+typedef enum { N_NUM, N_VAR, N_NEG, N_NOT, N_BIN, N_CALL, N_MAT, N_STR } NodeKind;
+
+constexpr int MAX_ARGS = 4;
+constexpr int MAX_NODES = MAX_INPUT;
+
+typedef struct {
+    uint8_t kind;              // NodeKind
+    char op;                   // N_BIN: operator as in Token.op
+    uint8_t nargs;
+    bool inexact;              // N_NUM: num is a rounded integer literal
+    uint16_t name;             // N_VAR, N_CALL: offset into Expr.names
+    int16_t args[MAX_ARGS];    // children (N_NEG, N_NOT use args[0]); N_MAT: rows, cols
+    uint32_t lit_len;          // N_NUM, N_STR: literal length; N_MAT: first entry in Expr.items
+    const char *lit;           // N_NUM, N_STR: literal text in the source (N_STR without quotes)
+    double num;                // N_NUM: value
+} Node;
+
+typedef struct {
+    Node nodes[MAX_NODES];
+    char names[2 * MAX_INPUT];
+    int16_t items[MAX_NODES];  // N_MAT entries, row by row
+    int count;
+    int names_len;
+    int item_count;
+    bool overflow;             // input too long for the node/name arrays
+} Expr;
+
+static void expr_init(Expr *e) {
+    e->nodes[0] = (Node){.kind = N_NUM, .num = NAN};
+    e->names[0] = '\0';
+    e->count = 1;
+    e->names_len = 1;
+    e->item_count = 0;
+    e->overflow = false;
+}
+
+static int add_node(Expr *e, Node nd) {
+    if (e->count == MAX_NODES) {
+        e->overflow = true;
+        return 0;
     }
-    if (var_count < MAX_VARS) {
-        strncpy(vars[var_count].name, name, MAX_NAME - 1);
-        vars[var_count].value = value;
-        ++var_count;
+    e->nodes[e->count] = nd;
+    return e->count++;
+}
+
+static uint16_t add_name(Expr *e, const char *name) {
+    size_t len = strlen(name) + 1;
+    if ((size_t)e->names_len + len > sizeof(e->names)) {
+        e->overflow = true;
+        return 0;
     }
+    memcpy(e->names + e->names_len, name, len);
+    e->names_len += (int)len;
+    return (uint16_t)(e->names_len - (int)len);
 }
 
 // ============================================================================
@@ -103,7 +425,8 @@ static void set_var(const char *name, double value) {
 // ============================================================================
 
 typedef enum {
-    TOK_NUM, TOK_ID, TOK_OP, TOK_LPAREN, TOK_RPAREN, TOK_END, TOK_ERR
+    TOK_NUM, TOK_ID, TOK_OP, TOK_LPAREN, TOK_RPAREN, TOK_LBRACKET, TOK_RBRACKET,
+    TOK_STR, TOK_END, TOK_ERR
 } TokenType;
 
 typedef struct {
@@ -112,12 +435,15 @@ typedef struct {
     char id[MAX_NAME];
     char op;
     char op2;  // for two-char operators like << >>
+    bool inexact;  // TOK_NUM: integer literal past 2^53, rounded in num
 } Token;
 
 typedef struct {
     const char *src;
     const char *pos;
+    const char *tok_start;   // where the current token begins
     Token cur;
+    Expr *ex;                // tree being built
 } Parser;
 
 static void skip_ws(Parser *p) {
@@ -139,6 +465,7 @@ static bool parse_number(Parser *p) {
             if (end == p->pos) { p->pos = start; return false; }
             p->pos = end;
             p->cur.num = (double)val;
+            p->cur.inexact = val >= 9007199254740992ULL;  // or saturated past 2^64
             p->cur.type = TOK_NUM;
             return true;
         }
@@ -146,10 +473,13 @@ static bool parse_number(Parser *p) {
             // Binary
             p->pos += 2;
             uint64_t val = 0;
+            int digits = 0;
             while (*p->pos == '0' || *p->pos == '1') {
+                if (val || *p->pos == '1') ++digits;
                 val = (val << 1) | (*p->pos++ - '0');
             }
             p->cur.num = (double)val;
+            p->cur.inexact = digits > 53;
             p->cur.type = TOK_NUM;
             return true;
         }
@@ -161,6 +491,7 @@ static bool parse_number(Parser *p) {
             if (end == p->pos) { p->pos = start; return false; }
             p->pos = end;
             p->cur.num = (double)val;
+            p->cur.inexact = val >= 9007199254740992ULL;
             p->cur.type = TOK_NUM;
             return true;
         }
@@ -172,6 +503,7 @@ static bool parse_number(Parser *p) {
         char *end;
         p->cur.num = strtod(p->pos, &end);
         p->pos = end;
+        p->cur.inexact = !(p->cur.num < 9007199254740992.0);  // including overflow to inf
         p->cur.type = TOK_NUM;
         return true;
     }
@@ -181,8 +513,10 @@ static bool parse_number(Parser *p) {
 
 static void next_token(Parser *p) {
     skip_ws(p);
+    p->tok_start = p->pos;
 
-    if (*p->pos == '\0') {
+    // Interrupted: end the token stream so the parser unwinds at once
+    if (*p->pos == '\0' || g_interrupted) {
         p->cur = (Token){.type = TOK_END};
         return;
     }
@@ -206,8 +540,21 @@ static void next_token(Parser *p) {
     switch (c) {
         case '(': p->cur = (Token){.type = TOK_LPAREN}; return;
         case ')': p->cur = (Token){.type = TOK_RPAREN}; return;
+        case '[': p->cur = (Token){.type = TOK_LBRACKET}; return;
+        case ']': p->cur = (Token){.type = TOK_RBRACKET}; return;
+        case '"': {
+            // String literal (file names), no escapes
+            const char *end = strchr(p->pos, '"');
+            if (!end) {
+                p->cur = (Token){.type = TOK_ERR};
+                return;
+            }
+            p->pos = end + 1;
+            p->cur = (Token){.type = TOK_STR};
+            return;
+        }
         case '+': case '-': case '/': case '%': case '=':
-        case '&': case '|': case '~': case ',':
+        case '&': case '|': case '~': case ',': case ';':
             p->cur = (Token){.type = TOK_OP, .op = c};
             return;
         case '<':
@@ -237,6 +584,14 @@ static void next_token(Parser *p) {
         case '^':
             p->cur = (Token){.type = TOK_OP, .op = '^'};
             return;
+        case ':':
+            if (*p->pos == '=') {
+                ++p->pos;
+                p->cur = (Token){.type = TOK_OP, .op = ':'};  // := binding
+            } else {
+                p->cur = (Token){.type = TOK_ERR};
+            }
+            return;
         default:
             p->cur = (Token){.type = TOK_ERR};
     }
@@ -246,339 +601,7130 @@ static void next_token(Parser *p) {
 // Recursive descent parser
 // ============================================================================
 
-static double parse_expr(Parser *p);
-
-// Two-argument functions
-static double call_func2(const char *name, double arg1, double arg2) {
-    if (strcmp(name, "bxor") == 0) return (double)((uint64_t)arg1 ^ (uint64_t)arg2);
-    if (strcmp(name, "band") == 0) return (double)((uint64_t)arg1 & (uint64_t)arg2);
-    if (strcmp(name, "bor") == 0) return (double)((uint64_t)arg1 | (uint64_t)arg2);
-    if (strcmp(name, "shl") == 0) return (double)((uint64_t)arg1 << (int)arg2);
-    if (strcmp(name, "shr") == 0) return (double)((uint64_t)arg1 >> (int)arg2);
-    if (strcmp(name, "pow") == 0) return pow(arg1, arg2);
-    if (strcmp(name, "mod") == 0) return fmod(arg1, arg2);
-    if (strcmp(name, "atan2") == 0) return atan2(arg1, arg2);
-    if (strcmp(name, "max") == 0) return fmax(arg1, arg2);
-    if (strcmp(name, "min") == 0) return fmin(arg1, arg2);
-    return NAN;
-}
-
-// Built-in functions
-static double call_func(const char *name, double arg) {
-    // Math functions
-    if (strcmp(name, "sin") == 0) return sin(arg);
-    if (strcmp(name, "cos") == 0) return cos(arg);
-    if (strcmp(name, "tan") == 0) return tan(arg);
-    if (strcmp(name, "asin") == 0) return asin(arg);
-    if (strcmp(name, "acos") == 0) return acos(arg);
-    if (strcmp(name, "atan") == 0) return atan(arg);
-    if (strcmp(name, "sinh") == 0) return sinh(arg);
-    if (strcmp(name, "cosh") == 0) return cosh(arg);
-    if (strcmp(name, "tanh") == 0) return tanh(arg);
-    if (strcmp(name, "exp") == 0) return exp(arg);
-    if (strcmp(name, "log") == 0) return log(arg);
-    if (strcmp(name, "log10") == 0) return log10(arg);
-    if (strcmp(name, "log2") == 0) return log2(arg);
-    if (strcmp(name, "sqrt") == 0) return sqrt(arg);
-    if (strcmp(name, "cbrt") == 0) return cbrt(arg);
-    if (strcmp(name, "abs") == 0) return fabs(arg);
-    if (strcmp(name, "floor") == 0) return floor(arg);
-    if (strcmp(name, "ceil") == 0) return ceil(arg);
-    if (strcmp(name, "round") == 0) return round(arg);
-    if (strcmp(name, "ln") == 0) return log(arg);
-
-    // Bitwise functions
-    if (strcmp(name, "bnot") == 0) return (double)(~(uint64_t)arg);
-    if (strcmp(name, "not8") == 0) return (double)((uint8_t)~(uint8_t)arg);
-    if (strcmp(name, "not16") == 0) return (double)((uint16_t)~(uint16_t)arg);
-    if (strcmp(name, "not32") == 0) return (double)((uint32_t)~(uint32_t)arg);
-
-    // Programmer functions - format converters (set output format)
-    if (strcmp(name, "hex") == 0) { g_output_fmt = FMT_HEX; return arg; }
-    if (strcmp(name, "bin") == 0) { g_output_fmt = FMT_BIN; return arg; }
-    if (strcmp(name, "oct") == 0) { g_output_fmt = FMT_OCT; return arg; }
-    if (strcmp(name, "dec") == 0) { g_output_fmt = FMT_DEC; return arg; }
-
-    // Byte conversions - convert TO these units
-    if (strcmp(name, "toKiB") == 0 || strcmp(name, "tokib") == 0) return arg / KiB;
-    if (strcmp(name, "toMiB") == 0 || strcmp(name, "tomib") == 0) return arg / MiB;
-    if (strcmp(name, "toGiB") == 0 || strcmp(name, "togib") == 0) return arg / GiB;
-    if (strcmp(name, "toTiB") == 0 || strcmp(name, "totib") == 0) return arg / TiB;
-    if (strcmp(name, "toKB") == 0 || strcmp(name, "tokb") == 0) return arg / KB;
-    if (strcmp(name, "toMB") == 0 || strcmp(name, "tomb") == 0) return arg / MB;
-    if (strcmp(name, "toGB") == 0 || strcmp(name, "togb") == 0) return arg / GB;
-    if (strcmp(name, "toTB") == 0 || strcmp(name, "totb") == 0) return arg / TB;
+static int parse_expr(Parser *p);
 
-    // Bit manipulation
-    if (strcmp(name, "popcount") == 0) return (double)__builtin_popcountll((uint64_t)arg);
-    if (strcmp(name, "clz") == 0) return arg == 0 ? 64 : (double)__builtin_clzll((uint64_t)arg);
-    if (strcmp(name, "ctz") == 0) return arg == 0 ? 64 : (double)__builtin_ctzll((uint64_t)arg);
+// Matrix literal after its '[': expr (, expr)* (; expr (, expr)*)* ]
+static int parse_matrix(Parser *p) {
+    Expr *e = p->ex;
+    int16_t items[MAX_NODES / 2];
+    int count = 0, rows = 1, cols = 0;
+    for (;;) {
+        if (count == (int)(sizeof(items) / sizeof(items[0]))) {
+            e->overflow = true;
+            return 0;
+        }
+        items[count++] = (int16_t)parse_expr(p);
+        if (p->cur.type != TOK_OP || (p->cur.op != ',' && p->cur.op != ';')) break;
+        if (p->cur.op == ';') {
+            if (cols == 0) cols = count;
+            if (count != rows * cols) break;
+            ++rows;
+        }
+        next_token(p);
+    }
+    if (cols == 0) cols = count;
+    if (count != rows * cols) {
+        eval_error("matrix rows differ in length\n");
+        return 0;
+    }
+    if (p->cur.type == TOK_RBRACKET) next_token(p);
 
-    fprintf(stderr, "unknown function: %s\n", name);
-    return NAN;
+    memcpy(e->items + e->item_count, items, (size_t)count * sizeof(items[0]));
+    Node nd = {.kind = N_MAT, .args = {(int16_t)rows, (int16_t)cols},
+               .lit_len = (uint32_t)e->item_count};
+    e->item_count += count;
+    return add_node(e, nd);
 }
 
-// primary: number | identifier | function(expr) | (expr) | -primary | ~primary
-static double parse_primary(Parser *p) {
+// primary: number | "string" | identifier | function(expr, ...) | (expr)
+//        | [matrix] | -primary | ~primary
+static int parse_primary(Parser *p) {
+    Expr *e = p->ex;
+
     // Unary minus/plus
     if (p->cur.type == TOK_OP && (p->cur.op == '-' || p->cur.op == '+')) {
         char op = p->cur.op;
         next_token(p);
-        double val = parse_primary(p);
-        return op == '-' ? -val : val;
+        int arg = parse_primary(p);
+        return op == '-' ? add_node(e, (Node){.kind = N_NEG, .nargs = 1, .args = {arg}}) : arg;
     }
 
     // Bitwise NOT
     if (p->cur.type == TOK_OP && p->cur.op == '~') {
         next_token(p);
-        double val = parse_primary(p);
-        return (double)(~(uint64_t)val);
+        int arg = parse_primary(p);
+        return add_node(e, (Node){.kind = N_NOT, .nargs = 1, .args = {arg}});
     }
 
     // Parentheses
     if (p->cur.type == TOK_LPAREN) {
         next_token(p);
-        double val = parse_expr(p);
+        int node = parse_expr(p);
         if (p->cur.type == TOK_RPAREN) next_token(p);
-        return val;
+        return node;
     }
 
-    // Number
+    if (p->cur.type == TOK_LBRACKET) {
+        next_token(p);
+        return parse_matrix(p);
+    }
+
+    // Number (keeping its text for exact integer evaluation)
     if (p->cur.type == TOK_NUM) {
-        double val = p->cur.num;
+        Node nd = {.kind = N_NUM, .num = p->cur.num, .inexact = p->cur.inexact,
+                   .lit = p->tok_start, .lit_len = (uint32_t)(p->pos - p->tok_start)};
+        next_token(p);
+        return add_node(e, nd);
+    }
+
+    // String, pointing into the source between the quotes
+    if (p->cur.type == TOK_STR) {
+        Node nd = {.kind = N_STR, .lit = p->tok_start + 1,
+                   .lit_len = (uint32_t)(p->pos - p->tok_start - 2)};
         next_token(p);
-        return val;
+        return add_node(e, nd);
     }
 
     // Identifier or function call
     if (p->cur.type == TOK_ID) {
-        char name[MAX_NAME];
-        strcpy(name, p->cur.id);
+        Node nd = {.kind = N_VAR, .name = add_name(e, p->cur.id)};
         next_token(p);
 
         // Function call
         if (p->cur.type == TOK_LPAREN) {
             next_token(p);
-            double arg1 = parse_expr(p);
-
-            // Check for second argument
-            if (p->cur.type == TOK_OP && p->cur.op == ',') {
+            nd.kind = N_CALL;
+            nd.args[nd.nargs++] = (int16_t)parse_expr(p);
+            while (p->cur.type == TOK_OP && p->cur.op == ',' && nd.nargs < MAX_ARGS) {
                 next_token(p);
-                double arg2 = parse_expr(p);
-                if (p->cur.type == TOK_RPAREN) next_token(p);
-                return call_func2(name, arg1, arg2);
+                nd.args[nd.nargs++] = (int16_t)parse_expr(p);
             }
-
             if (p->cur.type == TOK_RPAREN) next_token(p);
-            return call_func(name, arg1);
         }
-
-        // Variable
-        return get_var(name);
+        return add_node(e, nd);
     }
 
-    fprintf(stderr, "syntax error\n");
-    return NAN;
+    eval_error("syntax error\n");
+    return 0;
+}
+
+static int binary_node(Parser *p, char op, int left, int right) {
+    return add_node(p->ex, (Node){.kind = N_BIN, .op = op, .nargs = 2, .args = {left, right}});
 }
 
 // power: primary (^ power)?  (right associative)
-static double parse_power(Parser *p) {
-    double left = parse_primary(p);
+static int parse_power(Parser *p) {
+    int left = parse_primary(p);
     if (p->cur.type == TOK_OP && p->cur.op == '^') {
         next_token(p);
-        double right = parse_power(p);  // right associative
-        return pow(left, right);
+        int right = parse_power(p);  // right associative
+        return binary_node(p, '^', left, right);
     }
     return left;
 }
 
 // term: power ((*|/|%) power)*
-static double parse_term(Parser *p) {
-    double left = parse_power(p);
+static int parse_term(Parser *p) {
+    int left = parse_power(p);
     while (p->cur.type == TOK_OP &&
            (p->cur.op == '*' || p->cur.op == '/' || p->cur.op == '%')) {
         char op = p->cur.op;
         next_token(p);
-        double right = parse_power(p);
-        switch (op) {
-            case '*': left *= right; break;
-            case '/': left /= right; break;
-            case '%': left = fmod(left, right); break;
-        }
+        left = binary_node(p, op, left, parse_power(p));
     }
     return left;
 }
 
 // additive: term ((+|-) term)*
-static double parse_additive(Parser *p) {
-    double left = parse_term(p);
+static int parse_additive(Parser *p) {
+    int left = parse_term(p);
     while (p->cur.type == TOK_OP && (p->cur.op == '+' || p->cur.op == '-')) {
         char op = p->cur.op;
         next_token(p);
-        double right = parse_term(p);
-        left = (op == '+') ? left + right : left - right;
+        left = binary_node(p, op, left, parse_term(p));
     }
     return left;
 }
 
 // shift: additive ((<<|>>) additive)*
-static double parse_shift(Parser *p) {
-    double left = parse_additive(p);
+static int parse_shift(Parser *p) {
+    int left = parse_additive(p);
     while (p->cur.type == TOK_OP && (p->cur.op == 'L' || p->cur.op == 'R')) {
         char op = p->cur.op;
         next_token(p);
-        double right = parse_additive(p);
-        uint64_t l = (uint64_t)left;
-        int r = (int)right;
-        left = (op == 'L') ? (double)(l << r) : (double)(l >> r);
+        left = binary_node(p, op, left, parse_additive(p));
     }
     return left;
 }
 
 // bitand: shift (& shift)*
-static double parse_bitand(Parser *p) {
-    double left = parse_shift(p);
+static int parse_bitand(Parser *p) {
+    int left = parse_shift(p);
     while (p->cur.type == TOK_OP && p->cur.op == '&') {
         next_token(p);
-        double right = parse_shift(p);
-        left = (double)((uint64_t)left & (uint64_t)right);
+        left = binary_node(p, '&', left, parse_shift(p));
     }
     return left;
 }
 
 // bitor: bitand (| bitand)*
-static double parse_bitor(Parser *p) {
-    double left = parse_bitand(p);
+static int parse_bitor(Parser *p) {
+    int left = parse_bitand(p);
     while (p->cur.type == TOK_OP && p->cur.op == '|') {
         next_token(p);
-        double right = parse_bitand(p);
-        left = (double)((uint64_t)left | (uint64_t)right);
+        left = binary_node(p, '|', left, parse_bitand(p));
     }
     return left;
 }
 
 // expr: bitor
-static double parse_expr(Parser *p) {
+static int parse_expr(Parser *p) {
     return parse_bitor(p);
 }
 
 // ============================================================================
-// Top-level: handle assignment or expression
+// Number theory
 // ============================================================================
 
-static double evaluate(const char *input) {
-    g_output_fmt = FMT_DEC;  // Reset format for each expression
+// Exact functions on 64-bit integers: deterministic Miller-Rabin and
+// Pollard-Brent rho, both on Montgomery multiplication so the inner loops
+// avoid 128-bit division, and binary gcd.
 
-    Parser p = {.src = input, .pos = input};
-    next_token(&p);
+__extension__ typedef unsigned __int128 u128;
 
-    // Check for assignment: name = expr
-    if (p.cur.type == TOK_ID) {
-        char name[MAX_NAME];
-        strcpy(name, p.cur.id);
+typedef struct {
+    uint64_t n;      // odd modulus
+    uint64_t ninv;   // n^-1 mod 2^64
+    uint64_t r2;     // 2^128 mod n, for converting into Montgomery form
+} Mont;
 
-        const char *saved = p.pos;
-        Token saved_tok = p.cur;
-        next_token(&p);
+static Mont mont_init(uint64_t n) {
+    uint64_t inv = n;  // correct to 3 bits for odd n; each step doubles that
+    for (int i = 0; i < 5; ++i) inv *= 2 - n * inv;
+    u128 r = ((u128)1 << 64) % n;
+    return (Mont){.n = n, .ninv = inv, .r2 = (uint64_t)(r * r % n)};
+}
 
-        if (p.cur.type == TOK_OP && p.cur.op == '=') {
-            next_token(&p);
-            double val = parse_expr(&p);
-            set_var(name, val);
-            return val;
-        }
+// t * 2^-64 mod n, for t < n * 2^64
+static uint64_t mont_reduce(const Mont *m, u128 t) {
+    uint64_t q = (uint64_t)t * m->ninv;
+    uint64_t hi = (uint64_t)(t >> 64);
+    uint64_t sub = (uint64_t)(((u128)q * m->n) >> 64);
+    return hi >= sub ? hi - sub : hi - sub + m->n;
+}
 
-        // Not assignment, backtrack
-        p.pos = saved;
-        p.cur = saved_tok;
+static uint64_t mont_mul(const Mont *m, uint64_t a, uint64_t b) {
+    return mont_reduce(m, (u128)a * b);
+}
+
+// a + b mod n for a, b < n (n may exceed 2^63)
+static uint64_t mont_add(const Mont *m, uint64_t a, uint64_t b) {
+    return a >= m->n - b ? a - (m->n - b) : a + b;
+}
+
+static uint64_t mont_to(const Mont *m, uint64_t a) {
+    return mont_mul(m, a % m->n, m->r2);
+}
+
+static uint64_t mont_pow(const Mont *m, uint64_t base, uint64_t exp) {
+    uint64_t result = mont_to(m, 1);
+    while (exp) {
+        if (exp & 1) result = mont_mul(m, result, base);
+        base = mont_mul(m, base, base);
+        exp >>= 1;
     }
+    return result;
+}
 
-    return parse_expr(&p);
+static uint64_t gcd_u64(uint64_t a, uint64_t b) {
+    if (a == 0) return b;
+    if (b == 0) return a;
+    int shift = __builtin_ctzll(a | b);
+    a >>= __builtin_ctzll(a);
+    do {
+        b >>= __builtin_ctzll(b);
+        if (a > b) {
+            uint64_t t = a; a = b; b = t;
+        }
+        b -= a;
+    } while (b);
+    return a << shift;
 }
 
-// ============================================================================
-// Output formatting
-// ============================================================================
+static const uint8_t small_primes[] = {2, 3, 5, 7, 11, 13, 17, 19, 23, 29, 31, 37};
 
-static void print_binary(uint64_t val) {
-    if (val == 0) { puts("0b0"); return; }
+static bool is_prime_u64(uint64_t n) {
+    for (size_t i = 0; i < sizeof(small_primes); ++i) {
+        if (n % small_primes[i] == 0) return n == small_primes[i];
+    }
+    if (n < 37 * 37) return n > 1;
 
-    char buf[65];
-    int i = 64;
-    buf[i--] = '\0';
+    // These seven bases decide every n < 2^64
+    static const uint64_t bases[] = {2, 325, 9375, 28178, 450775, 9780504, 1795265022};
+    Mont m = mont_init(n);
+    uint64_t d = n - 1;
+    int s = __builtin_ctzll(d);
+    d >>= s;
+    uint64_t one = mont_to(&m, 1), minus_one = mont_to(&m, n - 1);
+    for (size_t i = 0; i < sizeof(bases) / sizeof(bases[0]); ++i) {
+        uint64_t a = bases[i] % n;
+        if (a == 0) continue;
+        uint64_t x = mont_pow(&m, mont_to(&m, a), d);
+        if (x == one || x == minus_one) continue;
+        int r = 1;
+        for (; r < s; ++r) {
+            x = mont_mul(&m, x, x);
+            if (x == minus_one) break;
+        }
+        if (r == s) return false;
+    }
+    return true;
+}
 
-    while (val && i >= 0) {
-        buf[i--] = '0' + (val & 1);
-        val >>= 1;
+// A non-trivial factor of an odd composite n (Brent's cycle finding, with
+// the gcd taken once per batch of products)
+static uint64_t pollard_brent(uint64_t n) {
+    constexpr uint64_t BATCH = 128;
+    Mont m = mont_init(n);
+    for (uint64_t c = 1;; ++c) {
+        uint64_t cm = mont_to(&m, c);
+        uint64_t y = mont_to(&m, 2), x = y, ys = y, q = mont_to(&m, 1), g = 1;
+        for (uint64_t r = 1; g == 1; r <<= 1) {
+            x = y;
+            for (uint64_t i = 0; i < r; ++i) y = mont_add(&m, mont_mul(&m, y, y), cm);
+            for (uint64_t k = 0; k < r && g == 1; k += BATCH) {
+                ys = y;
+                for (uint64_t i = 0; i < BATCH && i < r - k; ++i) {
+                    y = mont_add(&m, mont_mul(&m, y, y), cm);
+                    q = mont_mul(&m, q, x > y ? x - y : y - x);
+                }
+                g = gcd_u64(q, n);
+            }
+        }
+        // The batch overshot: redo it one step at a time
+        if (g == n) {
+            do {
+                ys = mont_add(&m, mont_mul(&m, ys, ys), cm);
+                g = gcd_u64(x > ys ? x - ys : ys - x, n);
+            } while (g == 1);
+        }
+        if (g != n) return g;
+        if (g_interrupted) return n;
     }
-    printf("0b%s\n", &buf[i + 1]);
 }
 
-static void print_result(double val) {
-    if (isnan(val)) return;
+constexpr int MAX_FACTORS = 64;
 
-    switch (g_output_fmt) {
-        case FMT_HEX:
-            printf("0x%" PRIX64 "\n", (uint64_t)val);
-            break;
-        case FMT_BIN:
-            print_binary((uint64_t)val);
-            break;
-        case FMT_OCT:
-            printf("0o%" PRIo64 "\n", (uint64_t)val);
-            break;
-        case FMT_DEC:
-        default:
-            // Check if it's effectively an integer
-            if (fabs(val) < 1e15 && val == floor(val)) {
-                printf("%.0f\n", val);
-            } else {
-                printf("%.12g\n", val);
-            }
-            break;
+static void factor_rec(uint64_t n, uint64_t *f, int *count) {
+    if (n == 1 || g_interrupted) return;
+    if (is_prime_u64(n)) {
+        f[(*count)++] = n;
+        return;
     }
+    uint64_t d = pollard_brent(n);
+    if (d == n) return;  // interrupted
+    factor_rec(d, f, count);
+    factor_rec(n / d, f, count);
 }
 
-// ============================================================================
-// Interactive mode
-// ============================================================================
+// Prime factors of n in ascending order, with repeats; returns the count
+static int factor_u64(uint64_t n, uint64_t f[MAX_FACTORS]) {
+    int count = 0;
+    if (n < 2) return 0;
+    for (size_t i = 0; i < sizeof(small_primes); ++i) {
+        while (n % small_primes[i] == 0) {
+            f[count++] = small_primes[i];
+            n /= small_primes[i];
+        }
+    }
+    int first = count;
+    factor_rec(n, f, &count);
 
-static const char *get_history_path(void) {
-    static char path[512];
-    const char *home = getenv("HOME");
-    if (home) {
-        snprintf(path, sizeof(path), "%s/.c_history", home);
-        return path;
+    // Insertion sort: at most a handful of large factors
+    for (int i = first + 1; i < count; ++i) {
+        uint64_t v = f[i];
+        int j = i;
+        for (; j > first && f[j - 1] > v; --j) f[j] = f[j - 1];
+        f[j] = v;
     }
-    return nullptr;
+    return count;
 }
 
-static void repl(void) {
-    // Load history
-    const char *hist_path = get_history_path();
-    if (hist_path) read_history(hist_path);
+static uint64_t totient_u64(uint64_t n) {
+    uint64_t f[MAX_FACTORS];
+    int count = factor_u64(n, f);
+    uint64_t phi = n;
+    for (int i = 0; i < count; ++i) {
+        if (i == 0 || f[i] != f[i - 1]) phi = phi / f[i] * (f[i] - 1);
+    }
+    return phi;
+}
 
-    // Enable prefix search with up/down arrows
-    rl_bind_keyseq("\\e[A", rl_history_search_backward);  // Up
-    rl_bind_keyseq("\\e[B", rl_history_search_forward);   // Down
+// Smallest prime > n; false past the largest 64-bit prime
+static bool next_prime_u64(uint64_t n, uint64_t *out) {
+    if (n < 2) {
+        *out = 2;
+        return true;
+    }
+    if (n >= 18446744073709551557ULL) return false;
+    uint64_t c = (n + 1) | 1;
+    while (!is_prime_u64(c)) c += 2;
+    *out = c;
+    return true;
+}
 
-    char *line;
-    while ((line = readline("> ")) != nullptr) {
-        // Skip empty lines
-        if (line[0] == '\0') {
-            free(line);
-            continue;
-        }
+// --- modular arithmetic ----------------------------------------------------
 
-        // Exit commands
-        if (strcmp(line, "q") == 0 || strcmp(line, "quit") == 0 ||
-            strcmp(line, "exit") == 0) {
-            free(line);
-            break;
-        }
+// A prepared modulus: Montgomery form for odd moduli, Barrett for even ones.
+// Recently used moduli are cached, so batches that repeat a modulus (the
+// services, bindings over many rows) skip the 128-bit divisions in setup.
+typedef struct {
+    uint64_t m;      // 0 for an empty cache slot
+    bool odd;
+    Mont mont;
+    u128 mu;         // floor((2^128 - 1) / m) for Barrett
+} Modulus;
 
-        // Help
-        if (strcmp(line, "help") == 0 || strcmp(line, "?") == 0) {
+constexpr int MOD_CACHE = 8;
+static Modulus mod_cache[MOD_CACHE];
+
+static const Modulus *modulus_get(uint64_t m) {
+    Modulus *md = &mod_cache[(m * 0x9E3779B97F4A7C15ULL) >> 61];
+    if (md->m != m) {
+        *md = (Modulus){.m = m, .odd = m & 1};
+        if (md->odd) md->mont = mont_init(m);
+        else md->mu = ~(u128)0 / m;
+    }
+    return md;
+}
+
+// High 128 bits of a 128 x 128-bit product
+static u128 mulhi_u128(u128 a, u128 b) {
+    uint64_t a0 = (uint64_t)a, a1 = (uint64_t)(a >> 64);
+    uint64_t b0 = (uint64_t)b, b1 = (uint64_t)(b >> 64);
+    u128 p00 = (u128)a0 * b0, p01 = (u128)a0 * b1;
+    u128 p10 = (u128)a1 * b0, p11 = (u128)a1 * b1;
+    u128 mid = (p00 >> 64) + (uint64_t)p01 + (uint64_t)p10;
+    return p11 + (p01 >> 64) + (p10 >> 64) + (mid >> 64);
+}
+
+static uint64_t barrett_reduce(const Modulus *md, u128 x) {
+    u128 r = x - mulhi_u128(x, md->mu) * md->m;  // quotient estimate is at most 2 short
+    while (r >= md->m) r -= md->m;
+    return (uint64_t)r;
+}
+
+// a * b mod m for a, b < m
+static uint64_t mod_mul(const Modulus *md, uint64_t a, uint64_t b) {
+    if (!md->odd) return barrett_reduce(md, (u128)a * b);
+    return mont_mul(&md->mont, mont_mul(&md->mont, a, b), md->mont.r2);
+}
+
+static uint64_t mod_pow(const Modulus *md, uint64_t base, uint64_t exp) {
+    if (md->m == 1) return 0;
+    if (md->odd) return mont_reduce(&md->mont, mont_pow(&md->mont, mont_to(&md->mont, base), exp));
+    uint64_t result = 1;
+    base %= md->m;
+    while (exp) {
+        if (exp & 1) result = barrett_reduce(md, (u128)result * base);
+        base = barrett_reduce(md, (u128)base * base);
+        exp >>= 1;
+    }
+    return result;
+}
+
+// Extended Euclid; false when gcd(a, m) != 1
+static bool mod_inv(uint64_t a, uint64_t m, uint64_t *out) {
+    __extension__ __int128 t = 0, newt = 1;
+    uint64_t r = m, newr = a % m;
+    while (newr) {
+        uint64_t q = r / newr;
+        __extension__ __int128 tt = t - (__int128)q * newt;
+        t = newt;
+        newt = tt;
+        uint64_t rr = r - q * newr;
+        r = newr;
+        newr = rr;
+    }
+    if (r != 1) return false;
+    *out = (uint64_t)(t < 0 ? t + m : t);
+    return true;
+}
+
+// modpow(b, e, m), mulmod(a, b, m) and modinv(a, m); false if not one of
+// these or on a domain error (reported)
+static bool modular(const char *name, int nargs, const uint64_t *arg, uint64_t *out) {
+    bool pow = strcmp(name, "modpow") == 0, mul = strcmp(name, "mulmod") == 0;
+    bool inv = strcmp(name, "modinv") == 0;
+    if (!(((pow || mul) && nargs == 3) || (inv && nargs == 2))) return false;
+
+    uint64_t m = arg[nargs - 1];
+    if (m == 0) {
+        eval_error("%s: modulus must be positive\n", name);
+        return false;
+    }
+    if (inv) {
+        if (mod_inv(arg[0], m, out)) return true;
+        eval_error("modinv: %" PRIu64 " has no inverse mod %" PRIu64 "\n", arg[0], m);
+        return false;
+    }
+    const Modulus *md = modulus_get(m);
+    *out = pow ? mod_pow(md, arg[0], arg[1])
+               : m == 1 ? 0 : mod_mul(md, arg[0] % m, arg[1] % m);
+    return true;
+}
+
+// "2^3 * 3 * 5" for the factor() output format
+static void format_factors(char *out, size_t size, uint64_t n, bool neg) {
+    uint64_t f[MAX_FACTORS];
+    int count = factor_u64(n, f);
+    size_t len = (size_t)snprintf(out, size, "%s", neg ? "-" : "");
+    if (count == 0) snprintf(out + len, size - len, "%" PRIu64, n);
+
+    for (int i = 0; i < count && len < size;) {
+        int j = i;
+        while (j < count && f[j] == f[i]) ++j;
+        len += (size_t)snprintf(out + len, size - len, "%s%" PRIu64, i ? " * " : "", f[i]);
+        if (j - i > 1 && len < size) len += (size_t)snprintf(out + len, size - len, "^%d", j - i);
+        i = j;
+    }
+}
+
+// ============================================================================
+// Prime sieve
+// ============================================================================
+
+// Segmented sieve of Eratosthenes over odd numbers only, one bit each
+// (bit g of the global index stands for 2g + 1). Segments are L1-sized
+// and start from a pre-sieved pattern with 3, 5, 7, 11 and 13 already
+// struck out (a 2*3*5*7*11*13 wheel), so only primes >= 17 are crossed
+// off. Counting splits the segments across threads and uses popcount.
+// primepi() itself uses Lucy's O(n^3/4) prime-counting recurrence, which
+// reaches 1e12 in seconds where sieving would take minutes; the sieve
+// finishes nthprime() from that count and serves primes(a, b).
+
+constexpr size_t SEG_BYTES = 32 * 1024;
+constexpr uint64_t SEG_BITS = SEG_BYTES * 8;
+constexpr uint32_t WHEEL_BYTES = 3 * 5 * 7 * 11 * 13;  // pattern period in bytes
+constexpr int SIEVE_THREADS = 64;
+constexpr uint64_t SIEVE_MAX = 1ULL << 50;             // sieving primes stay below 2^25
+constexpr uint64_t PRIMEPI_MAX = 100000000000000ULL;   // 1e14 (160 MB, a few minutes)
+constexpr uint64_t PREVIEW_SIEVE_MAX = 100000000;      // live preview skips bigger ones
+
+static uint8_t *wheel_pattern = nullptr;
+
+// Primes 17..limit for crossing off, in a growing cache
+static uint32_t *sieve_primes = nullptr;
+static size_t sieve_nprimes = 0;
+static uint64_t sieve_limit = 0;
+
+static uint64_t isqrt_u64(uint64_t n) {
+    uint64_t r = (uint64_t)sqrt((double)n);
+    while (r * r > n) --r;
+    while ((r + 1) * (r + 1) <= n) ++r;
+    return r;
+}
+
+static bool sieve_prepare(uint64_t hi) {
+    if (!wheel_pattern) {
+        uint8_t *pat = calloc(WHEEL_BYTES, 1);
+        if (!pat) return false;
+        for (uint64_t g = 0; g < 8ULL * WHEEL_BYTES; ++g) {
+            uint64_t n = 2 * g + 1;
+            if (n % 3 && n % 5 && n % 7 && n % 11 && n % 13) pat[g / 8] |= (uint8_t)(1u << (g % 8));
+        }
+        wheel_pattern = pat;
+    }
+
+    uint64_t limit = isqrt_u64(hi);
+    if (limit <= sieve_limit) return true;
+
+    // Plain byte sieve up to sqrt(hi)
+    uint8_t *composite = calloc(limit + 1, 1);
+    if (!composite) return false;
+    size_t count = 0;
+    for (uint64_t i = 2; i <= limit; ++i) {
+        if (composite[i]) continue;
+        if (i >= 17) ++count;
+        for (uint64_t j = i * i; j <= limit; j += i) composite[j] = 1;
+    }
+    uint32_t *primes = malloc((count ? count : 1) * sizeof(uint32_t));
+    if (!primes) {
+        free(composite);
+        return false;
+    }
+    count = 0;
+    for (uint64_t i = 17; i <= limit; ++i) {
+        if (!composite[i]) primes[count++] = (uint32_t)i;
+    }
+    free(composite);
+    free(sieve_primes);
+    sieve_primes = primes;
+    sieve_nprimes = count;
+    sieve_limit = limit;
+    return true;
+}
+
+// Sieve segment s (global bits s*SEG_BITS ...) into buf, keeping only
+// global bits in [glo, ghi]
+HOT_LOOP
+static void sieve_segment(uint8_t *buf, uint64_t s, uint64_t glo, uint64_t ghi) {
+    uint64_t g0 = s * SEG_BITS;
+
+    // Start from the wheel pattern
+    size_t off = (size_t)((g0 / 8) % WHEEL_BYTES);
+    for (size_t done = 0; done < SEG_BYTES;) {
+        size_t n = WHEEL_BYTES - off < SEG_BYTES - done ? WHEEL_BYTES - off : SEG_BYTES - done;
+        memcpy(buf + done, wheel_pattern + off, n);
+        done += n;
+        off = 0;
+    }
+    if (g0 == 0) buf[0] = 0x6E;  // 1 is not prime; 3, 5, 7, 11, 13 are
+
+    // Cross off odd multiples of p from p^2
+    uint64_t lo = 2 * g0 + 1, hi = 2 * (g0 + SEG_BITS) - 1;
+    for (size_t i = 0; i < sieve_nprimes; ++i) {
+        uint64_t p = sieve_primes[i];
+        if (p * p > hi) break;
+        uint64_t m = p * p;
+        if (m < lo) {
+            m = (lo + p - 1) / p * p;
+            if (!(m & 1)) m += p;
+        }
+        for (uint64_t b = (m - 1) / 2 - g0; b < SEG_BITS; b += p) buf[b / 8] &= (uint8_t)~(1u << (b % 8));
+    }
+
+    // Trim to the requested range
+    for (uint64_t b = 0; b < SEG_BITS && g0 + b < glo; ++b) buf[b / 8] &= (uint8_t)~(1u << (b % 8));
+    if (ghi < g0 + SEG_BITS - 1) {
+        for (uint64_t b = ghi + 1 - g0; b < SEG_BITS; ++b) buf[b / 8] &= (uint8_t)~(1u << (b % 8));
+    }
+}
+
+HOT_LOOP
+static uint64_t segment_popcount(const uint8_t *buf) {
+    uint64_t count = 0;
+    for (size_t i = 0; i < SEG_BYTES; i += 8) {
+        uint64_t w;
+        memcpy(&w, buf + i, 8);
+        count += (uint64_t)__builtin_popcountll(w);
+    }
+    return count;
+}
+
+typedef struct {
+    uint64_t first, last, stride;   // segments first, first + stride, ... <= last
+    uint64_t glo, ghi;
+    uint64_t count;
+} SieveJob;
+
+static void *sieve_worker(void *arg) {
+    SieveJob *job = arg;
+    uint8_t *buf = malloc(SEG_BYTES);
+    if (!buf) return nullptr;
+    for (uint64_t s = job->first; s <= job->last && !g_interrupted; s += job->stride) {
+        sieve_segment(buf, s, job->glo, job->ghi);
+        job->count += segment_popcount(buf);
+        progress_set(s - job->first, job->last - job->first + 1);
+    }
+    free(buf);
+    return arg;
+}
+
+// Odd-index range [glo, ghi] covering the odd numbers in [lo, hi]
+static bool odd_range(uint64_t lo, uint64_t hi, uint64_t *glo, uint64_t *ghi) {
+    if (lo < 3) lo = 3;
+    if (hi < lo) return false;
+    *glo = lo / 2;             // first odd >= lo
+    *ghi = (hi - 1) / 2;       // last odd <= hi
+    return *glo <= *ghi;
+}
+
+// Number of primes in [lo, hi], segments spread over the CPUs
+static bool sieve_count(uint64_t lo, uint64_t hi, uint64_t *out) {
+    if (!sieve_prepare(hi)) return false;
+
+    uint64_t count = lo <= 2 && hi >= 2;
+    uint64_t glo, ghi;
+    if (odd_range(lo, hi, &glo, &ghi)) {
+        uint64_t first = glo / SEG_BITS, last = ghi / SEG_BITS;
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        uint64_t nthreads = cpus < 1 ? 1 : cpus > SIEVE_THREADS ? SIEVE_THREADS : (uint64_t)cpus;
+        if (nthreads > last - first + 1) nthreads = last - first + 1;
+
+        SieveJob jobs[SIEVE_THREADS];
+        pthread_t tids[SIEVE_THREADS];
+        bool started[SIEVE_THREADS] = {}, ok = true;
+        for (uint64_t t = 0; t < nthreads; ++t) {
+            jobs[t] = (SieveJob){.first = first + t, .last = last, .stride = nthreads,
+                                 .glo = glo, .ghi = ghi};
+        }
+        for (uint64_t t = 1; t < nthreads; ++t) {
+            started[t] = pthread_create(&tids[t], nullptr, sieve_worker, &jobs[t]) == 0;
+            if (!started[t] && !sieve_worker(&jobs[t])) ok = false;
+        }
+        if (!sieve_worker(&jobs[0])) ok = false;
+        for (uint64_t t = 1; t < nthreads; ++t) {
+            void *res = &jobs[t];
+            if (started[t]) pthread_join(tids[t], &res);
+            if (!res) ok = false;
+        }
+        if (!ok) return false;
+        for (uint64_t t = 0; t < nthreads; ++t) count += jobs[t].count;
+    }
+    *out = count;
+    return !g_interrupted;
+}
+
+// Visit the primes of [lo, hi] in order (from the top if reverse); the
+// visitor returns false to stop
+typedef bool (*PrimeVisitor)(uint64_t p, void *ctx);
+
+static bool sieve_each(uint64_t lo, uint64_t hi, bool reverse, PrimeVisitor visit, void *ctx) {
+    if (!sieve_prepare(hi)) return false;
+    uint8_t *buf = malloc(SEG_BYTES);
+    if (!buf) return false;
+
+    bool two = lo <= 2 && hi >= 2;
+    if (two && !reverse && !visit(2, ctx)) goto done;
+    uint64_t glo, ghi;
+    if (odd_range(lo, hi, &glo, &ghi)) {
+        uint64_t first = glo / SEG_BITS, last = ghi / SEG_BITS;
+        for (uint64_t k = 0; k <= last - first && !g_interrupted; ++k) {
+            uint64_t s = reverse ? last - k : first + k;
+            sieve_segment(buf, s, glo, ghi);
+            progress_set(k, last - first + 1);
+            uint64_t w;
+            for (size_t i = 0; i < SEG_BYTES; i += 8) {
+                size_t at = reverse ? SEG_BYTES - 8 - i : i;
+                memcpy(&w, buf + at, 8);
+                while (w) {
+                    int bit = reverse ? 63 - __builtin_clzll(w) : __builtin_ctzll(w);
+                    w &= ~(1ULL << bit);
+                    uint64_t g = s * SEG_BITS + at * 8 + (uint64_t)bit;
+                    if (!visit(2 * g + 1, ctx)) goto done;
+                }
+            }
+        }
+    }
+    if (two && reverse) visit(2, ctx);
+done:
+    free(buf);
+    return !g_interrupted;
+}
+
+// pi(n) by Lucy's recurrence over the values n / i: after processing prime
+// p, S(v) counts the integers in [2, v] with no prime factor below p
+static bool primepi_lucy(uint64_t n, uint64_t *out) {
+    if (n < 2) {
+        *out = 0;
+        return true;
+    }
+    uint64_t r = isqrt_u64(n);
+    uint64_t *small = malloc((r + 1) * sizeof(uint64_t));  // S(v), v <= r
+    uint64_t *large = malloc((r + 1) * sizeof(uint64_t));  // S(n / i), i <= r
+    if (!small || !large) {
+        free(small);
+        free(large);
+        return false;
+    }
+    small[0] = 0;
+    for (uint64_t i = 1; i <= r; ++i) {
+        small[i] = i - 1;
+        large[i] = n / i - 1;
+    }
+    for (uint64_t p = 2; p <= r && !g_interrupted; ++p) {
+        if (small[p] == small[p - 1]) continue;  // not prime
+        uint64_t sp = small[p - 1], p2 = p * p;
+        uint64_t imax = n / p2 < r ? n / p2 : r;
+        for (uint64_t i = 1; i <= imax; ++i) {
+            uint64_t ip = i * p;
+            large[i] -= (ip <= r ? large[ip] : small[n / ip]) - sp;
+        }
+        for (uint64_t v = r; v >= p2; --v) small[v] -= small[v / p] - sp;
+    }
+    *out = large[1];
+    free(small);
+    free(large);
+    return !g_interrupted;
+}
+
+typedef struct {
+    uint64_t remaining;
+    uint64_t found;
+} NthState;
+
+static bool nth_visit(uint64_t p, void *ctx) {
+    NthState *st = ctx;
+    st->found = p;
+    return --st->remaining > 0;
+}
+
+// The k-th prime: estimate it (Cipolla), count up to the estimate, then
+// walk the sieve window by window to the exact prime
+static bool nth_prime(uint64_t k, uint64_t *out) {
+    static const uint8_t first[] = {2, 3, 5, 7, 11, 13};
+    if (k <= 6) {
+        *out = first[k - 1];
+        return true;
+    }
+    double lk = log((double)k), llk = log(lk);
+    double est = (double)k * (lk + llk - 1 + (llk - 2) / lk);
+    if (est >= (double)SIEVE_MAX) return false;
+    uint64_t x = (uint64_t)est, count;
+    if (!primepi_lucy(x, &count)) return false;
+
+    constexpr uint64_t WINDOW = 1ULL << 24;
+    NthState st = {};
+    if (count >= k) {
+        // Walk down from x: the answer is the (count - k + 1)-th prime <= x
+        uint64_t need = count - k + 1;
+        for (uint64_t hi = x;; hi -= WINDOW) {
+            uint64_t lo = hi > WINDOW ? hi - WINDOW + 1 : 2, c;
+            if (!sieve_count(lo, hi, &c)) return false;
+            if (c >= need) {
+                st.remaining = need;
+                if (!sieve_each(lo, hi, true, nth_visit, &st)) return false;
+                break;
+            }
+            need -= c;
+        }
+    } else {
+        uint64_t need = k - count;
+        for (uint64_t lo = x + 1;; lo += WINDOW) {
+            uint64_t hi = lo + WINDOW - 1, c;
+            if (hi >= SIEVE_MAX) return false;
+            if (!sieve_count(lo, hi, &c)) return false;
+            if (c >= need) {
+                st.remaining = need;
+                if (!sieve_each(lo, hi, false, nth_visit, &st)) return false;
+                break;
+            }
+            need -= c;
+        }
+    }
+    *out = st.found;
+    return true;
+}
+
+// primepi(n) or nthprime(n), reporting arguments out of range
+static bool prime_count_fn(const char *name, uint64_t n, uint64_t *out) {
+    bool pi = name[0] == 'p';
+    bool ok = (pi ? n <= PRIMEPI_MAX : n > 0) && (pi ? primepi_lucy(n, out) : nth_prime(n, out));
+    if (!ok && !g_interrupted) eval_error("%s: argument out of range\n", name);
+    return ok;
+}
+
+// primes(a, b) at the top level lists the primes instead of their count
+static bool g_list_primes = false;
+static uint64_t g_primes_lo, g_primes_hi;
+
+static bool print_prime(uint64_t p, void *ctx) {
+    (void)ctx;
+    printf("%" PRIu64 "\n", p);
+    return true;
+}
+
+// ============================================================================
+// Bit manipulation
+// ============================================================================
+
+// pext, pdep and bextr are single instructions with BMI2/BMI1 and popcount
+// with POPCNT. The binary targets the baseline ISA, so those variants are
+// compiled with target attributes and bits_init() picks them from cpuid at
+// startup; everywhere else the portable versions run. Buffer popcounts also
+// have AVX2 (nibble lookup) and AVX-512 VPOPCNTDQ versions.
+
+static uint64_t pext_soft(uint64_t x, uint64_t mask) {
+    uint64_t r = 0;
+    for (uint64_t bit = 1; mask; mask &= mask - 1, bit <<= 1) {
+        if (x & mask & -mask) r |= bit;
+    }
+    return r;
+}
+
+static uint64_t pdep_soft(uint64_t x, uint64_t mask) {
+    uint64_t r = 0;
+    for (uint64_t bit = 1; mask; mask &= mask - 1, bit <<= 1) {
+        if (x & bit) r |= mask & -mask;
+    }
+    return r;
+}
+
+// start and len are taken below 256 as by the instruction
+static uint64_t bextr_soft(uint64_t x, unsigned start, unsigned len) {
+    if (start >= 64 || len == 0) return 0;
+    x >>= start;
+    return len >= 64 ? x : x & ((1ULL << len) - 1);
+}
+
+static unsigned popcount_soft(uint64_t x) {
+    return (unsigned)__builtin_popcountll(x);
+}
+
+// Set bits in n bytes; inlined into each target variant below
+[[gnu::always_inline]] static inline uint64_t popcount_bytes_tail(const uint8_t *p, size_t n) {
+    uint64_t count = 0;
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        uint64_t v;
+        memcpy(&v, p + i, 8);
+        count += (uint64_t)__builtin_popcountll(v);
+    }
+    for (; i < n; ++i) count += (uint64_t)__builtin_popcount(p[i]);
+    return count;
+}
+
+static uint64_t popcount_bytes_soft(const uint8_t *p, size_t n) {
+    return popcount_bytes_tail(p, n);
+}
+
+#if defined(__x86_64__)
+[[gnu::target("bmi2")]] static uint64_t pext_bmi2(uint64_t x, uint64_t mask) {
+    return _pext_u64(x, mask);
+}
+
+[[gnu::target("bmi2")]] static uint64_t pdep_bmi2(uint64_t x, uint64_t mask) {
+    return _pdep_u64(x, mask);
+}
+
+[[gnu::target("bmi")]] static uint64_t bextr_bmi(uint64_t x, unsigned start, unsigned len) {
+    return _bextr_u64(x, start, len);
+}
+
+[[gnu::target("popcnt")]] static unsigned popcount_hw(uint64_t x) {
+    return (unsigned)__builtin_popcountll(x);
+}
+
+[[gnu::target("popcnt")]] static uint64_t popcount_bytes_hw(const uint8_t *p, size_t n) {
+    return popcount_bytes_tail(p, n);
+}
+
+// Per-nibble counts by table shuffle, summed into 64-bit lanes by vpsadbw
+// every 8 vectors (before a byte count can pass 255)
+[[gnu::target("avx2,popcnt")]] static uint64_t popcount_bytes_avx2(const uint8_t *p, size_t n) {
+    const __m256i table = _mm256_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
+                                           0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+    const __m256i low = _mm256_set1_epi8(0x0F);
+    __m256i total = _mm256_setzero_si256();
+    size_t i = 0;
+    while (i + 32 <= n) {
+        __m256i bytes = _mm256_setzero_si256();
+        for (int k = 0; k < 8 && i + 32 <= n; ++k, i += 32) {
+            __m256i v = _mm256_loadu_si256((const __m256i *)(p + i));
+            __m256i lo = _mm256_shuffle_epi8(table, _mm256_and_si256(v, low));
+            __m256i hi = _mm256_shuffle_epi8(table, _mm256_and_si256(_mm256_srli_epi16(v, 4), low));
+            bytes = _mm256_add_epi8(bytes, _mm256_add_epi8(lo, hi));
+        }
+        total = _mm256_add_epi64(total, _mm256_sad_epu8(bytes, _mm256_setzero_si256()));
+    }
+    uint64_t lanes[4];
+    _mm256_storeu_si256((__m256i *)lanes, total);
+    return lanes[0] + lanes[1] + lanes[2] + lanes[3] + popcount_bytes_tail(p + i, n - i);
+}
+
+[[gnu::target("avx512f,avx512vpopcntdq,popcnt")]]
+static uint64_t popcount_bytes_avx512(const uint8_t *p, size_t n) {
+    __m512i total = _mm512_setzero_si512();
+    size_t i = 0;
+    for (; i + 64 <= n; i += 64) {
+        total = _mm512_add_epi64(total, _mm512_popcnt_epi64(_mm512_loadu_si512(p + i)));
+    }
+    return (uint64_t)_mm512_reduce_add_epi64(total) + popcount_bytes_tail(p + i, n - i);
+}
+#endif
+
+static struct {
+    uint64_t (*pext)(uint64_t, uint64_t);
+    uint64_t (*pdep)(uint64_t, uint64_t);
+    uint64_t (*bextr)(uint64_t, unsigned, unsigned);
+    unsigned (*popcount)(uint64_t);
+    uint64_t (*popcount_bytes)(const uint8_t *, size_t);
+} bitops = {pext_soft, pdep_soft, bextr_soft, popcount_soft, popcount_bytes_soft};
+
+static void bits_init(void) {
+#if defined(__x86_64__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("bmi2")) {
+        bitops.pext = pext_bmi2;
+        bitops.pdep = pdep_bmi2;
+    }
+    if (__builtin_cpu_supports("bmi")) bitops.bextr = bextr_bmi;
+    if (__builtin_cpu_supports("popcnt")) {
+        bitops.popcount = popcount_hw;
+        bitops.popcount_bytes = popcount_bytes_hw;
+    }
+    if (__builtin_cpu_supports("avx2")) bitops.popcount_bytes = popcount_bytes_avx2;
+    if (__builtin_cpu_supports("avx512vpopcntdq")) bitops.popcount_bytes = popcount_bytes_avx512;
+#endif
+}
+
+static uint64_t bitrev64(uint64_t x) {
+#if __has_builtin(__builtin_bitreverse64)
+    return __builtin_bitreverse64(x);
+#else
+    x = __builtin_bswap64(x);
+    x = (x >> 4 & 0x0F0F0F0F0F0F0F0FULL) | (x & 0x0F0F0F0F0F0F0F0FULL) << 4;
+    x = (x >> 2 & 0x3333333333333333ULL) | (x & 0x3333333333333333ULL) << 2;
+    return (x >> 1 & 0x5555555555555555ULL) | (x & 0x5555555555555555ULL) << 1;
+#endif
+}
+
+// Builtins handled by bit_func, by argument count; rotl, rotr and bitrev
+// take an optional width (default 64)
+static bool is_bit_func(const char *name, int nargs) {
+    switch (nargs) {
+        case 1:
+            return strcmp(name, "bswap16") == 0 || strcmp(name, "bswap32") == 0 ||
+                   strcmp(name, "bswap64") == 0 || strcmp(name, "bitrev") == 0 ||
+                   strcmp(name, "parity") == 0 || strcmp(name, "popcount") == 0 ||
+                   strcmp(name, "clz") == 0 || strcmp(name, "ctz") == 0;
+        case 2:
+            return strcmp(name, "pext") == 0 || strcmp(name, "pdep") == 0 ||
+                   strcmp(name, "rotl") == 0 || strcmp(name, "rotr") == 0 ||
+                   strcmp(name, "bitrev") == 0 || strcmp(name, "hamming") == 0;
+        case 3:
+            return strcmp(name, "rotl") == 0 || strcmp(name, "rotr") == 0 ||
+                   strcmp(name, "bextr") == 0 || strcmp(name, "bitfield") == 0;
+    }
+    return false;
+}
+
+// A builtin accepted by is_bit_func on exact 64-bit arguments
+static bool bit_func(const char *name, int nargs, const uint64_t *arg, uint64_t *out) {
+    uint64_t x = arg[0];
+    if (strcmp(name, "bswap16") == 0) { *out = __builtin_bswap16((uint16_t)x); return true; }
+    if (strcmp(name, "bswap32") == 0) { *out = __builtin_bswap32((uint32_t)x); return true; }
+    if (strcmp(name, "bswap64") == 0) { *out = __builtin_bswap64(x); return true; }
+    if (strcmp(name, "parity") == 0) { *out = bitops.popcount(x) & 1; return true; }
+    if (strcmp(name, "popcount") == 0) { *out = bitops.popcount(x); return true; }
+    if (strcmp(name, "clz") == 0) { *out = x ? (uint64_t)__builtin_clzll(x) : 64; return true; }
+    if (strcmp(name, "ctz") == 0) { *out = x ? (uint64_t)__builtin_ctzll(x) : 64; return true; }
+    if (strcmp(name, "pext") == 0) { *out = bitops.pext(x, arg[1]); return true; }
+    if (strcmp(name, "pdep") == 0) { *out = bitops.pdep(x, arg[1]); return true; }
+    if (strcmp(name, "hamming") == 0) { *out = bitops.popcount(x ^ arg[1]); return true; }
+    if (strcmp(name, "bextr") == 0) {
+        *out = bitops.bextr(x, arg[1] > 255 ? 255 : (unsigned)arg[1], arg[2] > 255 ? 255 : (unsigned)arg[2]);
+        return true;
+    }
+    if (strcmp(name, "bitfield") == 0) {
+        // Bits lo..hi inclusive in either order, like [31:16] in manuals
+        uint64_t lo = arg[1] < arg[2] ? arg[1] : arg[2], hi = arg[1] ^ arg[2] ^ lo;
+        if (hi > 63) {
+            eval_error("bitfield: bit positions must be 0 to 63\n");
+            return false;
+        }
+        *out = bextr_soft(x, (unsigned)lo, (unsigned)(hi - lo + 1));
+        return true;
+    }
+
+    // rotl, rotr, bitrev within the low `width` bits
+    uint64_t width = nargs == (name[0] == 'b' ? 2 : 3) ? arg[nargs - 1] : 64;
+    if (width == 0 || width > 64) {
+        eval_error("%s: width must be 1 to 64\n", name);
+        return false;
+    }
+    uint64_t mask = width == 64 ? UINT64_MAX : (1ULL << width) - 1;
+    x &= mask;
+    if (name[0] == 'b') {
+        *out = bitrev64(x) >> (64 - width);
+        return true;
+    }
+    unsigned n = (unsigned)(arg[1] % width);
+    if (name[3] == 'r') n = n ? (unsigned)width - n : 0;
+    *out = n ? ((x << n) | (x >> (width - n))) & mask : x;
+    return true;
+}
+
+// ============================================================================
+// Hashes
+// ============================================================================
+
+// crc32c, xxh3 and murmur3 of a value hash its 8 little-endian bytes, as a
+// program hashing a uint64_t key does. CRC32C runs on the SSE4.2 or ARMv8
+// crc32c instruction when hash_init() finds one and on slicing-by-8 tables
+// otherwise. crc32c_file splits the mapped file across threads and joins
+// the pieces with the CRC combination identity; XXH3 folds its input into
+// one accumulator in order, so xxh3_file is a single streaming pass.
+
+constexpr uint32_t CRC32C_POLY = 0x82F63B78;   // Castagnoli, bit-reflected
+constexpr size_t HASH_STEP = 1 << 20;          // bytes between interrupt checks
+constexpr size_t CRC_THREAD_MIN = 16 << 20;    // smallest share of crc32c_file
+constexpr int HASH_THREADS = 64;
+constexpr uint64_t PREVIEW_FILE_MAX = 64 << 20;  // live preview skips bigger files
+
+static uint64_t rd64(const uint8_t *p) {
+    uint64_t v;
+    memcpy(&v, p, 8);
+    return v;
+}
+
+static uint32_t rd32(const uint8_t *p) {
+    uint32_t v;
+    memcpy(&v, p, 4);
+    return v;
+}
+
+static uint32_t crc32c_table[8][256];
+
+// CRC register update (no pre/post inversion) by slicing-by-8
+static uint32_t crc32c_soft(uint32_t crc, const uint8_t *p, size_t n) {
+    const uint32_t (*t)[256] = crc32c_table;
+    for (; n >= 8; n -= 8, p += 8) {
+        uint64_t v = rd64(p) ^ crc;
+        crc = t[7][v & 0xFF] ^ t[6][v >> 8 & 0xFF] ^ t[5][v >> 16 & 0xFF] ^ t[4][v >> 24 & 0xFF] ^
+              t[3][v >> 32 & 0xFF] ^ t[2][v >> 40 & 0xFF] ^ t[1][v >> 48 & 0xFF] ^ t[0][v >> 56];
+    }
+    while (n--) crc = t[0][(crc ^ *p++) & 0xFF] ^ crc >> 8;
+    return crc;
+}
+
+#if defined(__x86_64__)
+[[gnu::target("sse4.2")]] static uint32_t crc32c_sse42(uint32_t crc, const uint8_t *p, size_t n) {
+    uint64_t c = crc;
+    for (; n >= 8; n -= 8, p += 8) c = _mm_crc32_u64(c, rd64(p));
+    while (n--) c = _mm_crc32_u8((uint32_t)c, *p++);
+    return (uint32_t)c;
+}
+#elif defined(__aarch64__) && defined(__linux__)
+[[gnu::target("+crc")]] static uint32_t crc32c_armv8(uint32_t crc, const uint8_t *p, size_t n) {
+    for (; n >= 8; n -= 8, p += 8) crc = __crc32cd(crc, rd64(p));
+    while (n--) crc = __crc32cb(crc, *p++);
+    return crc;
+}
+#endif
+
+static uint32_t (*crc32c_update)(uint32_t, const uint8_t *, size_t) = crc32c_soft;
+
+static void hash_init(void) {
+#if defined(__x86_64__)
+    if (__builtin_cpu_supports("sse4.2")) {
+        crc32c_update = crc32c_sse42;
+        return;
+    }
+#elif defined(__aarch64__) && defined(__linux__)
+    if (getauxval(AT_HWCAP) & HWCAP_CRC32) {
+        crc32c_update = crc32c_armv8;
+        return;
+    }
+#endif
+    for (uint32_t i = 0; i < 256; ++i) {
+        uint32_t c = i;
+        for (int k = 0; k < 8; ++k) c = c & 1 ? c >> 1 ^ CRC32C_POLY : c >> 1;
+        crc32c_table[0][i] = c;
+    }
+    for (int k = 1; k < 8; ++k) {
+        for (int i = 0; i < 256; ++i) {
+            uint32_t c = crc32c_table[k - 1][i];
+            crc32c_table[k][i] = c >> 8 ^ crc32c_table[0][c & 0xFF];
+        }
+    }
+}
+
+// a*b modulo the CRC polynomial, bit-reflected as the register is
+static uint32_t crc_mulmod(uint32_t a, uint32_t b) {
+    uint32_t p = 0;
+    for (uint32_t m = 1u << 31; m; m >>= 1) {
+        if (a & m) p ^= b;
+        b = b & 1 ? b >> 1 ^ CRC32C_POLY : b >> 1;
+    }
+    return p;
+}
+
+// CRC of A followed by B from their CRCs and the length of B: the CRC of A
+// is shifted over len_b zero bytes by multiplying with x^(8*len_b)
+static uint32_t crc32c_combine(uint32_t crc_a, uint32_t crc_b, uint64_t len_b) {
+    uint32_t shift = 1u << 31, sq = 1u << 23;   // x^0, x^8
+    for (; len_b; len_b >>= 1, sq = crc_mulmod(sq, sq)) {
+        if (len_b & 1) shift = crc_mulmod(shift, sq);
+    }
+    return crc_mulmod(shift, crc_a) ^ crc_b;
+}
+
+static uint32_t crc32c(const uint8_t *p, size_t n) {
+    return ~crc32c_update(~0u, p, n);
+}
+
+// XXH3-64, as specified by xxHash 0.8 (default secret)
+
+static const uint8_t xxh3_secret[192] = {
+    0xb8, 0xfe, 0x6c, 0x39, 0x23, 0xa4, 0x4b, 0xbe, 0x7c, 0x01, 0x81, 0x2c, 0xf7, 0x21, 0xad, 0x1c,
+    0xde, 0xd4, 0x6d, 0xe9, 0x83, 0x90, 0x97, 0xdb, 0x72, 0x40, 0xa4, 0xa4, 0xb7, 0xb3, 0x67, 0x1f,
+    0xcb, 0x79, 0xe6, 0x4e, 0xcc, 0xc0, 0xe5, 0x78, 0x82, 0x5a, 0xd0, 0x7d, 0xcc, 0xff, 0x72, 0x21,
+    0xb8, 0x08, 0x46, 0x74, 0xf7, 0x43, 0x24, 0x8e, 0xe0, 0x35, 0x90, 0xe6, 0x81, 0x3a, 0x26, 0x4c,
+    0x3c, 0x28, 0x52, 0xbb, 0x91, 0xc3, 0x00, 0xcb, 0x88, 0xd0, 0x65, 0x8b, 0x1b, 0x53, 0x2e, 0xa3,
+    0x71, 0x64, 0x48, 0x97, 0xa2, 0x0d, 0xf9, 0x4e, 0x38, 0x19, 0xef, 0x46, 0xa9, 0xde, 0xac, 0xd8,
+    0xa8, 0xfa, 0x76, 0x3f, 0xe3, 0x9c, 0x34, 0x3f, 0xf9, 0xdc, 0xbb, 0xc7, 0xc7, 0x0b, 0x4f, 0x1d,
+    0x8a, 0x51, 0xe0, 0x4b, 0xcd, 0xb4, 0x59, 0x31, 0xc8, 0x9f, 0x7e, 0xc9, 0xd9, 0x78, 0x73, 0x64,
+    0xea, 0xc5, 0xac, 0x83, 0x34, 0xd3, 0xeb, 0xc3, 0xc5, 0x81, 0xa0, 0xff, 0xfa, 0x13, 0x63, 0xeb,
+    0x17, 0x0d, 0xdd, 0x51, 0xb7, 0xf0, 0xda, 0x49, 0xd3, 0x16, 0x55, 0x26, 0x29, 0xd4, 0x68, 0x9e,
+    0x2b, 0x16, 0xbe, 0x58, 0x7d, 0x47, 0xa1, 0xfc, 0x8f, 0xf8, 0xb8, 0xd1, 0x7a, 0xd0, 0x31, 0xce,
+    0x45, 0xcb, 0x3a, 0x8f, 0x95, 0x16, 0x04, 0x28, 0xaf, 0xd7, 0xfb, 0xca, 0xbb, 0x4b, 0x40, 0x7e,
+};
+
+constexpr uint64_t XXH_P32_1 = 0x9E3779B1U;
+constexpr uint64_t XXH_P32_2 = 0x85EBCA77U;
+constexpr uint64_t XXH_P32_3 = 0xC2B2AE3DU;
+constexpr uint64_t XXH_P64_1 = 0x9E3779B185EBCA87ULL;
+constexpr uint64_t XXH_P64_2 = 0xC2B2AE3D27D4EB4FULL;
+constexpr uint64_t XXH_P64_3 = 0x165667B19E3779F9ULL;
+constexpr uint64_t XXH_P64_4 = 0x85EBCA77C2B2AE63ULL;
+constexpr uint64_t XXH_P64_5 = 0x27D4EB2F165667C5ULL;
+constexpr uint64_t XXH_MX1 = 0x165667919E3779F9ULL;
+constexpr uint64_t XXH_MX2 = 0x9FB21C651E98DF25ULL;
+constexpr size_t XXH_STRIPE = 64;
+constexpr size_t XXH_BLOCK = XXH_STRIPE * (sizeof(xxh3_secret) - XXH_STRIPE) / 8;
+
+static uint64_t rotl64(uint64_t x, int r) {
+    return x << r | x >> (64 - r);
+}
+
+// 64x64 -> 128 bit product, halves folded together
+static uint64_t xxh_fold(uint64_t a, uint64_t b) {
+    u128 m = (u128)a * b;
+    return (uint64_t)m ^ (uint64_t)(m >> 64);
+}
+
+static uint64_t xxh64_avalanche(uint64_t h) {
+    h ^= h >> 33;
+    h *= XXH_P64_2;
+    h ^= h >> 29;
+    h *= XXH_P64_3;
+    return h ^ h >> 32;
+}
+
+static uint64_t xxh3_avalanche(uint64_t h) {
+    h ^= h >> 37;
+    h *= XXH_MX1;
+    return h ^ h >> 32;
+}
+
+static uint64_t xxh3_rrmxmx(uint64_t h, uint64_t len) {
+    h ^= rotl64(h, 49) ^ rotl64(h, 24);
+    h *= XXH_MX2;
+    h ^= (h >> 35) + len;
+    h *= XXH_MX2;
+    return h ^ h >> 28;
+}
+
+static uint64_t xxh3_mix16(const uint8_t *p, const uint8_t *s, uint64_t seed) {
+    return xxh_fold(rd64(p) ^ (rd64(s) + seed), rd64(p + 8) ^ (rd64(s + 8) - seed));
+}
+
+// Inputs of at most 240 bytes
+static uint64_t xxh3_short(const uint8_t *p, size_t len, uint64_t seed) {
+    const uint8_t *s = xxh3_secret;
+    if (len > 128) {
+        uint64_t acc = len * XXH_P64_1;
+        for (size_t i = 0; i < 8; ++i) acc += xxh3_mix16(p + 16 * i, s + 16 * i, seed);
+        uint64_t end = xxh3_mix16(p + len - 16, s + 136 - 17, seed);
+        acc = xxh3_avalanche(acc);
+        for (size_t i = 8; i < len / 16; ++i) end += xxh3_mix16(p + 16 * i, s + 16 * (i - 8) + 3, seed);
+        return xxh3_avalanche(acc + end);
+    }
+    if (len > 16) {
+        uint64_t acc = len * XXH_P64_1;
+        for (size_t i = (len - 1) / 32 + 1; i-- > 0;) {
+            acc += xxh3_mix16(p + 16 * i, s + 32 * i, seed);
+            acc += xxh3_mix16(p + len - 16 * (i + 1), s + 32 * i + 16, seed);
+        }
+        return xxh3_avalanche(acc);
+    }
+    if (len > 8) {
+        uint64_t lo = rd64(p) ^ ((rd64(s + 24) ^ rd64(s + 32)) + seed);
+        uint64_t hi = rd64(p + len - 8) ^ ((rd64(s + 40) ^ rd64(s + 48)) - seed);
+        return xxh3_avalanche(len + __builtin_bswap64(lo) + hi + xxh_fold(lo, hi));
+    }
+    if (len >= 4) {
+        seed ^= (uint64_t)__builtin_bswap32((uint32_t)seed) << 32;
+        uint64_t in = rd32(p + len - 4) + ((uint64_t)rd32(p) << 32);
+        return xxh3_rrmxmx(in ^ ((rd64(s + 8) ^ rd64(s + 16)) - seed), len);
+    }
+    if (len > 0) {
+        uint32_t c = (uint32_t)p[0] << 16 | (uint32_t)p[len >> 1] << 24 | p[len - 1] | (uint32_t)len << 8;
+        return xxh64_avalanche(c ^ ((uint64_t)(rd32(s) ^ rd32(s + 4)) + seed));
+    }
+    return xxh64_avalanche(seed ^ rd64(s + 56) ^ rd64(s + 64));
+}
+
+static void xxh3_accumulate(uint64_t *acc, const uint8_t *p, size_t stripes, const uint8_t *s) {
+    for (size_t n = 0; n < stripes; ++n, p += XXH_STRIPE, s += 8) {
+        for (int i = 0; i < 8; ++i) {
+            uint64_t v = rd64(p + 8 * i), k = v ^ rd64(s + 8 * i);
+            acc[i ^ 1] += v;
+            acc[i] += (uint64_t)(uint32_t)k * (k >> 32);
+        }
+    }
+}
+
+// Inputs over 240 bytes with seed 0: 1 KiB blocks of 16 stripes, each
+// block followed by a scramble of the eight accumulator lanes
+HOT_LOOP
+static bool xxh3_long(const uint8_t *p, size_t len, uint64_t *out) {
+    const uint8_t *s = xxh3_secret;
+    uint64_t acc[8] = {XXH_P32_3, XXH_P64_1, XXH_P64_2, XXH_P64_3,
+                       XXH_P64_4, XXH_P32_2, XXH_P64_5, XXH_P32_1};
+    size_t blocks = (len - 1) / XXH_BLOCK;
+    for (size_t b = 0; b < blocks; ++b) {
+        if (b % (HASH_STEP / XXH_BLOCK) == 0 && g_interrupted) return false;
+        xxh3_accumulate(acc, p + b * XXH_BLOCK, XXH_BLOCK / XXH_STRIPE, s);
+        const uint8_t *k = s + sizeof(xxh3_secret) - XXH_STRIPE;
+        for (int i = 0; i < 8; ++i) acc[i] = (acc[i] ^ acc[i] >> 47 ^ rd64(k + 8 * i)) * XXH_P32_1;
+    }
+    xxh3_accumulate(acc, p + blocks * XXH_BLOCK, (len - 1 - blocks * XXH_BLOCK) / XXH_STRIPE, s);
+    xxh3_accumulate(acc, p + len - XXH_STRIPE, 1, s + sizeof(xxh3_secret) - XXH_STRIPE - 7);
+
+    uint64_t h = len * XXH_P64_1;
+    for (int i = 0; i < 4; ++i) h += xxh_fold(acc[2 * i] ^ rd64(s + 11 + 16 * i), acc[2 * i + 1] ^ rd64(s + 19 + 16 * i));
+    *out = xxh3_avalanche(h);
+    return true;
+}
+
+// MurmurHash3 x86_32
+static uint32_t murmur3_32(const uint8_t *p, size_t len, uint32_t seed) {
+    const uint32_t c1 = 0xcc9e2d51, c2 = 0x1b873593;
+    uint32_t h = seed, k;
+    size_t i = 0;
+    for (; i + 4 <= len; i += 4) {
+        k = rd32(p + i) * c1;
+        h ^= (k << 15 | k >> 17) * c2;
+        h = (h << 13 | h >> 19) * 5 + 0xe6546b64;
+    }
+    k = 0;
+    switch (len & 3) {
+        case 3: k ^= (uint32_t)p[i + 2] << 16; [[fallthrough]];
+        case 2: k ^= (uint32_t)p[i + 1] << 8; [[fallthrough]];
+        case 1:
+            k = (k ^ p[i]) * c1;
+            h ^= (k << 15 | k >> 17) * c2;
+    }
+    h ^= (uint32_t)len;
+    h ^= h >> 16;
+    h *= 0x85ebca6b;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35;
+    return h ^ h >> 16;
+}
+
+// Builtins hashing a value, by argument count (xxh3 and murmur3 take an
+// optional seed)
+static bool is_hash_func(const char *name, int nargs) {
+    if (nargs == 1 && strcmp(name, "crc32c") == 0) return true;
+    return (nargs == 1 || nargs == 2) && (strcmp(name, "xxh3") == 0 || strcmp(name, "murmur3") == 0);
+}
+
+// A builtin accepted by is_hash_func on exact 64-bit arguments
+static bool hash_func(const char *name, int nargs, const uint64_t *arg, uint64_t *out) {
+    uint8_t bytes[8];
+    for (int i = 0; i < 8; ++i) bytes[i] = (uint8_t)(arg[0] >> 8 * i);
+    uint64_t seed = nargs == 2 ? arg[1] : 0;
+    if (name[0] == 'c') {
+        *out = crc32c(bytes, 8);
+    } else if (name[0] == 'x') {
+        *out = xxh3_short(bytes, 8, seed);
+    } else if (seed > UINT32_MAX) {
+        eval_error("murmur3: seed must be below 2^32\n");
+        return false;
+    } else {
+        *out = murmur3_32(bytes, 8, (uint32_t)seed);
+    }
+    return true;
+}
+
+typedef struct {
+    const uint8_t *p;
+    size_t len;
+    uint32_t crc;
+    bool done;
+} CrcJob;
+
+static void *crc_worker(void *arg) {
+    CrcJob *job = arg;
+    uint32_t c = ~0u;
+    for (size_t off = 0; off < job->len; off += HASH_STEP) {
+        if (g_interrupted) return nullptr;
+        size_t n = job->len - off < HASH_STEP ? job->len - off : HASH_STEP;
+        c = crc32c_update(c, job->p + off, n);
+    }
+    job->crc = ~c;
+    job->done = true;
+    return arg;
+}
+
+// CRC32C of a buffer, in equal shares across the CPUs
+static bool crc32c_parallel(const uint8_t *p, size_t len, uint32_t *out) {
+    long cpus = g_in_preview ? 1 : sysconf(_SC_NPROCESSORS_ONLN);
+    size_t nthreads = cpus < 1 ? 1 : cpus > HASH_THREADS ? HASH_THREADS : (size_t)cpus;
+    if (nthreads > len / CRC_THREAD_MIN) nthreads = len / CRC_THREAD_MIN ? len / CRC_THREAD_MIN : 1;
+
+    CrcJob jobs[HASH_THREADS];
+    pthread_t tids[HASH_THREADS];
+    bool started[HASH_THREADS] = {};
+    size_t share = len / nthreads;
+    for (size_t t = 0; t < nthreads; ++t) {
+        jobs[t] = (CrcJob){.p = p + t * share, .len = t + 1 < nthreads ? share : len - t * share};
+    }
+    for (size_t t = 1; t < nthreads; ++t) {
+        started[t] = pthread_create(&tids[t], nullptr, crc_worker, &jobs[t]) == 0;
+        if (!started[t]) crc_worker(&jobs[t]);
+    }
+    crc_worker(&jobs[0]);
+    uint32_t crc = jobs[0].crc;
+    bool ok = jobs[0].done;
+    for (size_t t = 1; t < nthreads; ++t) {
+        if (started[t]) pthread_join(tids[t], nullptr);
+        ok = ok && jobs[t].done;
+        crc = crc32c_combine(crc, jobs[t].crc, jobs[t].len);
+    }
+    *out = crc;
+    return ok;
+}
+
+// Last file hashed, so the exact pass and repeated lines don't reread it
+static struct {
+    char name[16];
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    struct timespec mtime;
+    uint64_t value;
+    bool valid;
+} hash_cache;
+
+// Open the file named by string node `path`; errors are reported for `name`
+static int open_file(const char *name, const Node *path, struct stat *st) {
+    if (g_no_files) {
+        eval_error("%s: file access is disabled\n", name);
+        return -1;
+    }
+    char *file = strndup(path->lit, path->lit_len);
+    if (!file) return -1;
+    int fd = open(file, O_RDONLY);
+    if (fd < 0 || fstat(fd, st) != 0) {
+        eval_error("%s: %s: %s\n", name, file, strerror(errno));
+        if (fd >= 0) close(fd);
+        fd = -1;
+    }
+    free(file);
+    return fd;
+}
+
+// Map an open file read-only for a sequential pass and close it. An empty
+// file maps to nullptr.
+static bool map_file(const char *name, int fd, size_t len, const uint8_t **map) {
+    const uint8_t *p = len ? mmap(nullptr, len, PROT_READ, MAP_PRIVATE, fd, 0) : nullptr;
+    close(fd);
+    if (p == MAP_FAILED) {
+        eval_error("%s: %s\n", name, strerror(errno));
+        return false;
+    }
+    if (len) madvise((void *)p, len, MADV_SEQUENTIAL);
+    *map = p;
+    return true;
+}
+
+// crc32c_file("path") and xxh3_file("path")
+static bool file_hash(const char *name, const Node *path, uint64_t *out) {
+    bool crc = strcmp(name, "crc32c_file") == 0;
+    if (!crc && strcmp(name, "xxh3_file") != 0) {
+        eval_error("%s: does not take a string\n", name);
+        return false;
+    }
+    struct stat st;
+    int fd = open_file(name, path, &st);
+    if (fd < 0) return false;
+    if (hash_cache.valid && strcmp(hash_cache.name, name) == 0 && hash_cache.dev == st.st_dev &&
+        hash_cache.ino == st.st_ino && hash_cache.size == st.st_size &&
+        hash_cache.mtime.tv_sec == st.st_mtim.tv_sec && hash_cache.mtime.tv_nsec == st.st_mtim.tv_nsec) {
+        close(fd);
+        *out = hash_cache.value;
+        return true;
+    }
+    if (g_in_preview && (uint64_t)st.st_size > PREVIEW_FILE_MAX) {
+        close(fd);
+        return false;
+    }
+
+    size_t len = (size_t)st.st_size;
+    const uint8_t *map;
+    if (!map_file(name, fd, len, &map)) return false;
+
+    bool ok = true;
+    if (crc) {
+        uint32_t c = 0;
+        ok = len == 0 || crc32c_parallel(map, len, &c);
+        *out = c;
+    } else if (len > 240) {
+        ok = xxh3_long(map, len, out);
+    } else {
+        *out = xxh3_short(map, len, 0);
+    }
+    if (len) munmap((void *)map, len);
+    if (!ok) return false;
+
+    hash_cache.valid = true;
+    strcpy(hash_cache.name, name);
+    hash_cache.dev = st.st_dev;
+    hash_cache.ino = st.st_ino;
+    hash_cache.size = st.st_size;
+    hash_cache.mtime = st.st_mtim;
+    hash_cache.value = *out;
+    return true;
+}
+
+// ============================================================================
+// Evaluation
+// ============================================================================
+
+// Set when an integer operation leaves the 64-bit range, so the result is
+// recomputed exactly (see Big integers)
+static bool g_int_overflow = false;
+
+// Out of range (or nan) converts to 0 rather than the undefined cast; the
+// exact pass then redoes the operation
+static uint64_t to_u64(double v) {
+    if (!(v >= -9223372036854775808.0 && v < 18446744073709551616.0)) {
+        g_int_overflow = true;
+        return 0;
+    }
+    return v < 0 ? (uint64_t)(int64_t)v : (uint64_t)v;
+}
+
+// Number-theory function whose argument was past 2^53: the double may not
+// be the exact value, so the result has to come from the exact pass
+static const char *g_exact_arg = nullptr;
+
+// Integer argument of a number-theory function
+static bool exact_u64(const char *name, double v, uint64_t *out) {
+    if (!(v >= 0) || v != floor(v)) {
+        eval_error("%s: expects a non-negative integer\n", name);
+        return false;
+    }
+    if (v >= 9007199254740992.0) {
+        g_int_overflow = true;
+        g_exact_arg = name;
+        return false;
+    }
+    *out = (uint64_t)v;
+    return true;
+}
+
+static double shift_op(char op, double left, double right) {
+    uint64_t l = to_u64(left);
+    int r = (int)right;
+    if (r < 0 || r >= 64) {
+        g_int_overflow = true;
+        return 0.0;
+    }
+    return op == 'L' ? (double)(l << r) : (double)(l >> r);
+}
+
+static double binary_op(char op, double left, double right) {
+    switch (op) {
+        case '+': return left + right;
+        case '-': return left - right;
+        case '*': return left * right;
+        case '/': return left / right;
+        case '%': return fmod(left, right);
+        case '^': return pow(left, right);
+        case 'L': case 'R': return shift_op(op, left, right);
+        case '&': return (double)(to_u64(left) & to_u64(right));
+        case '|': return (double)(to_u64(left) | to_u64(right));
+    }
+    return NAN;
+}
+
+// Modular functions on exact integers; results past 2^53 come from the
+// exact pass
+static double call_modular(const char *name, int nargs, const double *args) {
+    uint64_t a[3], r;
+    for (int i = 0; i < nargs; ++i) {
+        if (!exact_u64(name, args[i], &a[i])) return NAN;
+    }
+    if (!modular(name, nargs, a, &r)) return NAN;
+    if (r >= 9007199254740992ULL) g_int_overflow = true;
+    return (double)r;
+}
+
+// Bit-manipulation and hash functions (bit_func, hash_func), likewise on
+// exact integers
+typedef bool U64Fn(const char *name, int nargs, const uint64_t *arg, uint64_t *out);
+
+static double call_bits(U64Fn *fn, const char *name, int nargs, const double *args) {
+    uint64_t a[3], r;
+    for (int i = 0; i < nargs; ++i) {
+        if (!exact_u64(name, args[i], &a[i])) return NAN;
+    }
+    if (!fn(name, nargs, a, &r)) return NAN;
+    if (r >= 9007199254740992ULL) g_int_overflow = true;
+    return (double)r;
+}
+
+// A builtin taking a string: the file hashes
+static double call_strfn(const Expr *e, const Node *nd) {
+    const char *name = e->names + nd->name;
+    uint64_t r;
+    if (strcmp(name, "file") == 0 || strcmp(name, "blob") == 0) {
+        eval_error("buffer where a number is expected\n");
+        return NAN;
+    }
+    if (nd->nargs != 1) {
+        eval_error("%s: expects one argument\n", name);
+        return NAN;
+    }
+    if (!file_hash(name, &e->nodes[nd->args[0]], &r)) return NAN;
+    if (r >= 9007199254740992ULL) g_int_overflow = true;
+    return (double)r;
+}
+
+// Two-argument functions
+static double call_func2(const char *name, double arg1, double arg2) {
+    if (strcmp(name, "bxor") == 0) return (double)(to_u64(arg1) ^ to_u64(arg2));
+    if (strcmp(name, "band") == 0) return (double)(to_u64(arg1) & to_u64(arg2));
+    if (strcmp(name, "bor") == 0) return (double)(to_u64(arg1) | to_u64(arg2));
+    if (strcmp(name, "shl") == 0) return shift_op('L', arg1, arg2);
+    if (strcmp(name, "shr") == 0) return shift_op('R', arg1, arg2);
+    if (strcmp(name, "pow") == 0) return pow(arg1, arg2);
+    if (strcmp(name, "mod") == 0) return fmod(arg1, arg2);
+    if (strcmp(name, "atan2") == 0) return atan2(arg1, arg2);
+    if (strcmp(name, "max") == 0) return fmax(arg1, arg2);
+    if (strcmp(name, "min") == 0) return fmin(arg1, arg2);
+
+    // Number theory
+    if (strcmp(name, "gcd") == 0 || strcmp(name, "lcm") == 0) {
+        uint64_t a, b, l;
+        if (!exact_u64(name, fabs(arg1), &a) || !exact_u64(name, fabs(arg2), &b)) return NAN;
+        uint64_t g = gcd_u64(a, b);
+        if (name[0] == 'g' || g == 0) return (double)g;
+        if (__builtin_mul_overflow(a / g, b, &l)) {
+            g_int_overflow = true;
+            return (double)(a / g) * (double)b;
+        }
+        return (double)l;
+    }
+    if (strcmp(name, "modinv") == 0) return call_modular(name, 2, (double[]){arg1, arg2});
+
+    // Primes in [a, b]: counted here, listed when it is the whole expression
+    if (strcmp(name, "primes") == 0) {
+        uint64_t a, b, count;
+        if (!exact_u64(name, arg1, &a) || !exact_u64(name, arg2, &b)) return NAN;
+        if (g_in_preview && b - a > PREVIEW_SIEVE_MAX) return NAN;
+        if (b >= SIEVE_MAX) {
+            eval_error("primes: range must end below 2^50\n");
+            return NAN;
+        }
+        g_primes_lo = a;
+        g_primes_hi = b;
+        return sieve_count(a, b, &count) ? (double)count : NAN;
+    }
+    if (is_bit_func(name, 2)) return call_bits(bit_func, name, 2, (double[]){arg1, arg2});
+    if (is_hash_func(name, 2)) return call_bits(hash_func, name, 2, (double[]){arg1, arg2});
+    return NAN;
+}
+
+// Three-argument functions
+static double call_func3(const char *name, double arg1, double arg2, double arg3) {
+    if (strcmp(name, "modpow") == 0 || strcmp(name, "mulmod") == 0) {
+        return call_modular(name, 3, (double[]){arg1, arg2, arg3});
+    }
+    if (is_bit_func(name, 3)) return call_bits(bit_func, name, 3, (double[]){arg1, arg2, arg3});
+    eval_error("unknown function: %s\n", name);
+    return NAN;
+}
+
+// Built-in functions
+static double call_func(const char *name, double arg) {
+    // Math functions
+    if (strcmp(name, "sin") == 0) return sin(arg);
+    if (strcmp(name, "cos") == 0) return cos(arg);
+    if (strcmp(name, "tan") == 0) return tan(arg);
+    if (strcmp(name, "asin") == 0) return asin(arg);
+    if (strcmp(name, "acos") == 0) return acos(arg);
+    if (strcmp(name, "atan") == 0) return atan(arg);
+    if (strcmp(name, "sinh") == 0) return sinh(arg);
+    if (strcmp(name, "cosh") == 0) return cosh(arg);
+    if (strcmp(name, "tanh") == 0) return tanh(arg);
+    if (strcmp(name, "exp") == 0) return exp(arg);
+    if (strcmp(name, "log") == 0) return log(arg);
+    if (strcmp(name, "log10") == 0) return log10(arg);
+    if (strcmp(name, "log2") == 0) return log2(arg);
+    if (strcmp(name, "sqrt") == 0) return sqrt(arg);
+    if (strcmp(name, "cbrt") == 0) return cbrt(arg);
+    if (strcmp(name, "abs") == 0) return fabs(arg);
+    if (strcmp(name, "floor") == 0) return floor(arg);
+    if (strcmp(name, "ceil") == 0) return ceil(arg);
+    if (strcmp(name, "round") == 0) return round(arg);
+    if (strcmp(name, "ln") == 0) return log(arg);
+    if (strcmp(name, "factorial") == 0) return tgamma(arg + 1);
+
+    // Bitwise functions
+    if (strcmp(name, "bnot") == 0) return (double)(~to_u64(arg));
+    if (strcmp(name, "not8") == 0) return (double)((uint8_t)~to_u64(arg));
+    if (strcmp(name, "not16") == 0) return (double)((uint16_t)~to_u64(arg));
+    if (strcmp(name, "not32") == 0) return (double)((uint32_t)~to_u64(arg));
+
+    // Programmer functions - format converters (set output format)
+    if (strcmp(name, "hex") == 0) { g_output_fmt = FMT_HEX; return arg; }
+    if (strcmp(name, "bin") == 0) { g_output_fmt = FMT_BIN; return arg; }
+    if (strcmp(name, "oct") == 0) { g_output_fmt = FMT_OCT; return arg; }
+    if (strcmp(name, "dec") == 0) { g_output_fmt = FMT_DEC; return arg; }
+    if (strcmp(name, "factor") == 0) { g_output_fmt = FMT_FACTOR; return arg; }
+
+    // Number theory on exact integers
+    if (strcmp(name, "isprime") == 0 || strcmp(name, "nextprime") == 0 ||
+        strcmp(name, "totient") == 0) {
+        uint64_t n, p;
+        if (!exact_u64(name, arg, &n)) return NAN;
+        if (name[0] == 'i') return is_prime_u64(n) ? 1.0 : 0.0;
+        if (name[0] == 't') return (double)totient_u64(n);
+        if (next_prime_u64(n, &p)) return (double)p;
+        eval_error("nextprime: no 64-bit prime above %" PRIu64 "\n", n);
+        return NAN;
+    }
+    if (strcmp(name, "primepi") == 0 || strcmp(name, "nthprime") == 0) {
+        uint64_t n, r;
+        if (!exact_u64(name, arg, &n)) return NAN;
+        if (g_in_preview && n > PREVIEW_SIEVE_MAX / 20) return NAN;
+        return prime_count_fn(name, n, &r) ? (double)r : NAN;
+    }
+
+    // Byte conversions - convert TO these units
+    if (strcmp(name, "toKiB") == 0 || strcmp(name, "tokib") == 0) return arg / KiB;
+    if (strcmp(name, "toMiB") == 0 || strcmp(name, "tomib") == 0) return arg / MiB;
+    if (strcmp(name, "toGiB") == 0 || strcmp(name, "togib") == 0) return arg / GiB;
+    if (strcmp(name, "toTiB") == 0 || strcmp(name, "totib") == 0) return arg / TiB;
+    if (strcmp(name, "toKB") == 0 || strcmp(name, "tokb") == 0) return arg / KB;
+    if (strcmp(name, "toMB") == 0 || strcmp(name, "tomb") == 0) return arg / MB;
+    if (strcmp(name, "toGB") == 0 || strcmp(name, "togb") == 0) return arg / GB;
+    if (strcmp(name, "toTB") == 0 || strcmp(name, "totb") == 0) return arg / TB;
+
+    // Bit manipulation
+    if (is_bit_func(name, 1)) return call_bits(bit_func, name, 1, &arg);
+
+    // Hashes of the value's 8 bytes
+    if (is_hash_func(name, 1)) return call_bits(hash_func, name, 1, &arg);
+
+    eval_error("unknown function: %s\n", name);
+    return NAN;
+}
+
+static double call_varfn(const Expr *e, const Node *nd);
+static bool buf_reduction(const Expr *e, const Node *nd);
+static double buf_reduce(const Expr *e, const Node *nd);
+
+// Builtins reading files or buffers rather than numbers (file hashes,
+// popcount and hamming of buffers); other evaluators take them as constants
+static bool data_call(const Expr *e, const Node *nd) {
+    return e->nodes[nd->args[0]].kind == N_STR || buf_reduction(e, nd);
+}
+
+static double call_data(const Expr *e, const Node *nd) {
+    return e->nodes[nd->args[0]].kind == N_STR ? call_strfn(e, nd) : buf_reduce(e, nd);
+}
+
+static double eval_node(const Expr *e, int n);
+
+static double eval_call(const Expr *e, const Node *nd) {
+    const char *name = e->names + nd->name;
+    if (nd->nargs == 4 || strcmp(name, "diff") == 0) return call_varfn(e, nd);
+    if (data_call(e, nd)) return call_data(e, nd);
+    double arg1 = eval_node(e, nd->args[0]);
+    if (nd->nargs == 1) return call_func(name, arg1);
+    double arg2 = eval_node(e, nd->args[1]);
+    if (nd->nargs == 2) return call_func2(name, arg1, arg2);
+    double arg3 = eval_node(e, nd->args[2]);
+    if (nd->nargs == 3) return call_func3(name, arg1, arg2, arg3);
+    eval_error("unknown function: %s\n", name);
+    return NAN;
+}
+
+// Anything that may be a rounded integer (a long literal, a variable or
+// result past 2^53, factorial(200) overflowing to inf) sets g_int_overflow
+// so evaluate_tree retries the tree exactly
+static double eval_node(const Expr *e, int n) {
+    const Node *nd = &e->nodes[n];
+    switch ((NodeKind)nd->kind) {
+        case N_NUM:
+            if (nd->inexact) g_int_overflow = true;
+            return nd->num;
+        case N_VAR: {
+            double val = get_var(e->names + nd->name);
+            if (fabs(val) >= 9007199254740992.0) g_int_overflow = true;
+            return val;
+        }
+        case N_NEG:
+            return -eval_node(e, nd->args[0]);
+        case N_NOT:
+            return (double)(~to_u64(eval_node(e, nd->args[0])));
+        case N_BIN: {
+            double left = eval_node(e, nd->args[0]);
+            double right = eval_node(e, nd->args[1]);
+            double val = binary_op(nd->op, left, right);
+            if (fabs(val) >= 9007199254740992.0) g_int_overflow = true;  // past exact range
+            return val;
+        }
+        case N_CALL: {
+            double val = eval_call(e, nd);
+            if (!(fabs(val) < 9007199254740992.0)) g_int_overflow = true;  // also inf, nan
+            return val;
+        }
+        case N_MAT:
+            eval_error("matrix where a number is expected\n");
+            return NAN;
+        case N_STR:
+            eval_error("string where a number is expected\n");
+            return NAN;
+    }
+    return NAN;
+}
+
+// ============================================================================
+// Batch evaluation
+// ============================================================================
+
+// integrate(), solve() and minimize() evaluate an expression as a function
+// of one of its variables, and --mc of several. The tree is evaluated a
+// batch of points at a time, node by node, so the arithmetic runs as loops
+// over arrays; the free variables read columns of point values. The other
+// variables and the plain math functions are resolved once up front. A tree
+// using only those and arithmetic touches no shared state and can run on
+// several threads; any other builtin (modular caches, the sieve, output
+// formats, error and overflow flags) or bit operator makes it serial.
+
+constexpr int VARFN_BATCH = 64;          // points per batch evaluation
+constexpr int VARFN_MAX_COLS = 64;
+
+typedef double (*MathFn)(double);
+typedef double (*MathFn2)(double, double);
+
+typedef struct {
+    double value;              // N_VAR: any other variable, read once
+    MathFn fn;                 // N_CALL: 1-argument math function, if plain
+    MathFn2 fn2;               // N_CALL: 2-argument math function, if plain
+    int col;                   // N_VAR, N_CALL: reads this column, or -1
+} VarNode;
+
+typedef struct {
+    const Expr *e;
+    int root;
+    const char *vars[VARFN_MAX_COLS];   // free variables: vars[i] reads column i
+    int nvars;
+    VarNode *nodes;            // indexed like e->nodes
+    bool serial;               // uses shared state: evaluate on one thread
+} VarFn;
+
+static MathFn plain_math_fn(const char *name) {
+    static const struct { const char *name; MathFn fn; } fns[] = {
+        {"sin", sin}, {"cos", cos}, {"tan", tan}, {"asin", asin}, {"acos", acos},
+        {"atan", atan}, {"sinh", sinh}, {"cosh", cosh}, {"tanh", tanh},
+        {"exp", exp}, {"log", log}, {"ln", log}, {"log10", log10}, {"log2", log2},
+        {"sqrt", sqrt}, {"cbrt", cbrt}, {"abs", fabs}, {"floor", floor},
+        {"ceil", ceil}, {"round", round},
+    };
+    for (size_t i = 0; i < sizeof(fns) / sizeof(fns[0]); ++i) {
+        if (strcmp(name, fns[i].name) == 0) return fns[i].fn;
+    }
+    return nullptr;
+}
+
+static MathFn2 plain_math_fn2(const char *name) {
+    static const struct { const char *name; MathFn2 fn; } fns[] = {
+        {"pow", pow}, {"mod", fmod}, {"atan2", atan2}, {"max", fmax}, {"min", fmin},
+    };
+    for (size_t i = 0; i < sizeof(fns) / sizeof(fns[0]); ++i) {
+        if (strcmp(name, fns[i].name) == 0) return fns[i].fn;
+    }
+    return nullptr;
+}
+
+static bool varfn_init(VarFn *f, const Expr *e, int root) {
+    *f = (VarFn){.e = e, .root = root};
+    f->nodes = malloc((size_t)e->count * sizeof *f->nodes);
+    if (!f->nodes) return false;
+    for (int i = 0; i < e->count; ++i) f->nodes[i] = (VarNode){.col = -1};
+    return true;
+}
+
+static bool varfn_prepare(VarFn *f, int n) {
+    const Node *nd = &f->e->nodes[n];
+    VarNode *q = &f->nodes[n];
+    const char *name = f->e->names + nd->name;
+    switch ((NodeKind)nd->kind) {
+        case N_NUM:
+            return true;
+        case N_VAR:
+            for (int i = 0; i < f->nvars; ++i) {
+                if (strcmp(name, f->vars[i]) == 0) q->col = i;
+            }
+            if (q->col < 0) q->value = get_var(name);
+            return true;
+        case N_CALL:
+            if (q->col >= 0) return true;      // a column set up by the caller
+            if (nd->nargs == 4 || strcmp(name, "diff") == 0 || data_call(f->e, nd)) {
+                eval_error("%s: cannot be used inside integrate/solve/minimize\n", name);
+                return false;
+            }
+            if (nd->nargs == 1) q->fn = plain_math_fn(name);
+            if (nd->nargs == 2) q->fn2 = plain_math_fn2(name);
+            if (!q->fn && !q->fn2) f->serial = true;
+            break;
+        case N_NOT:
+            f->serial = true;           // to_u64 sets g_int_overflow
+            break;
+        case N_BIN:
+            if (nd->op == 'L' || nd->op == 'R' || nd->op == '&' || nd->op == '|') f->serial = true;
+            break;
+        case N_MAT:
+            eval_error("matrix where a number is expected\n");
+            return false;
+        case N_STR:
+            eval_error("string where a number is expected\n");
+            return false;
+        default:
+            break;
+    }
+    for (int i = 0; i < nd->nargs; ++i) {
+        if (!varfn_prepare(f, nd->args[i])) return false;
+    }
+    return true;
+}
+
+// Node n at count (<= VARFN_BATCH) points, given the free variables' columns
+HOT_LOOP
+static void varfn_batch(const VarFn *f, int n, int count, const double *const *x, double *out) {
+    const Node *nd = &f->e->nodes[n];
+    const VarNode *q = &f->nodes[n];
+    double b[VARFN_BATCH], c[VARFN_BATCH];
+
+    switch ((NodeKind)nd->kind) {
+        case N_NUM:
+            for (int i = 0; i < count; ++i) out[i] = nd->num;
+            return;
+        case N_VAR:
+            for (int i = 0; i < count; ++i) out[i] = q->col >= 0 ? x[q->col][i] : q->value;
+            return;
+        case N_NEG:
+            varfn_batch(f, nd->args[0], count, x, out);
+            for (int i = 0; i < count; ++i) out[i] = -out[i];
+            return;
+        case N_NOT:
+            varfn_batch(f, nd->args[0], count, x, out);
+            for (int i = 0; i < count; ++i) out[i] = (double)(~to_u64(out[i]));
+            return;
+        case N_BIN:
+            varfn_batch(f, nd->args[0], count, x, out);
+            varfn_batch(f, nd->args[1], count, x, b);
+            switch (nd->op) {
+                case '+': for (int i = 0; i < count; ++i) out[i] += b[i]; return;
+                case '-': for (int i = 0; i < count; ++i) out[i] -= b[i]; return;
+                case '*': for (int i = 0; i < count; ++i) out[i] *= b[i]; return;
+                case '/': for (int i = 0; i < count; ++i) out[i] /= b[i]; return;
+            }
+            for (int i = 0; i < count; ++i) out[i] = binary_op(nd->op, out[i], b[i]);
+            return;
+        case N_CALL: {
+            const char *name = f->e->names + nd->name;
+            if (q->col >= 0) {
+                memcpy(out, x[q->col], (size_t)count * sizeof *out);
+                return;
+            }
+            varfn_batch(f, nd->args[0], count, x, out);
+            if (nd->nargs == 1) {
+                for (int i = 0; i < count; ++i) out[i] = q->fn ? q->fn(out[i]) : call_func(name, out[i]);
+                return;
+            }
+            varfn_batch(f, nd->args[1], count, x, b);
+            if (nd->nargs == 2) {
+                for (int i = 0; i < count; ++i) out[i] = q->fn2 ? q->fn2(out[i], b[i]) : call_func2(name, out[i], b[i]);
+                return;
+            }
+            varfn_batch(f, nd->args[2], count, x, c);
+            for (int i = 0; i < count; ++i) out[i] = call_func3(name, out[i], b[i], c[i]);
+            return;
+        }
+        case N_MAT:     // rejected by varfn_prepare
+        case N_STR:
+            for (int i = 0; i < count; ++i) out[i] = NAN;
+            return;
+    }
+}
+
+// The expression at any number of points, quietly
+static void varfn_eval(const VarFn *f, int count, const double *x, double *out) {
+    bool quiet = g_quiet;
+    g_quiet = true;
+    for (int done = 0; done < count; done += VARFN_BATCH) {
+        int m = count - done < VARFN_BATCH ? count - done : VARFN_BATCH;
+        const double *col = x + done;
+        varfn_batch(f, f->root, m, &col, out + done);
+    }
+    g_quiet = quiet;
+}
+
+static double varfn_at(const VarFn *f, double x) {
+    double y;
+    varfn_eval(f, 1, &x, &y);
+    return y;
+}
+
+// Set up fn(expr, x, a, b) and evaluate it once at probe, so errors in the
+// expression are reported once rather than from every point
+static bool varfn_open(VarFn *f, const Expr *e, const Node *nd, double probe) {
+    const char *name = e->names + nd->name;
+    const Node *var = &e->nodes[nd->args[1]];
+    if (var->kind != N_VAR) {
+        eval_error("%s: second argument must be a variable name\n", name);
+        return false;
+    }
+    if (!varfn_init(f, e, nd->args[0])) {
+        eval_error("%s: out of memory\n", name);
+        return false;
+    }
+    f->vars[f->nvars++] = e->names + var->name;
+
+    char prev_error[sizeof(g_error)];
+    memcpy(prev_error, g_error, sizeof(g_error));
+    g_error[0] = '\0';
+    if (varfn_prepare(f, f->root)) {
+        double y;
+        const double *col = &probe;
+        varfn_batch(f, f->root, 1, &col, &y);
+        if (!g_error[0]) {
+            memcpy(g_error, prev_error, sizeof(g_error));
+            return true;
+        }
+    }
+    free(f->nodes);
+    return false;
+}
+
+// ============================================================================
+// Numerical integration
+// ============================================================================
+
+// integrate(expr, x, a, b) by adaptive Gauss-Kronrod (7-point Gauss inside
+// 15-point Kronrod). Each round bisects the subintervals with the largest
+// error estimates and spreads their points over threads. Infinite limits
+// are mapped onto a finite range.
+
+constexpr int QUAD_SPLIT = 64;           // most subintervals bisected per round
+constexpr int QUAD_MAX_INTERVALS = 8192;
+constexpr int QUAD_THREADS = 64;
+constexpr int QUAD_PAR_POINTS = 960;     // fewer points are evaluated inline
+constexpr double QUAD_REL_TOL = 1e-10;
+
+// Kronrod nodes (odd entries are the Gauss nodes) and weights
+static const double quad_xk[8] = {
+    0.991455371120812639206854697526329, 0.949107912342758524526189684047851,
+    0.864864423359769072789712788640926, 0.741531185599394439863864773280788,
+    0.586087235467691130294144845693013, 0.405845151377397166906606412076961,
+    0.207784955007898467600689403773245, 0.0,
+};
+static const double quad_wk[8] = {
+    0.022935322010529224963732008058970, 0.063092092629978553290700663189204,
+    0.104790010322250183839876322541518, 0.140653259715525918745189590510238,
+    0.169004726639267902826583426598550, 0.190350578064785409913256402421014,
+    0.204432940075298892414161999234649, 0.209482141084727828012999174891714,
+};
+static const double quad_wg[4] = {
+    0.129484966168869693270611432679082, 0.279705391489276667901467771423780,
+    0.381830050505118944950369775488975, 0.417959183673469387755102040816327,
+};
+
+typedef enum { QUAD_FINITE, QUAD_UPPER_INF, QUAD_LOWER_INF, QUAD_BOTH_INF } QuadMap;
+
+typedef struct {
+    VarFn fn;
+    QuadMap map;
+    double origin;             // finite limit of a half-infinite range
+} Integrand;
+
+typedef struct {
+    double a, b;               // in the mapped variable
+    double val, err, absval;
+} QuadInterval;
+
+// Integrand times the Jacobian of the range mapping at points t
+static void quad_points(const Integrand *f, const double *t, double *fx, int count) {
+    for (int done = 0; done < count; done += VARFN_BATCH) {
+        int m = count - done < VARFN_BATCH ? count - done : VARFN_BATCH;
+        double x[VARFN_BATCH], jac[VARFN_BATCH];
+        for (int i = 0; i < m; ++i) {
+            double u = t[done + i];
+            switch (f->map) {
+                case QUAD_FINITE:    x[i] = u; jac[i] = 1.0; break;
+                case QUAD_UPPER_INF: x[i] = f->origin + (1 - u) / u; jac[i] = 1 / (u * u); break;
+                case QUAD_LOWER_INF: x[i] = f->origin - (1 - u) / u; jac[i] = 1 / (u * u); break;
+                case QUAD_BOTH_INF:
+                    x[i] = u / (1 - u * u);
+                    jac[i] = (1 + u * u) / ((1 - u * u) * (1 - u * u));
+                    break;
+            }
+        }
+        varfn_batch(&f->fn, f->fn.root, m, (const double *const[]){x}, fx + done);
+        if (f->map != QUAD_FINITE) {
+            for (int i = 0; i < m; ++i) fx[done + i] *= jac[i];
+        }
+    }
+}
+
+typedef struct {
+    const Integrand *f;
+    const double *t;
+    double *fx;
+    int count;
+} QuadJob;
+
+static void *quad_worker(void *arg) {
+    QuadJob *job = arg;
+    quad_points(job->f, job->t, job->fx, job->count);
+    return nullptr;
+}
+
+// Evaluate count points, over several threads when there are enough and
+// the integrand allows it
+static void quad_eval(const Integrand *f, const double *t, double *fx, int count) {
+    long cpus = g_in_preview || f->fn.serial ? 1 : sysconf(_SC_NPROCESSORS_ONLN);
+    int nthreads = count / QUAD_PAR_POINTS + 1;
+    if (nthreads > cpus) nthreads = cpus < 1 ? 1 : (int)cpus;
+    if (nthreads > QUAD_THREADS) nthreads = QUAD_THREADS;
+
+    QuadJob jobs[QUAD_THREADS];
+    pthread_t tids[QUAD_THREADS];
+    bool started[QUAD_THREADS] = {};
+    int chunk = (count + nthreads - 1) / nthreads;
+    for (int i = 0; i < nthreads; ++i) {
+        int first = i * chunk, n = count - first < chunk ? count - first : chunk;
+        jobs[i] = (QuadJob){.f = f, .t = t + first, .fx = fx + first, .count = n > 0 ? n : 0};
+    }
+    for (int i = 1; i < nthreads; ++i) {
+        started[i] = pthread_create(&tids[i], nullptr, quad_worker, &jobs[i]) == 0;
+        if (!started[i]) quad_worker(&jobs[i]);
+    }
+    quad_worker(&jobs[0]);
+    for (int i = 1; i < nthreads; ++i) {
+        if (started[i]) pthread_join(tids[i], nullptr);
+    }
+}
+
+// The 15 Kronrod points of [a, b]
+static void quad_nodes(const QuadInterval *iv, double *t) {
+    double c = 0.5 * (iv->a + iv->b), h = 0.5 * (iv->b - iv->a);
+    for (int j = 0; j < 7; ++j) {
+        t[2 * j] = c - h * quad_xk[j];
+        t[2 * j + 1] = c + h * quad_xk[j];
+    }
+    t[14] = c;
+}
+
+// Kronrod value and error estimate (scaled as in QUADPACK's qk15)
+static void quad_rule(QuadInterval *iv, const double *fx) {
+    double h = 0.5 * (iv->b - iv->a);
+    double fc = fx[14];
+    double resk = quad_wk[7] * fc, resg = quad_wg[3] * fc, resabs = fabs(resk);
+    for (int j = 0; j < 7; ++j) {
+        double sum = fx[2 * j] + fx[2 * j + 1];
+        resk += quad_wk[j] * sum;
+        resabs += quad_wk[j] * (fabs(fx[2 * j]) + fabs(fx[2 * j + 1]));
+        if (j & 1) resg += quad_wg[j / 2] * sum;
+    }
+    double mean = 0.5 * resk;
+    double resasc = quad_wk[7] * fabs(fc - mean);
+    for (int j = 0; j < 7; ++j) {
+        resasc += quad_wk[j] * (fabs(fx[2 * j] - mean) + fabs(fx[2 * j + 1] - mean));
+    }
+    double err = fabs((resk - resg) * h);
+    resasc *= fabs(h);
+    if (resasc != 0 && err != 0) err = resasc * fmin(1.0, pow(200 * err / resasc, 1.5));
+    iv->val = resk * h;
+    iv->err = err;
+    iv->absval = resabs * fabs(h);
+}
+
+// Subintervals are kept in a max-heap on their error estimate
+static void quad_push(QuadInterval *heap, int *count, QuadInterval iv) {
+    int i = (*count)++;
+    while (i > 0 && heap[(i - 1) / 2].err < iv.err) {
+        heap[i] = heap[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+    heap[i] = iv;
+}
+
+static QuadInterval quad_pop(QuadInterval *heap, int *count) {
+    QuadInterval top = heap[0], last = heap[--*count];
+    int i = 0;
+    for (;;) {
+        int c = 2 * i + 1;
+        if (c >= *count) break;
+        if (c + 1 < *count && heap[c + 1].err > heap[c].err) ++c;
+        if (heap[c].err <= last.err) break;
+        heap[i] = heap[c];
+        i = c;
+    }
+    if (*count > 0) heap[i] = last;
+    return top;
+}
+
+// Integrate over [lo, hi] (mapped variable), reporting error and evaluations
+static double quad_adaptive(const Integrand *f, double lo, double hi) {
+    QuadInterval *heap = malloc(QUAD_MAX_INTERVALS * sizeof *heap);
+    double *t = malloc(2 * QUAD_SPLIT * 15 * sizeof *t);
+    double *fx = malloc(2 * QUAD_SPLIT * 15 * sizeof *fx);
+    if (!heap || !t || !fx) {
+        free(heap);
+        free(t);
+        free(fx);
+        eval_error("integrate: out of memory\n");
+        return NAN;
+    }
+
+    // Start from a few equal pieces so the first round already runs in parallel
+    QuadInterval fresh[2 * QUAD_SPLIT];
+    int nfresh = 8, count = 0;
+    for (int k = 0; k < nfresh; ++k) {
+        fresh[k] = (QuadInterval){.a = lo + (hi - lo) * k / 8, .b = k == 7 ? hi : lo + (hi - lo) * (k + 1) / 8};
+    }
+    long evals = 0;
+    double total = 0, err = 0, err0 = 0;
+    bool converged = false;
+
+    while (!g_interrupted) {
+        for (int i = 0; i < nfresh; ++i) quad_nodes(&fresh[i], t + 15 * i);
+        bool quiet = g_quiet;
+        g_quiet = true;        // the first point has reported any errors
+        quad_eval(f, t, fx, 15 * nfresh);
+        g_quiet = quiet;
+        evals += 15 * nfresh;
+        for (int i = 0; i < nfresh; ++i) {
+            quad_rule(&fresh[i], fx + 15 * i);
+            quad_push(heap, &count, fresh[i]);
+        }
+
+        double absval = 0;
+        total = err = 0;
+        for (int i = 0; i < count; ++i) {
+            total += heap[i].val;
+            err += heap[i].err;
+            absval += heap[i].absval;
+        }
+        if (!isfinite(total)) break;
+        double tol = fmax(QUAD_REL_TOL * fabs(total), 1e-3 * QUAD_REL_TOL * absval);
+        if (err <= tol) {
+            converged = true;
+            break;
+        }
+        if (count + QUAD_SPLIT > QUAD_MAX_INTERVALS) break;
+
+        // Progress: how far the error has fallen toward the tolerance on a
+        // log scale, or how much of the interval budget is spent
+        if (err0 == 0) err0 = err;
+        double done = err < err0 ? log(err0 / err) / log(err0 / tol) : 0;
+        done = fmin(fmax(done, (double)count / QUAD_MAX_INTERVALS), 1);
+        progress_set((uint64_t)(done * 1000), 1000);
+
+        // Bisect the worst intervals, enough of them that the rest would be
+        // within tolerance (and at least an eighth, to keep the threads busy)
+        int split = 0;
+        nfresh = 0;
+        for (double rest = err; split < QUAD_SPLIT && count > 0 && (rest > tol || split < count / 8); ++split) {
+            QuadInterval worst = quad_pop(heap, &count);
+            double mid = 0.5 * (worst.a + worst.b);
+            if (!(worst.a < mid && mid < worst.b)) {   // too narrow to split
+                quad_push(heap, &count, worst);
+                break;
+            }
+            rest -= worst.err;
+            fresh[nfresh++] = (QuadInterval){.a = worst.a, .b = mid};
+            fresh[nfresh++] = (QuadInterval){.a = mid, .b = worst.b};
+        }
+        if (nfresh == 0) break;
+    }
+    free(heap);
+    free(t);
+    free(fx);
+    if (g_interrupted) return NAN;
+    if (isnan(total)) eval_error("integrate: integrand is undefined on part of the range\n");
+    if (!g_quiet && isfinite(total)) {
+        progress_hide();
+        fprintf(stderr, "integrate: %serror estimate %.2g, %ld evaluations\n",
+                converged ? "" : "did not converge, ", err, evals);
+    }
+    return total;
+}
+
+static double integrate_call(const Expr *e, const Node *nd) {
+    double a = eval_node(e, nd->args[2]), b = eval_node(e, nd->args[3]);
+    if (isnan(a) || isnan(b)) return NAN;
+    double sign = a < b ? 1.0 : -1.0;
+    if (a > b) {
+        double tmp = a;
+        a = b;
+        b = tmp;
+    }
+
+    Integrand f = {.map = QUAD_FINITE};
+    double lo = a, hi = b;
+    if (isinf(a) && isinf(b)) {
+        f.map = QUAD_BOTH_INF;
+        lo = -1;
+        hi = 1;
+    } else if (isinf(a) || isinf(b)) {
+        f.map = isinf(b) ? QUAD_UPPER_INF : QUAD_LOWER_INF;
+        f.origin = isinf(b) ? a : b;
+        lo = 0;
+        hi = 1;
+    }
+    double probe = f.map == QUAD_FINITE ? 0.5 * (a + b) :
+                   f.map == QUAD_BOTH_INF ? 0.0 : f.origin + (f.map == QUAD_UPPER_INF ? 1 : -1);
+    if (!varfn_open(&f.fn, e, nd, probe)) return NAN;
+    double val = a == b ? 0.0 : quad_adaptive(&f, lo, hi);
+    free(f.fn.nodes);
+    return sign * val;
+}
+
+// ============================================================================
+// Automatic differentiation
+// ============================================================================
+
+// diff(expr, x) is the derivative of expr with respect to x at x's current
+// value; diff(expr, x, at) evaluates it at x = at. It is forward mode: every
+// node yields its value and its partial derivatives (dual numbers), so one
+// pass gives the derivative with respect to each seeded variable (:grad in
+// the REPL seeds all inputs at once). Bindings are differentiated through
+// their formulas.
+
+constexpr int DUAL_MAX = MAX_VARS;           // tangents carried at once
+constexpr int DUAL_SCRATCH = 1 << 18;        // doubles of temporaries
+constexpr int DUAL_MAX_DEPTH = 64;           // nested bindings
+
+static int compile(Expr *e, Parser *p);
+
+typedef struct {
+    int k;                         // tangents: seed[0..k)
+    const char *seed[DUAL_MAX];
+    const char *at_name;           // diff(expr, x, at): x takes this value
+    double at;
+    double *scratch, *top;         // temporaries, each 1 + k doubles
+    int depth;
+    bool failed;
+} DualCtx;
+
+static double *dual_alloc(DualCtx *c) {
+    if (c->top + 1 + c->k > c->scratch + DUAL_SCRATCH) {
+        if (!c->failed) eval_error("diff: expression too deep\n");
+        c->failed = true;
+        c->top = c->scratch;
+    }
+    double *d = c->top;
+    c->top += 1 + c->k;
+    return d;
+}
+
+// Digamma for factorial'(x) = factorial(x) * digamma(x + 1)
+static double digamma(double x) {
+    if (x <= 0 && x == floor(x)) return NAN;
+    if (x < 0) return digamma(1 - x) - PI / tan(PI * x);
+    double r = 0;
+    for (; x < 6; x += 1) r -= 1 / x;
+    double x2 = 1 / (x * x);
+    return r + log(x) - 0.5 / x - x2 * (1.0 / 12 - x2 * (1.0 / 120 - x2 / 252));
+}
+
+// Derivative of a 1-argument builtin at a (0 for the integer-valued ones)
+static double dual_slope1(const char *name, double a, double val) {
+    if (strcmp(name, "sin") == 0) return cos(a);
+    if (strcmp(name, "cos") == 0) return -sin(a);
+    if (strcmp(name, "tan") == 0) return 1 + val * val;
+    if (strcmp(name, "asin") == 0) return 1 / sqrt(1 - a * a);
+    if (strcmp(name, "acos") == 0) return -1 / sqrt(1 - a * a);
+    if (strcmp(name, "atan") == 0) return 1 / (1 + a * a);
+    if (strcmp(name, "sinh") == 0) return cosh(a);
+    if (strcmp(name, "cosh") == 0) return sinh(a);
+    if (strcmp(name, "tanh") == 0) return 1 - val * val;
+    if (strcmp(name, "exp") == 0) return val;
+    if (strcmp(name, "log") == 0 || strcmp(name, "ln") == 0) return 1 / a;
+    if (strcmp(name, "log10") == 0) return 1 / (a * log(10.0));
+    if (strcmp(name, "log2") == 0) return 1 / (a * log(2.0));
+    if (strcmp(name, "sqrt") == 0) return 0.5 / val;
+    if (strcmp(name, "cbrt") == 0) return 1 / (3 * val * val);
+    if (strcmp(name, "abs") == 0) return a > 0 ? 1 : a < 0 ? -1 : 0;
+    if (strcmp(name, "factorial") == 0) return val * digamma(a + 1);
+
+    // Format converters pass the value through; byte conversions scale it
+    if (strcmp(name, "hex") == 0 || strcmp(name, "bin") == 0 || strcmp(name, "oct") == 0 ||
+        strcmp(name, "dec") == 0 || strcmp(name, "factor") == 0) {
+        return 1;
+    }
+    if (strncmp(name, "to", 2) == 0 && strcmp(name, "totient") != 0 && a != 0) return val / a;
+    return 0;
+}
+
+static void dual_eval(DualCtx *c, const Expr *e, int n, double *out);
+
+// A binding read inside the expression: differentiate its formula
+static void dual_binding(DualCtx *c, const Variable *v, double *out) {
+    if (c->depth == DUAL_MAX_DEPTH) {
+        if (!c->failed) eval_error("diff: bindings nested too deeply\n");
+        c->failed = true;
+        out[0] = NAN;
+        return;
+    }
+    Expr *e = malloc(sizeof *e);
+    if (!e) {
+        out[0] = NAN;
+        c->failed = true;
+        return;
+    }
+    Parser p = {.src = v->formula, .pos = v->formula};
+    next_token(&p);
+    int root = compile(e, &p);
+    ++c->depth;
+    dual_eval(c, e, root, out);
+    --c->depth;
+    free(e);
+}
+
+static void dual_eval(DualCtx *c, const Expr *e, int n, double *out) {
+    const Node *nd = &e->nodes[n];
+    const int k = c->k;
+    double *saved = c->top;
+
+    switch ((NodeKind)nd->kind) {
+        case N_NUM:
+            out[0] = nd->num;
+            for (int i = 1; i <= k; ++i) out[i] = 0;
+            break;
+        case N_VAR: {
+            const char *name = e->names + nd->name;
+            int seeded = -1;
+            for (int i = 0; i < k; ++i) {
+                if (strcmp(c->seed[i], name) == 0) seeded = i;
+            }
+            int v = find_var(name);
+            bool at = c->at_name && strcmp(name, c->at_name) == 0;
+            if (seeded < 0 && !at && v >= 0 && vars[v].formula) {
+                dual_binding(c, &vars[v], out);
+                break;
+            }
+            out[0] = at ? c->at : get_var(name);
+            for (int i = 1; i <= k; ++i) out[i] = i - 1 == seeded;
+            break;
+        }
+        case N_NEG:
+            dual_eval(c, e, nd->args[0], out);
+            for (int i = 0; i <= k; ++i) out[i] = -out[i];
+            break;
+        case N_NOT:
+            dual_eval(c, e, nd->args[0], out);
+            out[0] = (double)(~to_u64(out[0]));
+            for (int i = 1; i <= k; ++i) out[i] = 0;
+            break;
+        case N_BIN: {
+            double *b = dual_alloc(c);
+            dual_eval(c, e, nd->args[0], out);
+            dual_eval(c, e, nd->args[1], b);
+            double x = out[0], y = b[0];
+            switch (nd->op) {
+                case '+': for (int i = 0; i <= k; ++i) out[i] += b[i]; break;
+                case '-': for (int i = 0; i <= k; ++i) out[i] -= b[i]; break;
+                case '*':
+                    for (int i = 1; i <= k; ++i) out[i] = out[i] * y + x * b[i];
+                    out[0] = x * y;
+                    break;
+                case '/':
+                    for (int i = 1; i <= k; ++i) out[i] = (out[i] * y - x * b[i]) / (y * y);
+                    out[0] = x / y;
+                    break;
+                case '%': {
+                    double q = trunc(x / y);
+                    for (int i = 1; i <= k; ++i) out[i] -= q * b[i];
+                    out[0] = fmod(x, y);
+                    break;
+                }
+                case '^': {
+                    // Each term only where its input moves, so constant
+                    // exponents of negative bases stay finite
+                    double val = pow(x, y), dx = y * pow(x, y - 1), dy = val * log(x);
+                    for (int i = 1; i <= k; ++i) {
+                        out[i] = (out[i] != 0 ? dx * out[i] : 0) + (b[i] != 0 ? dy * b[i] : 0);
+                    }
+                    out[0] = val;
+                    break;
+                }
+                default:     // bitwise: integer-valued, flat almost everywhere
+                    out[0] = binary_op(nd->op, x, y);
+                    for (int i = 1; i <= k; ++i) out[i] = 0;
+                    break;
+            }
+            break;
+        }
+        case N_CALL: {
+            const char *name = e->names + nd->name;
+            if (nd->nargs == 4 || strcmp(name, "diff") == 0) {
+                if (!c->failed) eval_error("diff: cannot differentiate through %s\n", name);
+                c->failed = true;
+                out[0] = NAN;
+                break;
+            }
+            if (data_call(e, nd)) {   // file hashes, buffer counts: constants
+                out[0] = call_data(e, nd);
+                for (int i = 1; i <= k; ++i) out[i] = 0;
+                break;
+            }
+            dual_eval(c, e, nd->args[0], out);
+            double x = out[0];
+            if (nd->nargs == 1) {
+                double val = call_func(name, x), slope = dual_slope1(name, x, val);
+                for (int i = 1; i <= k; ++i) out[i] = out[i] != 0 ? slope * out[i] : 0;
+                out[0] = val;
+                break;
+            }
+            double *b = dual_alloc(c);
+            dual_eval(c, e, nd->args[1], b);
+            double y = b[0];
+            if (nd->nargs == 3) {
+                double *a3 = dual_alloc(c);
+                dual_eval(c, e, nd->args[2], a3);
+                out[0] = call_func3(name, x, y, a3[0]);
+                for (int i = 1; i <= k; ++i) out[i] = 0;
+                break;
+            }
+            double val = call_func2(name, x, y), dx = 0, dy = 0;
+            if (strcmp(name, "pow") == 0) {
+                dx = y * pow(x, y - 1);
+                dy = val * log(x);
+            } else if (strcmp(name, "atan2") == 0) {
+                dx = y / (x * x + y * y);     // atan2(x, y): x is the y-coordinate
+                dy = -x / (x * x + y * y);
+            } else if (strcmp(name, "max") == 0 || strcmp(name, "min") == 0) {
+                bool first = val == x;
+                dx = first;
+                dy = !first;
+            } else if (strcmp(name, "mod") == 0) {
+                dx = 1;
+                dy = -trunc(x / y);
+            }
+            for (int i = 1; i <= k; ++i) {
+                out[i] = (out[i] != 0 ? dx * out[i] : 0) + (b[i] != 0 ? dy * b[i] : 0);
+            }
+            out[0] = val;
+            break;
+        }
+        case N_MAT:
+            if (!c->failed) eval_error("diff: cannot differentiate a matrix\n");
+            c->failed = true;
+            out[0] = NAN;
+            break;
+        case N_STR:
+            if (!c->failed) eval_error("string where a number is expected\n");
+            c->failed = true;
+            out[0] = NAN;
+            break;
+    }
+    c->top = saved;
+}
+
+// Value and partial derivatives (out[1..k]) of a tree for the seeded
+// variables; false after an error
+static bool dual_run(DualCtx *c, const Expr *e, int root, double *out) {
+    c->scratch = c->top = malloc(DUAL_SCRATCH * sizeof(double));
+    if (!c->scratch) {
+        eval_error("diff: out of memory\n");
+        return false;
+    }
+    char prev_error[sizeof(g_error)];
+    memcpy(prev_error, g_error, sizeof(g_error));
+    g_error[0] = '\0';
+    c->failed = false;
+    dual_eval(c, e, root, out);
+    free(c->scratch);
+    if (c->failed || g_error[0]) return false;
+    memcpy(g_error, prev_error, sizeof(g_error));
+    return true;
+}
+
+// Seed every plain variable a tree reads, directly or through bindings
+static void dual_seed_inputs(DualCtx *c, const Expr *e, int n, int depth) {
+    const Node *nd = &e->nodes[n];
+    if (nd->kind == N_VAR) {
+        const char *name = e->names + nd->name;
+        int v = find_var(name);
+        if (v < 0) return;
+        if (vars[v].formula && depth < DUAL_MAX_DEPTH) {
+            Expr *sub = malloc(sizeof *sub);
+            if (!sub) return;
+            Parser p = {.src = vars[v].formula, .pos = vars[v].formula};
+            next_token(&p);
+            dual_seed_inputs(c, sub, compile(sub, &p), depth + 1);
+            free(sub);
+            return;
+        }
+        for (int i = 0; i < c->k; ++i) {
+            if (strcmp(c->seed[i], vars[v].name) == 0) return;
+        }
+        if (c->k < DUAL_MAX) c->seed[c->k++] = vars[v].name;
+        return;
+    }
+    for (int i = 0; i < nd->nargs; ++i) dual_seed_inputs(c, e, nd->args[i], depth);
+}
+
+static double diff_call(const Expr *e, const Node *nd) {
+    const Node *var = &e->nodes[nd->args[1]];
+    if (nd->nargs < 2 || nd->nargs > 3 || var->kind != N_VAR) {
+        eval_error("diff: expects diff(expr, x) or diff(expr, x, at)\n");
+        return NAN;
+    }
+    DualCtx c = {.k = 1, .seed = {e->names + var->name}};
+    if (nd->nargs == 3) {
+        c.at_name = c.seed[0];
+        c.at = eval_node(e, nd->args[2]);
+        if (isnan(c.at)) return NAN;
+    }
+    double out[2];
+    return dual_run(&c, e, nd->args[0], out) ? out[1] : NAN;
+}
+
+// ============================================================================
+// Root finding and minimisation
+// ============================================================================
+
+// solve(expr, x, lo, hi) and minimize(expr, x, lo, hi) start from a coarse
+// scan of the range, evaluated as one batch, and refine with Brent's
+// methods. solve() returns the lowest root found; minimize() returns where
+// the smallest value is and reports that value on stderr.
+
+constexpr int SCAN_POINTS = 1025;
+constexpr int BRENT_MAX_ITER = 200;
+
+// Brent's zeroin on [a, b] with f(a), f(b) of opposite signs
+static double brent_root(const VarFn *f, double a, double b, double fa, double fb) {
+    double c = a, fc = fa, d = b - a, e = d;
+    for (int iter = 0; iter < BRENT_MAX_ITER && !g_interrupted; ++iter) {
+        if (fabs(fc) < fabs(fb)) {
+            a = b; b = c; c = a;
+            fa = fb; fb = fc; fc = fa;
+        }
+        double tol = 2 * DBL_EPSILON * fabs(b) + DBL_MIN;
+        double m = 0.5 * (c - b);
+        if (fabs(m) <= tol || fb == 0) break;
+
+        // Inverse quadratic (or secant) step when it stays well inside
+        // the bracket, bisection otherwise
+        if (fabs(e) >= tol && fabs(fa) > fabs(fb)) {
+            double s = fb / fa, p, q;
+            if (a == c) {
+                p = 2 * m * s;
+                q = 1 - s;
+            } else {
+                double qa = fa / fc, r = fb / fc;
+                p = s * (2 * m * qa * (qa - r) - (b - a) * (r - 1));
+                q = (qa - 1) * (r - 1) * (s - 1);
+            }
+            if (p > 0) q = -q;
+            p = fabs(p);
+            if (2 * p < fmin(3 * m * q - fabs(tol * q), fabs(e * q))) {
+                e = d;
+                d = p / q;
+            } else {
+                d = e = m;
+            }
+        } else {
+            d = e = m;
+        }
+        a = b;
+        fa = fb;
+        b += fabs(d) > tol ? d : copysign(tol, m);
+        fb = varfn_at(f, b);
+        if ((fb > 0) == (fc > 0)) {
+            c = a;
+            fc = fa;
+            d = e = b - a;
+        }
+    }
+    return b;
+}
+
+// Brent's localmin on [a, b]: golden section with parabolic steps
+static double brent_min(const VarFn *f, double a, double b, double *fmin_out) {
+    const double golden = 0.3819660112501051;    // (3 - sqrt(5)) / 2
+    double x = a + golden * (b - a), w = x, v = x;
+    double fx = varfn_at(f, x), fw = fx, fv = fx;
+    double d = 0, e = 0, abs_tol = 1e-3 * sqrt(DBL_EPSILON) * (b - a);
+    for (int iter = 0; iter < BRENT_MAX_ITER && !g_interrupted; ++iter) {
+        double m = 0.5 * (a + b);
+        double tol = sqrt(DBL_EPSILON) * fabs(x) + abs_tol, tol2 = 2 * tol;
+        if (fabs(x - m) <= tol2 - 0.5 * (b - a)) break;
+
+        bool golden_step = true;
+        if (fabs(e) > tol) {
+            double r = (x - w) * (fx - fv), q = (x - v) * (fx - fw);
+            double p = (x - v) * q - (x - w) * r;
+            q = 2 * (q - r);
+            if (q > 0) p = -p;
+            q = fabs(q);
+            if (fabs(p) < fabs(0.5 * q * e) && p > q * (a - x) && p < q * (b - x)) {
+                e = d;
+                d = p / q;
+                double u = x + d;
+                if (u - a < tol2 || b - u < tol2) d = copysign(tol, m - x);
+                golden_step = false;
+            }
+        }
+        if (golden_step) {
+            e = x >= m ? a - x : b - x;
+            d = golden * e;
+        }
+        double u = fabs(d) >= tol ? x + d : x + copysign(tol, d);
+        double fu = varfn_at(f, u);
+        if (fu <= fx) {
+            if (u >= x) a = x; else b = x;
+            v = w; fv = fw;
+            w = x; fw = fx;
+            x = u; fx = fu;
+        } else {
+            if (u < x) a = u; else b = u;
+            if (fu <= fw || w == x) {
+                v = w; fv = fw;
+                w = u; fw = fu;
+            } else if (fu <= fv || v == x || v == w) {
+                v = u; fv = fu;
+            }
+        }
+    }
+    *fmin_out = fx;
+    return x;
+}
+
+static double solve_call(const VarFn *f, const double *xs, const double *ys) {
+    for (int i = 0; i < SCAN_POINTS; ++i) {
+        if (ys[i] == 0) return xs[i];
+        if (i == 0 || !isfinite(ys[i - 1]) || !isfinite(ys[i]) || (ys[i - 1] > 0) == (ys[i] > 0)) continue;
+        double x = brent_root(f, xs[i - 1], xs[i], ys[i - 1], ys[i]);
+        if (g_interrupted) return NAN;
+
+        // A sign change across a pole is not a root
+        if (fabs(varfn_at(f, x)) <= fmax(fabs(ys[i - 1]), fabs(ys[i]))) return x;
+    }
+    eval_error("solve: no sign change in the range\n");
+    return NAN;
+}
+
+static double minimize_call(const VarFn *f, const double *xs, const double *ys) {
+    int best = -1;
+    for (int i = 0; i < SCAN_POINTS; ++i) {
+        if (!isnan(ys[i]) && (best < 0 || ys[i] < ys[best])) best = i;
+    }
+    if (best < 0) {
+        eval_error("minimize: expression is undefined on the range\n");
+        return NAN;
+    }
+    double lo = xs[best > 0 ? best - 1 : 0], hi = xs[best < SCAN_POINTS - 1 ? best + 1 : best];
+    double fmin, x = brent_min(f, lo, hi, &fmin);
+    if (g_interrupted) return NAN;
+    if (!(fmin < ys[best])) {     // the minimum is the sample itself (or an end)
+        x = xs[best];
+        fmin = ys[best];
+    }
+    if (!g_quiet) fprintf(stderr, "minimize: minimum %.12g\n", fmin);
+    return x;
+}
+
+// Functions taking an expression and a variable: integrate, diff, solve,
+// minimize
+static double call_varfn(const Expr *e, const Node *nd) {
+    const char *name = e->names + nd->name;
+    if (strcmp(name, "integrate") == 0) return integrate_call(e, nd);
+    if (strcmp(name, "diff") == 0) return diff_call(e, nd);
+    bool solve = strcmp(name, "solve") == 0;
+    if (!solve && strcmp(name, "minimize") != 0) {
+        eval_error("unknown function: %s\n", name);
+        return NAN;
+    }
+
+    double lo = eval_node(e, nd->args[2]), hi = eval_node(e, nd->args[3]);
+    if (isnan(lo) || isnan(hi)) return NAN;
+    if (!isfinite(lo) || !isfinite(hi) || lo >= hi) {
+        eval_error("%s: expects a finite range lo < hi\n", name);
+        return NAN;
+    }
+    VarFn f;
+    if (!varfn_open(&f, e, nd, 0.5 * (lo + hi))) return NAN;
+
+    double *xs = malloc(2 * SCAN_POINTS * sizeof *xs), *ys = xs + SCAN_POINTS, r = NAN;
+    if (xs) {
+        for (int i = 0; i < SCAN_POINTS; ++i) xs[i] = lo + (hi - lo) * i / (SCAN_POINTS - 1);
+        xs[SCAN_POINTS - 1] = hi;
+        varfn_eval(&f, SCAN_POINTS, xs, ys);
+        r = solve ? solve_call(&f, xs, ys) : minimize_call(&f, xs, ys);
+        free(xs);
+    } else {
+        eval_error("%s: out of memory\n", name);
+    }
+    free(f.nodes);
+    return r;
+}
+
+// ============================================================================
+// Matrices
+// ============================================================================
+
+// `[1, 2; 3, 4]` makes a matrix value. A tree that involves one (a literal,
+// a matrix variable or a matrix function) is evaluated here as a whole and
+// everything else stays on the scalar path. Numbers are 1x1 matrices and
+// broadcast in elementwise operators and functions.
+
+constexpr int MAT_BLOCK = 64;              // GEMM/LU tile edge
+constexpr size_t MAT_ALIGN = 64;
+constexpr size_t MAT_MAX_CELLS = 1 << 26;
+
+typedef struct {
+    int rows, cols;
+    double *a;         // rows * cols, row-major, MAT_ALIGN-aligned
+} Mat;
+
+typedef struct {
+    char name[MAX_NAME];
+    Mat m;
+} MatVar;
+
+static MatVar mat_vars[MAX_VARS];
+static int mat_var_count = 0;
+
+// Last result when it is a matrix
+static Mat g_mat_last;
+static bool g_have_mat = false;
+
+static size_t mat_cells(const Mat *m) {
+    return (size_t)m->rows * (size_t)m->cols;
+}
+
+static bool mat_is_scalar(const Mat *m) {
+    return m->rows == 1 && m->cols == 1;
+}
+
+static bool mat_alloc(Mat *m, int rows, int cols) {
+    size_t cells = (size_t)rows * (size_t)cols;
+    m->a = nullptr;
+    if (cells > MAT_MAX_CELLS) {
+        eval_error("matrix too large: %dx%d\n", rows, cols);
+        return false;
+    }
+    size_t bytes = (cells * sizeof(double) + MAT_ALIGN - 1) / MAT_ALIGN * MAT_ALIGN;
+    m->a = aligned_alloc(MAT_ALIGN, bytes ? bytes : MAT_ALIGN);
+    if (!m->a) {
+        eval_error("out of memory\n");
+        return false;
+    }
+    m->rows = rows;
+    m->cols = cols;
+    return true;
+}
+
+static void mat_free(Mat *m) {
+    free(m->a);
+    m->a = nullptr;
+}
+
+static bool mat_scalar(Mat *m, double v) {
+    if (!mat_alloc(m, 1, 1)) return false;
+    m->a[0] = v;
+    return true;
+}
+
+static bool mat_copy(Mat *dst, const Mat *src) {
+    if (!mat_alloc(dst, src->rows, src->cols)) return false;
+    memcpy(dst->a, src->a, mat_cells(src) * sizeof(double));
+    return true;
+}
+
+static int find_mat(const char *name) {
+    for (int i = 0; i < mat_var_count; ++i) {
+        if (strcmp(mat_vars[i].name, name) == 0) return i;
+    }
+    return -1;
+}
+
+// A scalar assignment replaces a matrix of the same name
+static void mat_forget(const char *name) {
+    int i = find_mat(name);
+    if (i < 0) return;
+    mat_free(&mat_vars[i].m);
+    mat_vars[i] = mat_vars[--mat_var_count];
+}
+
+static void mat_store(const char *name, const Mat *m) {
+    int i = find_mat(name);
+    if (i < 0) {
+        if (mat_var_count == MAX_VARS) {
+            eval_error("too many matrix variables\n");
+            return;
+        }
+        i = mat_var_count++;
+        mat_vars[i] = (MatVar){};
+        strncpy(mat_vars[i].name, name, MAX_NAME - 1);
+    }
+    Mat copy;
+    if (!mat_copy(&copy, m)) return;
+    mat_free(&mat_vars[i].m);
+    mat_vars[i].m = copy;
+}
+
+// C += alpha * A * B for an m x k by k x n product. The leading dimensions
+// let LU update a trailing block in place. Tiled so a MAT_BLOCK square of B
+// stays in cache; the inner loop is a contiguous axpy the compiler vectorises.
+HOT_LOOP
+static void gemm_acc(int m, int n, int k, double alpha,
+                     const double *restrict a, int lda, const double *restrict b, int ldb,
+                     double *restrict c, int ldc) {
+    for (int p0 = 0; p0 < k; p0 += MAT_BLOCK) {
+        int p1 = k - p0 < MAT_BLOCK ? k : p0 + MAT_BLOCK;
+        for (int j0 = 0; j0 < n; j0 += MAT_BLOCK) {
+            int j1 = n - j0 < MAT_BLOCK ? n : j0 + MAT_BLOCK;
+            for (int i = 0; i < m; ++i) {
+                double *ci = c + (size_t)i * ldc;
+                for (int p = p0; p < p1; ++p) {
+                    double s = alpha * a[(size_t)i * lda + p];
+                    const double *bp = b + (size_t)p * ldb;
+                    for (int j = j0; j < j1; ++j) ci[j] += s * bp[j];
+                }
+            }
+        }
+    }
+}
+
+// In-place LU with partial pivoting, row i of the result being row perm[i]
+// of the input: L (unit diagonal) below, U on and above the diagonal.
+// Blocked right-looking: factor a panel of MAT_BLOCK columns, solve for the
+// U block to its right, then update the trailing matrix with one GEMM.
+// False when a pivot is exactly zero (singular).
+static bool mat_lu(double *a, int n, int *perm, int *sign) {
+    *sign = 1;
+    for (int i = 0; i < n; ++i) perm[i] = i;
+
+    for (int j0 = 0; j0 < n; j0 += MAT_BLOCK) {
+        int j1 = n - j0 < MAT_BLOCK ? n : j0 + MAT_BLOCK;
+        for (int j = j0; j < j1; ++j) {
+            int piv = j;
+            for (int i = j + 1; i < n; ++i) {
+                if (fabs(a[(size_t)i * n + j]) > fabs(a[(size_t)piv * n + j])) piv = i;
+            }
+            if (a[(size_t)piv * n + j] == 0) return false;
+            if (piv != j) {
+                double *r = a + (size_t)j * n, *s = a + (size_t)piv * n;
+                for (int c = 0; c < n; ++c) {
+                    double t = r[c];
+                    r[c] = s[c];
+                    s[c] = t;
+                }
+                int t = perm[j];
+                perm[j] = perm[piv];
+                perm[piv] = t;
+                *sign = -*sign;
+            }
+            const double *u = a + (size_t)j * n;
+            double inv = 1.0 / u[j];
+            for (int i = j + 1; i < n; ++i) {
+                double *r = a + (size_t)i * n;
+                r[j] *= inv;
+                for (int c = j + 1; c < j1; ++c) r[c] -= r[j] * u[c];
+            }
+        }
+        if (j1 == n) break;
+
+        // U12 = L11^-1 A12, then A22 -= L21 U12
+        for (int r = j0 + 1; r < j1; ++r) {
+            double *row = a + (size_t)r * n;
+            for (int t = j0; t < r; ++t) {
+                const double *u = a + (size_t)t * n;
+                double l = row[t];
+                for (int c = j1; c < n; ++c) row[c] -= l * u[c];
+            }
+        }
+        gemm_acc(n - j1, n - j1, j1 - j0, -1.0, a + (size_t)j1 * n + j0, n,
+                 a + (size_t)j0 * n + j1, n, a + (size_t)j1 * n + j1, n);
+    }
+    return true;
+}
+
+// x (n x m) = A^-1 b from the LU factors of A
+static void mat_lu_solve(const double *lu, const int *perm, int n, const double *b, double *x, int m) {
+    for (int i = 0; i < n; ++i) {
+        memcpy(x + (size_t)i * m, b + (size_t)perm[i] * m, (size_t)m * sizeof(double));
+    }
+    for (int i = 1; i < n; ++i) {
+        double *xi = x + (size_t)i * m;
+        for (int t = 0; t < i; ++t) {
+            double l = lu[(size_t)i * n + t];
+            const double *xt = x + (size_t)t * m;
+            if (l != 0) for (int c = 0; c < m; ++c) xi[c] -= l * xt[c];
+        }
+    }
+    for (int i = n - 1; i >= 0; --i) {
+        double *xi = x + (size_t)i * m;
+        for (int t = i + 1; t < n; ++t) {
+            double u = lu[(size_t)i * n + t];
+            const double *xt = x + (size_t)t * m;
+            if (u != 0) for (int c = 0; c < m; ++c) xi[c] -= u * xt[c];
+        }
+        double inv = 1.0 / lu[(size_t)i * n + i];
+        for (int c = 0; c < m; ++c) xi[c] *= inv;
+    }
+}
+
+// LU factors of a square matrix into lu (allocated) and perm; *singular is
+// set instead of failing so det can return 0
+static bool mat_factor(const char *name, const Mat *a, Mat *lu, int **perm, int *sign, bool *singular) {
+    if (a->rows != a->cols) {
+        eval_error("%s: expects a square matrix, got %dx%d\n", name, a->rows, a->cols);
+        return false;
+    }
+    *perm = malloc((size_t)a->rows * sizeof(int));
+    if (!*perm || !mat_copy(lu, a)) {
+        free(*perm);
+        if (!*perm) eval_error("out of memory\n");
+        return false;
+    }
+    *singular = !mat_lu(lu->a, a->rows, *perm, sign);
+    return true;
+}
+
+// solve(A, b) and inv(A) (b = nullptr for the identity)
+static bool mat_solve(const char *name, const Mat *a, const Mat *b, Mat *out) {
+    int n = a->rows, *perm, sign;
+    bool singular;
+    if (b && b->rows != n) {
+        eval_error("%s: %dx%d matrix with a %dx%d right-hand side\n", name, n, a->cols, b->rows, b->cols);
+        return false;
+    }
+    Mat lu, eye = {};
+    if (!mat_factor(name, a, &lu, &perm, &sign, &singular)) return false;
+    bool ok = false;
+    if (singular) {
+        eval_error("%s: matrix is singular\n", name);
+    } else if (b || mat_alloc(&eye, n, n)) {
+        if (!b) {
+            memset(eye.a, 0, mat_cells(&eye) * sizeof(double));
+            for (int i = 0; i < n; ++i) eye.a[(size_t)i * n + i] = 1;
+            b = &eye;
+        }
+        ok = mat_alloc(out, n, b->cols);
+        if (ok) mat_lu_solve(lu.a, perm, n, b->a, out->a, b->cols);
+    }
+    mat_free(&eye);
+    mat_free(&lu);
+    free(perm);
+    return ok;
+}
+
+static bool mat_det(const Mat *a, Mat *out) {
+    int *perm, sign;
+    bool singular;
+    Mat lu;
+    if (!mat_factor("det", a, &lu, &perm, &sign, &singular)) return false;
+    double d = singular ? 0.0 : sign;
+    for (int i = 0; i < a->rows && !singular; ++i) d *= lu.a[(size_t)i * a->rows + i];
+    mat_free(&lu);
+    free(perm);
+    return mat_scalar(out, d);
+}
+
+static bool mat_transpose(const Mat *a, Mat *out) {
+    if (!mat_alloc(out, a->cols, a->rows)) return false;
+    for (int i0 = 0; i0 < a->rows; i0 += MAT_BLOCK) {
+        for (int j0 = 0; j0 < a->cols; j0 += MAT_BLOCK) {
+            for (int i = i0; i < a->rows && i < i0 + MAT_BLOCK; ++i) {
+                for (int j = j0; j < a->cols && j < j0 + MAT_BLOCK; ++j) {
+                    out->a[(size_t)j * a->rows + i] = a->a[(size_t)i * a->cols + j];
+                }
+            }
+        }
+    }
+    return true;
+}
+
+static bool mat_matmul(const Mat *a, const Mat *b, Mat *out) {
+    if (a->cols != b->rows) {
+        eval_error("matmul: cannot multiply %dx%d by %dx%d\n", a->rows, a->cols, b->rows, b->cols);
+        return false;
+    }
+    if (!mat_alloc(out, a->rows, b->cols)) return false;
+    memset(out->a, 0, mat_cells(out) * sizeof(double));
+    gemm_acc(a->rows, b->cols, a->cols, 1.0, a->a, a->cols, b->a, b->cols, out->a, out->cols);
+    return true;
+}
+
+// Inner product of two vectors (either orientation) or same-shape matrices
+static bool mat_dot(const Mat *a, const Mat *b, Mat *out) {
+    bool vectors = (a->rows == 1 || a->cols == 1) && (b->rows == 1 || b->cols == 1);
+    if (mat_cells(a) != mat_cells(b) || (!vectors && a->rows != b->rows)) {
+        eval_error("dot: %dx%d and %dx%d do not match\n", a->rows, a->cols, b->rows, b->cols);
+        return false;
+    }
+    double s = 0;
+    for (size_t i = 0; i < mat_cells(a); ++i) s += a->a[i] * b->a[i];
+    return mat_scalar(out, s);
+}
+
+// Functions that take or return whole matrices
+static bool mat_function(const char *name, int nargs) {
+    if (nargs == 1) {
+        return strcmp(name, "transpose") == 0 || strcmp(name, "inv") == 0 ||
+               strcmp(name, "det") == 0;
+    }
+    return nargs == 2 && (strcmp(name, "matmul") == 0 || strcmp(name, "dot") == 0 ||
+                          strcmp(name, "solve") == 0);
+}
+
+static bool mat_call(const char *name, const Mat *arg, Mat *out) {
+    if (strcmp(name, "transpose") == 0) return mat_transpose(&arg[0], out);
+    if (strcmp(name, "inv") == 0) return mat_solve(name, &arg[0], nullptr, out);
+    if (strcmp(name, "det") == 0) return mat_det(&arg[0], out);
+    if (strcmp(name, "matmul") == 0) return mat_matmul(&arg[0], &arg[1], out);
+    if (strcmp(name, "dot") == 0) return mat_dot(&arg[0], &arg[1], out);
+    return mat_solve(name, &arg[0], &arg[1], out);
+}
+
+// Elementwise operator (name nullptr) or 1-3 argument function, with 1x1
+// arguments broadcast over the others
+static bool mat_map(const char *name, char op, int nargs, const Mat *arg, Mat *out) {
+    int rows = 1, cols = 1;
+    size_t step[3];
+    for (int k = 0; k < nargs; ++k) {
+        step[k] = !mat_is_scalar(&arg[k]);
+        if (!step[k]) continue;
+        if (rows * cols != 1 && (arg[k].rows != rows || arg[k].cols != cols)) {
+            if (name) {
+                eval_error("%s: shapes %dx%d and %dx%d do not match\n", name, rows, cols,
+                           arg[k].rows, arg[k].cols);
+            } else {
+                eval_error("shapes %dx%d and %dx%d do not match\n", rows, cols, arg[k].rows, arg[k].cols);
+            }
+            return false;
+        }
+        rows = arg[k].rows;
+        cols = arg[k].cols;
+    }
+    if (!mat_alloc(out, rows, cols)) return false;
+
+    size_t cells = mat_cells(out);
+    const double *x = arg[0].a, *y = nargs > 1 ? arg[1].a : nullptr;
+    double *r = out->a;
+    if (!name && (op == '+' || op == '-' || op == '*' || op == '/')) {
+        size_t sx = step[0], sy = step[1];
+        switch (op) {
+            case '+': for (size_t i = 0; i < cells; ++i) r[i] = x[i * sx] + y[i * sy]; break;
+            case '-': for (size_t i = 0; i < cells; ++i) r[i] = x[i * sx] - y[i * sy]; break;
+            case '*': for (size_t i = 0; i < cells; ++i) r[i] = x[i * sx] * y[i * sy]; break;
+            case '/': for (size_t i = 0; i < cells; ++i) r[i] = x[i * sx] / y[i * sy]; break;
+        }
+        return true;
+    }
+
+    // Stop at the first error rather than reporting it for every element
+    MathFn fn = name && nargs == 1 ? plain_math_fn(name) : nullptr;
+    for (size_t i = 0; i < cells && !g_error[0]; ++i) {
+        double v[3];
+        for (int k = 0; k < nargs; ++k) v[k] = arg[k].a[i * step[k]];
+        if (!name) {
+            r[i] = binary_op(op, v[0], v[1]);
+        } else if (nargs == 1) {
+            r[i] = fn ? fn(v[0]) : call_func(name, v[0]);
+        } else if (nargs == 2) {
+            r[i] = call_func2(name, v[0], v[1]);
+        } else {
+            r[i] = call_func3(name, v[0], v[1], v[2]);
+        }
+    }
+    if (g_error[0]) mat_free(out);
+    return !g_error[0];
+}
+
+// Does node n produce or consume a matrix?
+static bool mat_tree(const Expr *e, int n) {
+    const Node *nd = &e->nodes[n];
+    const char *name = e->names + nd->name;
+    switch ((NodeKind)nd->kind) {
+        case N_MAT:
+            return true;
+        case N_VAR:
+            return find_mat(name) >= 0;
+        case N_CALL:
+            if (nd->nargs == 4 || strcmp(name, "diff") == 0) return false;
+            if (mat_function(name, nd->nargs)) return true;
+            break;
+        default:
+            break;
+    }
+    for (int i = 0; i < nd->nargs; ++i) {
+        if (mat_tree(e, nd->args[i])) return true;
+    }
+    return false;
+}
+
+static bool mat_eval(const Expr *e, int n, Mat *out) {
+    const Node *nd = &e->nodes[n];
+    if (g_interrupted) return false;
+    if (!mat_tree(e, n)) return mat_scalar(out, eval_node(e, n));
+
+    switch ((NodeKind)nd->kind) {
+        case N_MAT: {
+            int rows = nd->args[0], cols = nd->args[1];
+            if (!mat_alloc(out, rows, cols)) return false;
+            for (int i = 0; i < rows * cols; ++i) {
+                Mat cell;
+                if (!mat_eval(e, e->items[nd->lit_len + i], &cell)) {
+                    mat_free(out);
+                    return false;
+                }
+                bool scalar = mat_is_scalar(&cell);
+                out->a[i] = cell.a[0];
+                mat_free(&cell);
+                if (!scalar) {
+                    eval_error("matrix entries must be numbers\n");
+                    mat_free(out);
+                    return false;
+                }
+            }
+            return true;
+        }
+        case N_VAR:
+            return mat_copy(out, &mat_vars[find_mat(e->names + nd->name)].m);
+        case N_NEG:
+        case N_NOT: {
+            if (!mat_eval(e, nd->args[0], out)) return false;
+            for (size_t i = 0; i < mat_cells(out); ++i) {
+                out->a[i] = nd->kind == N_NEG ? -out->a[i] : (double)(~to_u64(out->a[i]));
+            }
+            return true;
+        }
+        case N_BIN:
+        case N_CALL: {
+            const char *name = nd->kind == N_CALL ? e->names + nd->name : nullptr;
+            Mat arg[MAX_ARGS] = {};
+            int k = 0;
+            bool ok = true;
+            for (; k < nd->nargs && ok; ++k) ok = mat_eval(e, nd->args[k], &arg[k]);
+            if (ok && name && mat_function(name, nd->nargs)) {
+                ok = mat_call(name, arg, out);
+            } else if (ok) {
+                ok = mat_map(name, nd->op, nd->nargs, arg, out);
+            }
+            while (k-- > 0) mat_free(&arg[k]);
+            return ok;
+        }
+        case N_NUM:
+        case N_STR:
+            break;
+    }
+    return mat_scalar(out, NAN);
+}
+
+// Evaluate a matrix tree into g_mat_last. A 1x1 result is returned as an
+// ordinary number; for larger ones the return value is 0.
+static double mat_evaluate(const Expr *e, int root) {
+    Mat m;
+    if (!mat_eval(e, root, &m)) return NAN;
+    if (g_error[0] || g_interrupted) {
+        mat_free(&m);
+        return NAN;
+    }
+    if (mat_is_scalar(&m)) {
+        double v = m.a[0];
+        mat_free(&m);
+        return v;
+    }
+    if (g_quiet) {
+        eval_error("result is a %dx%d matrix\n", m.rows, m.cols);
+        mat_free(&m);
+        return NAN;
+    }
+    g_mat_last = m;
+    g_have_mat = true;
+    return 0.0;
+}
+
+// ============================================================================
+// Buffers
+// ============================================================================
+
+// file("path") maps a file and blob("hex") spells out bytes. &, |, ~ and
+// band/bor/bxor combine equal-length buffers bytewise; popcount(buf) and
+// hamming(a, b) reduce them to a number. Operands are never copied whole:
+// the tree runs over BUF_CHUNK-byte windows, leaves read in place and each
+// operator writing its own scratch window, so multi-GB inputs stream
+// through cache once. Reductions split the windows across threads.
+
+constexpr size_t BUF_CHUNK = 16 * 1024;
+constexpr int BUF_MAX_LEAVES = 16;
+constexpr int BUF_THREADS = 64;
+constexpr size_t BUF_THREAD_MIN = 16 << 20;   // smallest share of a reduction
+constexpr size_t BUF_SHOW = 32;               // bytes printed of a buffer result
+
+typedef struct {
+    const Expr *e;
+    int nleaves, nslots;
+    int leaf_node[BUF_MAX_LEAVES];
+    const uint8_t *leaf[BUF_MAX_LEAVES];
+    size_t leaf_len[BUF_MAX_LEAVES];
+    bool leaf_mapped[BUF_MAX_LEAVES];
+    int16_t slot[MAX_NODES];      // scratch window of each operator node
+} BufCtx;
+
+// Buffer result of the last evaluation, as much as is printed
+static struct {
+    uint8_t head[BUF_SHOW];
+    size_t len;
+} g_buf_last;
+static bool g_have_buf = false;
+
+// Bytewise operator of a buffer node (hamming is xor), or 0 for a leaf
+static char buf_op(const Expr *e, const Node *nd) {
+    const char *name = e->names + nd->name;
+    if (nd->kind == N_NOT) return '~';
+    if (nd->kind == N_BIN) return nd->op;
+    if (strcmp(name, "band") == 0) return '&';
+    if (strcmp(name, "bor") == 0) return '|';
+    if (strcmp(name, "bxor") == 0 || strcmp(name, "hamming") == 0) return '^';
+    return 0;
+}
+
+// Does node n produce a buffer?
+static bool buf_tree(const Expr *e, int n) {
+    const Node *nd = &e->nodes[n];
+    const char *name = e->names + nd->name;
+    switch ((NodeKind)nd->kind) {
+        case N_NOT:
+            return buf_tree(e, nd->args[0]);
+        case N_BIN:
+            return (nd->op == '&' || nd->op == '|') &&
+                   (buf_tree(e, nd->args[0]) || buf_tree(e, nd->args[1]));
+        case N_CALL:
+            if (nd->nargs == 1) return strcmp(name, "file") == 0 || strcmp(name, "blob") == 0;
+            return nd->nargs == 2 && buf_op(e, nd) && strcmp(name, "hamming") != 0 &&
+                   (buf_tree(e, nd->args[0]) || buf_tree(e, nd->args[1]));
+        default:
+            return false;
+    }
+}
+
+// popcount(buffer) or hamming(buffer, buffer)
+static bool buf_reduction(const Expr *e, const Node *nd) {
+    const char *name = e->names + nd->name;
+    if (nd->nargs == 1 && strcmp(name, "popcount") == 0) return buf_tree(e, nd->args[0]);
+    return nd->nargs == 2 && strcmp(name, "hamming") == 0 &&
+           (buf_tree(e, nd->args[0]) || buf_tree(e, nd->args[1]));
+}
+
+// blob("de ad be ef"): two hex digits per byte, spaces and a 0x prefix allowed
+static bool blob_parse(const Node *str, uint8_t **out, size_t *len) {
+    const char *s = str->lit, *end = str->lit + str->lit_len;
+    if (end - s >= 2 && s[0] == '0' && (s[1] == 'x' || s[1] == 'X')) s += 2;
+    uint8_t *buf = malloc(str->lit_len / 2 + 1);
+    if (!buf) return false;
+    size_t n = 0;
+    int high = -1;
+    for (; s < end; ++s) {
+        if (isspace((unsigned char)*s)) continue;
+        if (!isxdigit((unsigned char)*s)) {
+            eval_error("blob: '%c' is not a hex digit\n", *s);
+            free(buf);
+            return false;
+        }
+        int d = isdigit((unsigned char)*s) ? *s - '0' : tolower((unsigned char)*s) - 'a' + 10;
+        if (high < 0) {
+            high = d;
+        } else {
+            buf[n++] = (uint8_t)(high << 4 | d);
+            high = -1;
+        }
+    }
+    if (high >= 0) {
+        eval_error("blob: odd number of hex digits\n");
+        free(buf);
+        return false;
+    }
+    *out = buf;
+    *len = n;
+    return true;
+}
+
+static bool buf_leaf(BufCtx *c, int n, size_t *len) {
+    const Node *nd = &c->e->nodes[n];
+    const char *name = c->e->names + nd->name;
+    if (nd->kind != N_CALL || nd->nargs != 1 || (strcmp(name, "file") != 0 && strcmp(name, "blob") != 0)) {
+        eval_error("buffers combine only with buffers\n");
+        return false;
+    }
+    const Node *arg = &c->e->nodes[nd->args[0]];
+    if (arg->kind != N_STR) {
+        eval_error("%s: expects a string\n", name);
+        return false;
+    }
+    if (c->nleaves == BUF_MAX_LEAVES) {
+        eval_error("too many buffers in one expression\n");
+        return false;
+    }
+
+    int i = c->nleaves;
+    if (name[0] == 'f') {
+        struct stat st;
+        int fd = open_file(name, arg, &st);
+        if (fd < 0) return false;
+        c->leaf_len[i] = (size_t)st.st_size;
+        if (!map_file(name, fd, c->leaf_len[i], &c->leaf[i])) return false;
+        c->leaf_mapped[i] = true;
+    } else {
+        uint8_t *bytes;
+        if (!blob_parse(arg, &bytes, &c->leaf_len[i])) return false;
+        c->leaf[i] = bytes;
+        c->leaf_mapped[i] = false;
+    }
+    c->leaf_node[i] = n;
+    c->nleaves++;
+    *len = c->leaf_len[i];
+    return true;
+}
+
+// Load the leaves under node n, give each operator a scratch window and
+// check that operands agree in length; *len is the length of n
+static bool buf_prepare(BufCtx *c, int n, size_t *len) {
+    const Node *nd = &c->e->nodes[n];
+    char op = buf_op(c->e, nd);
+    if (!op) return buf_leaf(c, n, len);
+    if (op != '&' && op != '|' && op != '^' && op != '~') {
+        eval_error("buffers combine only with buffers\n");
+        return false;
+    }
+    size_t a, b;
+    if (!buf_prepare(c, nd->args[0], &a)) return false;
+    if (op != '~') {
+        if (!buf_prepare(c, nd->args[1], &b)) return false;
+        if (a != b) {
+            eval_error("buffers differ in length (%zu and %zu bytes)\n", a, b);
+            return false;
+        }
+    }
+    c->slot[n] = (int16_t)c->nslots++;
+    *len = a;
+    return true;
+}
+
+static void buf_release(BufCtx *c) {
+    for (int i = 0; i < c->nleaves; ++i) {
+        if (!c->leaf_mapped[i]) free((void *)c->leaf[i]);
+        else if (c->leaf_len[i]) munmap((void *)c->leaf[i], c->leaf_len[i]);
+    }
+    c->nleaves = 0;
+}
+
+// out = a op b, one loop per operator so each vectorises
+HOT_LOOP
+static void buf_kernel(char op, uint8_t *out, const uint8_t *a, const uint8_t *b, size_t n) {
+    switch (op) {
+        case '&': for (size_t i = 0; i < n; ++i) out[i] = a[i] & b[i]; break;
+        case '|': for (size_t i = 0; i < n; ++i) out[i] = a[i] | b[i]; break;
+        case '^': for (size_t i = 0; i < n; ++i) out[i] = a[i] ^ b[i]; break;
+        case '~': for (size_t i = 0; i < n; ++i) out[i] = (uint8_t)~a[i]; break;
+    }
+}
+
+// Bytes [off, off + len) of buffer node n: a pointer into a leaf, or the
+// node's scratch window (len is at most BUF_CHUNK)
+static const uint8_t *buf_chunk(const BufCtx *c, int n, size_t off, size_t len, uint8_t *scratch) {
+    for (int i = 0; i < c->nleaves; ++i) {
+        if (c->leaf_node[i] == n) return c->leaf[i] + off;
+    }
+    const Node *nd = &c->e->nodes[n];
+    char op = buf_op(c->e, nd);
+    uint8_t *out = scratch + (size_t)c->slot[n] * BUF_CHUNK;
+    const uint8_t *a = buf_chunk(c, nd->args[0], off, len, scratch);
+    const uint8_t *b = op == '~' ? a : buf_chunk(c, nd->args[1], off, len, scratch);
+    buf_kernel(op, out, a, b, len);
+    return out;
+}
+
+typedef struct {
+    const BufCtx *c;
+    int root;
+    size_t lo, hi;
+    uint64_t count;
+    bool done;
+} BufJob;
+
+static void *buf_worker(void *arg) {
+    BufJob *job = arg;
+    uint8_t *scratch = malloc((size_t)job->c->nslots * BUF_CHUNK + 1);
+    if (!scratch) return nullptr;
+    for (size_t off = job->lo; off < job->hi && !g_interrupted; off += BUF_CHUNK) {
+        size_t n = job->hi - off < BUF_CHUNK ? job->hi - off : BUF_CHUNK;
+        job->count += bitops.popcount_bytes(buf_chunk(job->c, job->root, off, n, scratch), n);
+    }
+    free(scratch);
+    job->done = !g_interrupted;
+    return arg;
+}
+
+// Set bits of buffer node root, in shares of whole windows across the CPUs
+static bool buf_popcount(const BufCtx *c, int root, size_t len, uint64_t *out) {
+    long cpus = g_in_preview ? 1 : sysconf(_SC_NPROCESSORS_ONLN);
+    size_t nthreads = cpus < 1 ? 1 : cpus > BUF_THREADS ? BUF_THREADS : (size_t)cpus;
+    if (nthreads > len / BUF_THREAD_MIN) nthreads = len / BUF_THREAD_MIN ? len / BUF_THREAD_MIN : 1;
+    size_t share = (len / nthreads + BUF_CHUNK - 1) / BUF_CHUNK * BUF_CHUNK;
+
+    BufJob jobs[BUF_THREADS];
+    pthread_t tids[BUF_THREADS];
+    bool started[BUF_THREADS] = {};
+    for (size_t t = 0; t < nthreads; ++t) {
+        size_t lo = t * share < len ? t * share : len;
+        jobs[t] = (BufJob){.c = c, .root = root, .lo = lo, .hi = len - lo > share ? lo + share : len};
+    }
+    for (size_t t = 1; t < nthreads; ++t) {
+        started[t] = pthread_create(&tids[t], nullptr, buf_worker, &jobs[t]) == 0;
+        if (!started[t]) buf_worker(&jobs[t]);
+    }
+    buf_worker(&jobs[0]);
+    bool ok = true;
+    *out = 0;
+    for (size_t t = 0; t < nthreads; ++t) {
+        if (t && started[t]) pthread_join(tids[t], nullptr);
+        ok = ok && jobs[t].done;
+        *out += jobs[t].count;
+    }
+    return ok;
+}
+
+// popcount(buf) and hamming(a, b), whose call node is the xor
+static double buf_reduce(const Expr *e, const Node *nd) {
+    BufCtx c = {.e = e};
+    int root = nd->nargs == 1 ? nd->args[0] : (int)(nd - e->nodes);
+    size_t len;
+    uint64_t count = 0;
+    bool ok = buf_prepare(&c, root, &len) && !(g_in_preview && len > PREVIEW_FILE_MAX) &&
+              buf_popcount(&c, root, len, &count);
+    buf_release(&c);
+    return ok ? (double)count : NAN;
+}
+
+// Evaluate a buffer tree; its length and first bytes go to g_buf_last
+static double buf_evaluate(const Expr *e, int root) {
+    BufCtx c = {.e = e};
+    size_t len;
+    bool ok = buf_prepare(&c, root, &len);
+    if (ok && g_quiet) {
+        eval_error("result is a %zu-byte buffer\n", len);
+        ok = false;
+    }
+    uint8_t *scratch = ok ? malloc((size_t)c.nslots * BUF_CHUNK + 1) : nullptr;
+    if (scratch) {
+        size_t n = len < BUF_SHOW ? len : BUF_SHOW;
+        if (n) memcpy(g_buf_last.head, buf_chunk(&c, root, 0, n, scratch), n);
+        g_buf_last.len = len;
+        g_have_buf = true;
+        free(scratch);
+    }
+    buf_release(&c);
+    return g_have_buf ? 0.0 : NAN;
+}
+
+// ============================================================================
+// Big integers
+// ============================================================================
+
+// Integer results beyond the exact range of double (2^53), and integer
+// operations that overflow 64 bits, are recomputed exactly from the same
+// tree on sign-magnitude integers with 64-bit limbs. Multiplication is
+// schoolbook for short operands, Karatsuba above KARATSUBA_LIMBS and
+// Toom-3 above TOOM3_LIMBS.
+// Anything that is not integer arithmetic (fractions, inexact division,
+// non-integer functions) makes the exact pass fail and the double stands.
+
+constexpr size_t KARATSUBA_LIMBS = 32;
+constexpr size_t TOOM3_LIMBS = 160;
+constexpr uint64_t BIG_MAX_BITS = 1ULL << 26;  // ~20M digits
+
+typedef struct {
+    uint64_t *d;   // little-endian limbs, d[n - 1] != 0
+    size_t n;      // 0 for zero
+    bool neg;
+} Big;
+
+static void big_free(Big *a) {
+    free(a->d);
+    *a = (Big){};
+}
+
+static bool big_alloc(Big *a, size_t n) {
+    *a = (Big){.d = calloc(n ? n : 1, sizeof(uint64_t)), .n = n};
+    return a->d != nullptr;
+}
+
+static void big_trim(Big *a) {
+    while (a->n > 0 && a->d[a->n - 1] == 0) --a->n;
+    if (a->n == 0) a->neg = false;
+}
+
+static bool big_from_u64(Big *a, uint64_t v) {
+    if (!big_alloc(a, 1)) return false;
+    a->d[0] = v;
+    big_trim(a);
+    return true;
+}
+
+static bool big_fits_u64(const Big *a) {
+    return !a->neg && a->n <= 1;
+}
+
+static uint64_t big_u64(const Big *a) {
+    return a->n ? a->d[0] : 0;
+}
+
+static uint64_t big_bits(const Big *a) {
+    return a->n ? 64 * (a->n - 1) + 64 - (uint64_t)__builtin_clzll(a->d[a->n - 1]) : 0;
+}
+
+// --- limb arrays -----------------------------------------------------------
+
+static int limbs_cmp(const uint64_t *a, size_t an, const uint64_t *b, size_t bn) {
+    if (an != bn) return an < bn ? -1 : 1;
+    for (size_t i = an; i-- > 0;) {
+        if (a[i] != b[i]) return a[i] < b[i] ? -1 : 1;
+    }
+    return 0;
+}
+
+// r[0..an) = a + b with an >= bn; returns the carry out
+static uint64_t limbs_add(uint64_t *r, const uint64_t *a, size_t an, const uint64_t *b, size_t bn) {
+    uint64_t carry = 0;
+    for (size_t i = 0; i < an; ++i) {
+        u128 s = (u128)a[i] + (i < bn ? b[i] : 0) + carry;
+        r[i] = (uint64_t)s;
+        carry = (uint64_t)(s >> 64);
+    }
+    return carry;
+}
+
+// r[0..an) = a - b with a >= b
+static void limbs_sub(uint64_t *r, const uint64_t *a, size_t an, const uint64_t *b, size_t bn) {
+    uint64_t borrow = 0;
+    for (size_t i = 0; i < an; ++i) {
+        uint64_t bi = i < bn ? b[i] : 0;
+        uint64_t d = a[i] - bi - borrow;
+        borrow = (a[i] < bi) || (a[i] - bi < borrow);
+        r[i] = d;
+    }
+}
+
+// r[0..rn) += a[0..an), carrying up to rn
+static void limbs_add_into(uint64_t *r, size_t rn, const uint64_t *a, size_t an) {
+    uint64_t carry = 0;
+    size_t i = 0;
+    for (; i < an; ++i) {
+        u128 s = (u128)r[i] + a[i] + carry;
+        r[i] = (uint64_t)s;
+        carry = (uint64_t)(s >> 64);
+    }
+    for (; carry && i < rn; ++i) carry = ++r[i] == 0;
+}
+
+static size_t limbs_len(const uint64_t *a, size_t n) {
+    while (n > 0 && a[n - 1] == 0) --n;
+    return n;
+}
+
+HOT_LOOP
+static void limbs_mul_basecase(uint64_t *r, const uint64_t *a, size_t an,
+                               const uint64_t *b, size_t bn) {
+    memset(r, 0, (an + bn) * sizeof(*r));
+    for (size_t i = 0; i < an; ++i) {
+        uint64_t carry = 0;
+        for (size_t j = 0; j < bn; ++j) {
+            u128 t = (u128)a[i] * b[j] + r[i + j] + carry;
+            r[i + j] = (uint64_t)t;
+            carry = (uint64_t)(t >> 64);
+        }
+        r[i + bn] = carry;
+    }
+}
+
+static bool limbs_mul(uint64_t *r, const uint64_t *a, size_t an, const uint64_t *b, size_t bn);
+static bool limbs_mul_toom3(uint64_t *r, const uint64_t *a, size_t an,
+                            const uint64_t *b, size_t bn);
+
+// Karatsuba for an >= bn > an / 2:
+//   a = a1*B^h + a0, b = b1*B^h + b0
+//   a*b = z2*B^2h + ((a0+a1)(b0+b1) - z0 - z2)*B^h + z0
+static bool limbs_mul_karatsuba(uint64_t *r, const uint64_t *a, size_t an,
+                                const uint64_t *b, size_t bn) {
+    size_t h = an / 2;
+    size_t a1n = an - h, b1n = bn - h;
+    size_t san = a1n + 1, sbn = (h > b1n ? h : b1n) + 1;
+    uint64_t *sa = malloc((san + sbn + san + sbn) * sizeof(uint64_t));
+    if (!sa) return false;
+    uint64_t *sb = sa + san, *z1 = sb + sbn;
+
+    // z0 and z2 go straight into the low and high halves of r
+    if (!limbs_mul(r, a, h, b, h) || !limbs_mul(r + 2 * h, a + h, a1n, b + h, b1n)) {
+        free(sa);
+        return false;
+    }
+
+    sa[a1n] = limbs_add(sa, a + h, a1n, a, h);
+    if (h >= b1n) sb[h] = limbs_add(sb, b, h, b + h, b1n);
+    else sb[b1n] = limbs_add(sb, b + h, b1n, b, h);
+
+    size_t z1n = san + sbn;
+    bool ok = limbs_mul(z1, sa, san, sb, sbn);
+    if (ok) {
+        limbs_sub(z1, z1, z1n, r, 2 * h);
+        limbs_sub(z1, z1, z1n, r + 2 * h, a1n + b1n);
+        limbs_add_into(r + h, an + bn - h, z1, limbs_len(z1, z1n));
+    }
+    free(sa);
+    return ok;
+}
+
+// r[0..an+bn) = a * b (r must not alias the inputs)
+static bool limbs_mul(uint64_t *r, const uint64_t *a, size_t an, const uint64_t *b, size_t bn) {
+    if (an < bn) {
+        const uint64_t *t = a; a = b; b = t;
+        size_t tn = an; an = bn; bn = tn;
+    }
+    if (bn == 0) {
+        memset(r, 0, an * sizeof(*r));
+        return true;
+    }
+    if (bn < KARATSUBA_LIMBS) {
+        limbs_mul_basecase(r, a, an, b, bn);
+        return true;
+    }
+    if (an < 2 * bn) {
+        return bn < TOOM3_LIMBS ? limbs_mul_karatsuba(r, a, an, b, bn)
+                                : limbs_mul_toom3(r, a, an, b, bn);
+    }
+
+    // Unbalanced: multiply bn-sized slices of a and accumulate
+    uint64_t *t = malloc(2 * bn * sizeof(uint64_t));
+    if (!t) return false;
+    memset(r, 0, (an + bn) * sizeof(*r));
+    for (size_t off = 0; off < an; off += bn) {
+        size_t len = an - off < bn ? an - off : bn;
+        if (!limbs_mul(t, a + off, len, b, bn)) { free(t); return false; }
+        limbs_add_into(r + off, an + bn - off, t, len + bn);
+    }
+    free(t);
+    return true;
+}
+
+// --- signed arithmetic -----------------------------------------------------
+
+static bool big_add(Big *r, const Big *a, const Big *b) {
+    if (a->n < b->n || (a->n == b->n && a->neg != b->neg &&
+                        limbs_cmp(a->d, a->n, b->d, b->n) < 0)) {
+        const Big *t = a; a = b; b = t;
+    }
+    // |a| >= |b| for subtraction; a->n >= b->n for addition
+    if (!big_alloc(r, a->n + 1)) return false;
+    if (a->neg == b->neg) {
+        r->d[a->n] = limbs_add(r->d, a->d, a->n, b->d, b->n);
+    } else if (limbs_cmp(a->d, a->n, b->d, b->n) >= 0) {
+        limbs_sub(r->d, a->d, a->n, b->d, b->n);
+    } else {
+        big_free(r);
+        return big_add(r, b, a);
+    }
+    r->neg = a->neg;
+    big_trim(r);
+    return true;
+}
+
+static bool big_sub(Big *r, const Big *a, const Big *b) {
+    Big nb = *b;
+    nb.neg = b->n ? !b->neg : false;
+    return big_add(r, a, &nb);
+}
+
+static bool big_mul(Big *r, const Big *a, const Big *b) {
+    if (big_bits(a) + big_bits(b) > BIG_MAX_BITS) return false;
+    if (!big_alloc(r, a->n + b->n)) return false;
+    if (!limbs_mul(r->d, a->d, a->n, b->d, b->n)) { big_free(r); return false; }
+    r->neg = a->neg != b->neg;
+    big_trim(r);
+    return true;
+}
+
+// In-place a = a * m + c for small m, growing as needed
+static bool big_mul_add_small(Big *a, uint64_t m, uint64_t c) {
+    uint64_t carry = c;
+    for (size_t i = 0; i < a->n; ++i) {
+        u128 t = (u128)a->d[i] * m + carry;
+        a->d[i] = (uint64_t)t;
+        carry = (uint64_t)(t >> 64);
+    }
+    if (carry) {
+        uint64_t *d = realloc(a->d, (a->n + 1) * sizeof(uint64_t));
+        if (!d) return false;
+        a->d = d;
+        a->d[a->n++] = carry;
+    }
+    return true;
+}
+
+// In-place a /= m for small m; returns the remainder
+static uint64_t big_div_small(Big *a, uint64_t m) {
+    u128 rem = 0;
+    for (size_t i = a->n; i-- > 0;) {
+        u128 cur = (rem << 64) | a->d[i];
+        a->d[i] = (uint64_t)(cur / m);
+        rem = cur % m;
+    }
+    big_trim(a);
+    return (uint64_t)rem;
+}
+
+// --- Toom-3 ----------------------------------------------------------------
+
+static bool big_copy(Big *r, const Big *a) {
+    if (!big_alloc(r, a->n)) return false;
+    if (a->n) memcpy(r->d, a->d, a->n * sizeof(uint64_t));
+    r->neg = a->neg;
+    return true;
+}
+
+// a += b or a -= b
+static bool big_acc(Big *a, const Big *b, bool sub) {
+    Big t;
+    if (!(sub ? big_sub : big_add)(&t, a, b)) return false;
+    big_free(a);
+    *a = t;
+    return true;
+}
+
+// a /= 2 for even a, keeping the sign
+static void big_half(Big *a) {
+    for (size_t i = 0; i < a->n; ++i) {
+        a->d[i] = (a->d[i] >> 1) | (i + 1 < a->n ? a->d[i + 1] << 63 : 0);
+    }
+    big_trim(a);
+}
+
+// Read-only Big over a slice of limbs (never freed)
+static Big big_view(const uint64_t *d, size_t n) {
+    return (Big){.d = (uint64_t *)d, .n = limbs_len(d, n)};
+}
+
+// Split into thirds of k limbs, evaluate at 0, 1, -1, -2 and infinity,
+// multiply pointwise and interpolate with Bodrato's sequence. The signed
+// intermediates go through Big arithmetic.
+static bool limbs_mul_toom3(uint64_t *r, const uint64_t *a, size_t an,
+                            const uint64_t *b, size_t bn) {
+    size_t k = (an + 2) / 3;
+    const Big a0 = big_view(a, k), a1 = big_view(a + k, k), a2 = big_view(a + 2 * k, an - 2 * k);
+    size_t b0n = bn < k ? bn : k, b1n = bn - b0n < k ? bn - b0n : k;
+    const Big b0 = big_view(b, b0n), b1 = big_view(b + k, b1n);
+    const Big b2 = big_view(b + 2 * k, bn - b0n - b1n);
+
+    Big t[11] = {};
+    Big *p1 = &t[0], *pm1 = &t[1], *pm2 = &t[2], *q1 = &t[3], *qm1 = &t[4], *qm2 = &t[5];
+    Big *r0 = &t[6], *r1 = &t[7], *rm1 = &t[8], *rm2 = &t[9], *rinf = &t[10];
+
+    // p(1) = a0+a1+a2, p(-1) = a0-a1+a2, p(-2) = 2(p(-1)+a2)-a0
+    bool ok = big_copy(p1, &a0) && big_acc(p1, &a2, false) && big_copy(pm1, p1) &&
+              big_acc(p1, &a1, false) && big_acc(pm1, &a1, true) &&
+              big_copy(pm2, pm1) && big_acc(pm2, &a2, false) && big_acc(pm2, pm2, false) &&
+              big_acc(pm2, &a0, true) &&
+              big_copy(q1, &b0) && big_acc(q1, &b2, false) && big_copy(qm1, q1) &&
+              big_acc(q1, &b1, false) && big_acc(qm1, &b1, true) &&
+              big_copy(qm2, qm1) && big_acc(qm2, &b2, false) && big_acc(qm2, qm2, false) &&
+              big_acc(qm2, &b0, true) &&
+              big_mul(r0, &a0, &b0) && big_mul(r1, p1, q1) && big_mul(rm1, pm1, qm1) &&
+              big_mul(rm2, pm2, qm2) && big_mul(rinf, &a2, &b2);
+
+    // Interpolation: rm2 becomes r3 and rm1 becomes r2
+    if (ok) ok = big_acc(rm2, r1, true);              // r3 = (r(-2) - r(1)) / 3
+    if (ok) {
+        big_div_small(rm2, 3);
+        ok = big_acc(r1, rm1, true);                  // r1 = (r(1) - r(-1)) / 2
+    }
+    if (ok) {
+        big_half(r1);
+        ok = big_acc(rm1, r0, true);                  // r2 = r(-1) - r0
+    }
+    if (ok) ok = big_acc(rm2, rm1, true);             // r3 = (r2 - r3) / 2 + 2 rinf
+    if (ok) {
+        rm2->neg = rm2->n && !rm2->neg;
+        big_half(rm2);
+        ok = big_acc(rm2, rinf, false) && big_acc(rm2, rinf, false) &&
+             big_acc(rm1, r1, false) && big_acc(rm1, rinf, true) &&  // r2 += r1 - rinf
+             big_acc(r1, rm2, true);                                 // r1 -= r3
+    }
+
+    if (ok) {
+        // The coefficients are non-negative; add them in at multiples of k
+        size_t rn = an + bn;
+        const Big *coef[5] = {r0, r1, rm1, rm2, rinf};
+        memset(r, 0, rn * sizeof(*r));
+        for (size_t i = 0; i < 5; ++i) {
+            if (coef[i]->n) limbs_add_into(r + i * k, rn - i * k, coef[i]->d, coef[i]->n);
+        }
+    }
+    for (size_t i = 0; i < sizeof(t) / sizeof(t[0]); ++i) big_free(&t[i]);
+    return ok;
+}
+
+// Truncated division (Knuth algorithm D): q = a / b, r = a % b with the
+// sign of a, as fmod does
+static bool big_divmod(Big *q, Big *r, const Big *a, const Big *b) {
+    if (b->n == 0) return false;
+    *q = *r = (Big){};
+    if (limbs_cmp(a->d, a->n, b->d, b->n) < 0) {
+        if (!big_alloc(q, 0) || !big_alloc(r, a->n)) { big_free(q); return false; }
+        if (a->n) memcpy(r->d, a->d, a->n * sizeof(uint64_t));
+        r->neg = a->neg;
+        big_trim(r);
+        return true;
+    }
+
+    size_t n = b->n, m = a->n - b->n;
+    if (!big_alloc(q, m + 1) || !big_alloc(r, n)) {
+        big_free(q);
+        big_free(r);
+        return false;
+    }
+
+    if (n == 1) {
+        memcpy(q->d, a->d, a->n * sizeof(uint64_t));
+        q->n = a->n;
+        r->d[0] = big_div_small(q, b->d[0]);
+    } else {
+        // Normalise so the divisor's top bit is set
+        int s = __builtin_clzll(b->d[n - 1]);
+        uint64_t *un = calloc(a->n + 1 + n, sizeof(uint64_t));
+        if (!un) { big_free(q); big_free(r); return false; }
+        uint64_t *vn = un + a->n + 1;
+        for (size_t i = n; i-- > 0;) {
+            vn[i] = (b->d[i] << s) | (s && i ? b->d[i - 1] >> (64 - s) : 0);
+        }
+        un[a->n] = s ? a->d[a->n - 1] >> (64 - s) : 0;
+        for (size_t i = a->n; i-- > 0;) {
+            un[i] = (a->d[i] << s) | (s && i ? a->d[i - 1] >> (64 - s) : 0);
+        }
+
+        for (size_t j = m + 1; j-- > 0;) {
+            u128 num = ((u128)un[j + n] << 64) | un[j + n - 1];
+            u128 qhat = num / vn[n - 1];
+            u128 rhat = num % vn[n - 1];
+            while (qhat >> 64 || qhat * vn[n - 2] > ((rhat << 64) | un[j + n - 2])) {
+                --qhat;
+                rhat += vn[n - 1];
+                if (rhat >> 64) break;
+            }
+
+            // un[j..j+n] -= qhat * vn
+            uint64_t borrow = 0, carry = 0;
+            for (size_t i = 0; i < n; ++i) {
+                u128 p = qhat * vn[i] + carry;
+                carry = (uint64_t)(p >> 64);
+                uint64_t sub = (uint64_t)p;
+                uint64_t t = un[i + j] - sub - borrow;
+                borrow = (un[i + j] < sub) || (un[i + j] - sub < borrow);
+                un[i + j] = t;
+            }
+            uint64_t t = un[j + n] - carry - borrow;
+            borrow = (un[j + n] < carry) || (un[j + n] - carry < borrow);
+            un[j + n] = t;
+
+            if (borrow) {
+                // qhat was one too large: add the divisor back
+                --qhat;
+                un[j + n] += limbs_add(un + j, un + j, n, vn, n);
+            }
+            q->d[j] = (uint64_t)qhat;
+        }
+
+        for (size_t i = 0; i < n; ++i) {
+            r->d[i] = (un[i] >> s) | (s ? un[i + 1] << (64 - s) : 0);
+        }
+        free(un);
+    }
+
+    q->neg = a->neg != b->neg;
+    r->neg = a->neg;
+    big_trim(q);
+    big_trim(r);
+    return true;
+}
+
+static bool big_pow(Big *r, const Big *base, uint64_t exp) {
+    if (exp > 0 && big_bits(base) > 1 && (big_bits(base) - 1) * exp > BIG_MAX_BITS) return false;
+    Big acc, sq;
+    if (!big_from_u64(&acc, 1)) return false;
+    if (!big_alloc(&sq, base->n)) { big_free(&acc); return false; }
+    if (base->n) memcpy(sq.d, base->d, base->n * sizeof(uint64_t));
+    sq.neg = base->neg;
+
+    bool ok = true;
+    while (ok && exp) {
+        Big t;
+        if (exp & 1) {
+            ok = big_mul(&t, &acc, &sq);
+            if (ok) { big_free(&acc); acc = t; }
+        }
+        exp >>= 1;
+        if (ok && exp) {
+            ok = big_mul(&t, &sq, &sq);
+            if (ok) { big_free(&sq); sq = t; }
+        }
+        if (g_interrupted) ok = false;
+    }
+    big_free(&sq);
+    if (!ok) { big_free(&acc); return false; }
+    *r = acc;
+    return true;
+}
+
+// Product of lo..hi by recursive halving, so the big multiplications are
+// balanced and hit Karatsuba
+static bool big_prod_range(Big *r, uint64_t lo, uint64_t hi) {
+    if (hi - lo < 16) {
+        if (!big_from_u64(r, lo)) return false;
+        for (uint64_t k = lo + 1; k <= hi; ++k) {
+            if (!big_mul_add_small(r, k, 0)) { big_free(r); return false; }
+        }
+        return true;
+    }
+    uint64_t mid = lo + (hi - lo) / 2;
+    Big a, b;
+    if (!big_prod_range(&a, lo, mid)) return false;
+    if (!big_prod_range(&b, mid + 1, hi)) { big_free(&a); return false; }
+    bool ok = !g_interrupted && big_mul(r, &a, &b);
+    big_free(&a);
+    big_free(&b);
+    return ok;
+}
+
+// Shifts and bitwise operations on non-negative values
+static bool big_shift(Big *r, const Big *a, uint64_t bits, bool left) {
+    if (left && big_bits(a) + bits > BIG_MAX_BITS) return false;
+    size_t limbs = (size_t)(bits / 64);
+    int s = (int)(bits % 64);
+    if (left) {
+        if (!big_alloc(r, a->n + limbs + 1)) return false;
+        for (size_t i = 0; i < a->n; ++i) {
+            r->d[i + limbs] |= a->d[i] << s;
+            if (s) r->d[i + limbs + 1] = a->d[i] >> (64 - s);
+        }
+    } else {
+        if (limbs >= a->n) return big_alloc(r, 0);
+        if (!big_alloc(r, a->n - limbs)) return false;
+        for (size_t i = 0; i < r->n; ++i) {
+            uint64_t hi = i + limbs + 1 < a->n ? a->d[i + limbs + 1] : 0;
+            r->d[i] = (a->d[i + limbs] >> s) | (s ? hi << (64 - s) : 0);
+        }
+    }
+    big_trim(r);
+    return true;
+}
+
+static bool big_bitop(Big *r, const Big *a, const Big *b, char op) {
+    size_t n = a->n > b->n ? a->n : b->n;
+    if (!big_alloc(r, n)) return false;
+    for (size_t i = 0; i < n; ++i) {
+        uint64_t x = i < a->n ? a->d[i] : 0, y = i < b->n ? b->d[i] : 0;
+        r->d[i] = op == '&' ? x & y : op == '|' ? x | y : x ^ y;
+    }
+    big_trim(r);
+    return true;
+}
+
+// --- conversion ------------------------------------------------------------
+
+// Decimal conversion splits the number at 10^(19 * 2^k) and recurses on
+// both halves, so the work is in a few large divisions or multiplications
+// rather than one pass per 19 digits.
+constexpr size_t DEC_CHUNK = 19;                 // digits per limb step
+constexpr uint64_t DEC_CHUNK_POW = 10000000000000000000ULL;
+constexpr size_t DEC_BASECASE = 32 * DEC_CHUNK;  // digits done directly
+constexpr int DEC_POWERS = 32;
+
+static Big dec_pow[DEC_POWERS];  // 10^(19 * 2^k), squared up on demand
+
+static const Big *dec_power(int k) {
+    if (dec_pow[k].d) return &dec_pow[k];
+    if (k == 0) {
+        if (!big_from_u64(&dec_pow[0], DEC_CHUNK_POW)) return nullptr;
+    } else {
+        const Big *half = dec_power(k - 1);
+        if (!half || !big_mul(&dec_pow[k], half, half)) return nullptr;
+    }
+    return &dec_pow[k];
+}
+
+// Largest k with 19 * 2^k < digits, so the low part is at least half
+static int dec_split(size_t digits) {
+    int k = 0;
+    while ((DEC_CHUNK << (k + 1)) < digits) ++k;
+    return k;
+}
+
+static bool dec_parse(Big *r, const char *s, size_t len) {
+    if (g_interrupted) return false;
+    if (len <= DEC_BASECASE) {
+        if (!big_alloc(r, 0)) return false;
+        for (size_t i = 0; i < len;) {
+            uint64_t chunk = 0, scale = 1;
+            for (size_t k = 0; k < DEC_CHUNK && i < len; ++k, ++i) {
+                if (!isdigit((unsigned char)s[i])) { big_free(r); return false; }
+                chunk = chunk * 10 + (uint64_t)(s[i] - '0');
+                scale *= 10;
+            }
+            if (!big_mul_add_small(r, scale, chunk)) { big_free(r); return false; }
+            big_trim(r);
+        }
+        return true;
+    }
+
+    // value = high * 10^lo_digits + low
+    int k = dec_split(len);
+    size_t lo_digits = DEC_CHUNK << k;
+    const Big *scale = dec_power(k);
+    Big hi, lo, t;
+    if (!scale || !dec_parse(&hi, s, len - lo_digits)) return false;
+    if (!dec_parse(&lo, s + len - lo_digits, lo_digits)) { big_free(&hi); return false; }
+    bool ok = big_mul(&t, &hi, scale);
+    if (ok) {
+        ok = big_add(r, &t, &lo);
+        big_free(&t);
+    }
+    big_free(&hi);
+    big_free(&lo);
+    return ok;
+}
+
+// Write |a| as exactly width digits, zero-padded; a must be < 10^width
+static bool dec_fill(const Big *a, char *out, size_t width) {
+    if (g_interrupted) return false;
+    if (width <= DEC_BASECASE) {
+        Big t;
+        if (!big_copy(&t, a)) return false;
+        char *p = out + width;
+        while (p > out) {
+            uint64_t chunk = big_div_small(&t, DEC_CHUNK_POW);
+            for (size_t k = 0; k < DEC_CHUNK && p > out; ++k) {
+                *--p = (char)('0' + chunk % 10);
+                chunk /= 10;
+            }
+        }
+        big_free(&t);
+        return true;
+    }
+
+    int k = dec_split(width);
+    size_t lo_digits = DEC_CHUNK << k;
+    const Big *scale = dec_power(k);
+    Big mag = {.d = a->d, .n = a->n}, q, r;
+    if (!scale || !big_divmod(&q, &r, &mag, scale)) return false;
+    bool ok = dec_fill(&q, out, width - lo_digits) &&
+              dec_fill(&r, out + width - lo_digits, lo_digits);
+    big_free(&q);
+    big_free(&r);
+    return ok;
+}
+
+// Parse an integer literal (decimal, 0x, 0b, 0o); false for anything else
+static bool big_parse(Big *r, const char *s, size_t len) {
+    int bits = 0;
+    if (len > 2 && s[0] == '0') {
+        char c = (char)tolower((unsigned char)s[1]);
+        bits = c == 'x' ? 4 : c == 'b' ? 1 : c == 'o' ? 3 : 0;
+    }
+    if (!bits) return dec_parse(r, s, len);
+
+    // Power-of-two bases pack straight into limbs from the last digit
+    s += 2;
+    len -= 2;
+    if (!big_alloc(r, (len * (size_t)bits + 63) / 64)) return false;
+    for (size_t i = 0; i < len; ++i) {
+        int c = tolower((unsigned char)s[len - 1 - i]);
+        uint64_t digit = isdigit(c) ? (uint64_t)(c - '0') : c >= 'a' && c <= 'f' ? (uint64_t)(c - 'a' + 10) : 99;
+        if (digit >= 1u << bits) { big_free(r); return false; }
+        for (int k = 0; k < bits; ++k) {
+            size_t bit = i * (size_t)bits + (size_t)k;
+            r->d[bit / 64] |= (digit >> k & 1) << (bit % 64);
+        }
+    }
+    big_trim(r);
+    return true;
+}
+
+static bool big_from_double(Big *r, double v) {
+    if (!(fabs(v) < 9007199254740992.0) || v != floor(v)) return false;
+    if (!big_from_u64(r, (uint64_t)fabs(v))) return false;
+    r->neg = v < 0 && r->n;
+    return true;
+}
+
+// Nearest double from the top two limbs (inf past the double range)
+static double big_to_double(const Big *a) {
+    double v = 0;
+    for (size_t i = a->n > 2 ? a->n - 2 : 0; i < a->n; ++i) v += ldexp((double)a->d[i], (int)(64 * i));
+    return a->neg ? -v : v;
+}
+
+// Format in the given output format; returns a malloc'd string
+static char *big_format(const Big *a, OutputFormat fmt) {
+    if (fmt == FMT_FACTOR && a->n <= 1) {
+        char *out = malloc(256);
+        if (out) format_factors(out, 256, big_u64(a), a->neg);
+        return out;
+    }
+
+    const char *prefix = fmt == FMT_HEX ? "0x" : fmt == FMT_BIN ? "0b" : fmt == FMT_OCT ? "0o" : "";
+    int bits_per_digit = fmt == FMT_HEX ? 4 : fmt == FMT_BIN ? 1 : fmt == FMT_OCT ? 3 : 0;
+    uint64_t bits = big_bits(a);
+    size_t width = bits_per_digit ? (size_t)(bits + (uint64_t)bits_per_digit - 1) / (size_t)bits_per_digit
+                                  : (size_t)(bits * 30103 / 100000) + 1;  // log10(2)
+    if (width == 0) width = 1;
+
+    char *out = malloc(width + 4);
+    if (!out) return nullptr;
+    char *digits = out + 3;
+    if (bits_per_digit) {
+        for (size_t i = 0; i < width; ++i) {
+            unsigned digit = 0;
+            for (int k = bits_per_digit - 1; k >= 0; --k) {
+                uint64_t b = i * (uint64_t)bits_per_digit + (uint64_t)k;
+                digit = digit << 1 | (b < bits ? (unsigned)(a->d[b / 64] >> (b % 64) & 1) : 0);
+            }
+            digits[width - 1 - i] = "0123456789ABCDEF"[digit];
+        }
+    } else if (!dec_fill(a, digits, width)) {
+        free(out);
+        return nullptr;
+    }
+    digits[width] = '\0';
+    while (digits[0] == '0' && digits[1]) ++digits;
+
+    size_t plen = strlen(prefix);
+    digits -= plen;
+    memcpy(digits, prefix, plen);
+    if (a->neg) *--digits = '-';
+    memmove(out, digits, strlen(digits) + 1);
+    return out;
+}
+
+// --- evaluation ------------------------------------------------------------
+
+static bool big_eval(const Expr *e, int n, Big *out);
+
+// Keep the exact value of an integer result stored in name
+static void var_set_exact(const char *name, const Big *a) {
+    int i = find_var(name);
+    if (i < 0 || vars[i].formula || a->n == 0) return;
+    free(vars[i].exact);
+    vars[i].exact = big_fits_u64(a) && big_u64(a) < 9007199254740992ULL
+                  ? nullptr : big_format(a, FMT_DEC);
+}
+
+// A variable's exact value: bindings are re-evaluated exactly, plain
+// values use the digits kept by var_set_exact
+static bool big_var(const char *name, Big *out) {
+    double val = get_var(name);
+    int i = find_var(name);
+    if (i < 0 || isnan(val)) return big_from_double(out, val);
+
+    if (vars[i].formula && !vars[i].busy) {
+        Expr e;
+        Parser p = {.src = vars[i].formula, .pos = vars[i].formula};
+        next_token(&p);
+        int root = compile(&e, &p);
+        vars[i].busy = true;
+        bool ok = big_eval(&e, root, out);
+        vars[i].busy = false;
+        return ok;
+    }
+    const char *digits = vars[i].exact;
+    if (!digits) return big_from_double(out, val);
+    bool neg = *digits == '-';
+    if (!big_parse(out, digits + neg, strlen(digits + neg))) return false;
+    out->neg = neg;
+    return true;
+}
+
+static bool big_eval_u64(const Expr *e, int n, uint64_t *out) {
+    Big a;
+    if (!big_eval(e, n, &a)) return false;
+    bool ok = big_fits_u64(&a);
+    *out = big_u64(&a);
+    big_free(&a);
+    return ok;
+}
+
+static bool big_binary(char op, Big *r, const Big *a, const Big *b) {
+    Big q, rem;
+    switch (op) {
+        case '+': return big_add(r, a, b);
+        case '-': return big_sub(r, a, b);
+        case '*': return big_mul(r, a, b);
+        case '/':
+        case '%':
+            // Division must be exact to stay an integer
+            if (!big_divmod(&q, &rem, a, b)) return false;
+            if (op == '/' && rem.n) { big_free(&q); big_free(&rem); return false; }
+            *r = op == '/' ? q : rem;
+            big_free(op == '/' ? &rem : &q);
+            return true;
+        case '^':
+            return big_fits_u64(b) && big_pow(r, a, big_u64(b));
+        case 'L':
+        case 'R':
+            return !a->neg && big_fits_u64(b) && big_shift(r, a, big_u64(b), op == 'L');
+        case '&':
+        case '|':
+        case 'x':
+            return !a->neg && !b->neg && big_bitop(r, a, b, op);
+    }
+    return false;
+}
+
+// Euclid on magnitudes; lcm = |a| / gcd * |b|
+static bool big_gcd_lcm(const Expr *e, const Node *nd, bool lcm, Big *r) {
+    Big a, b;
+    if (!big_eval(e, nd->args[0], &a)) return false;
+    if (!big_eval(e, nd->args[1], &b)) { big_free(&a); return false; }
+    a.neg = b.neg = false;
+
+    Big x = {}, y = {}, q, rem;
+    bool ok = big_copy(&x, &a) && big_copy(&y, &b);
+    while (ok && y.n && !g_interrupted) {
+        ok = big_divmod(&q, &rem, &x, &y);
+        if (ok) {
+            big_free(&q);
+            big_free(&x);
+            x = y;
+            y = rem;
+        }
+    }
+    big_free(&y);
+    ok = ok && !g_interrupted;
+
+    if (ok && lcm && x.n) {
+        ok = big_divmod(&q, &rem, &a, &x);
+        if (ok) {
+            big_free(&rem);
+            big_free(&x);
+            ok = big_mul(&x, &q, &b);
+            big_free(&q);
+        }
+    }
+    if (ok) *r = x;
+    else big_free(&x);
+    big_free(&a);
+    big_free(&b);
+    return ok;
+}
+
+static bool big_call(const Expr *e, const Node *nd, Big *r) {
+    const char *name = e->names + nd->name;
+
+    if (buf_reduction(e, nd)) {
+        double v = buf_reduce(e, nd);
+        return !isnan(v) && big_from_u64(r, (uint64_t)v);
+    }
+
+    U64Fn *fn = is_bit_func(name, nd->nargs) ? bit_func :
+                is_hash_func(name, nd->nargs) ? hash_func : nullptr;
+    if (fn) {
+        uint64_t args[3], v;
+        for (int i = 0; i < nd->nargs; ++i) {
+            if (!big_eval_u64(e, nd->args[i], &args[i])) return false;
+        }
+        return fn(name, nd->nargs, args, &v) && big_from_u64(r, v);
+    }
+    if (e->nodes[nd->args[0]].kind == N_STR) {
+        uint64_t v;
+        return nd->nargs == 1 && file_hash(name, &e->nodes[nd->args[0]], &v) && big_from_u64(r, v);
+    }
+
+    if (nd->nargs == 1) {
+        // Format converters pass the value through
+        if (strcmp(name, "hex") == 0 || strcmp(name, "bin") == 0 ||
+            strcmp(name, "oct") == 0 || strcmp(name, "dec") == 0 ||
+            strcmp(name, "factor") == 0 || strcmp(name, "floor") == 0 || strcmp(name, "ceil") == 0 ||
+            strcmp(name, "round") == 0) {
+            return big_eval(e, nd->args[0], r);
+        }
+        if (strcmp(name, "abs") == 0) {
+            if (!big_eval(e, nd->args[0], r)) return false;
+            r->neg = false;
+            return true;
+        }
+        // Complements keep their native widths
+        uint64_t v, mask = strcmp(name, "bnot") == 0 ? UINT64_MAX :
+                           strcmp(name, "not8") == 0 ? UINT8_MAX :
+                           strcmp(name, "not16") == 0 ? UINT16_MAX :
+                           strcmp(name, "not32") == 0 ? UINT32_MAX : 0;
+        if (mask) return big_eval_u64(e, nd->args[0], &v) && big_from_u64(r, ~v & mask);
+        if (strcmp(name, "isprime") == 0 || strcmp(name, "nextprime") == 0 ||
+            strcmp(name, "totient") == 0) {
+            uint64_t n, p;
+            if (!big_eval_u64(e, nd->args[0], &n)) return false;
+            if (name[0] == 'i') return big_from_u64(r, is_prime_u64(n));
+            if (name[0] == 't') return big_from_u64(r, totient_u64(n));
+            return next_prime_u64(n, &p) && big_from_u64(r, p);
+        }
+        if (strcmp(name, "primepi") == 0 || strcmp(name, "nthprime") == 0) {
+            uint64_t n, p;
+            return big_eval_u64(e, nd->args[0], &n) && prime_count_fn(name, n, &p) &&
+                   big_from_u64(r, p);
+        }
+        if (strcmp(name, "factorial") == 0) {
+            uint64_t k;
+            if (!big_eval_u64(e, nd->args[0], &k) || k > 10000000) return false;
+            return k < 2 ? big_from_u64(r, 1) : big_prod_range(r, 2, k);
+        }
+        return false;
+    }
+
+    // Modular functions take 64-bit arguments
+    uint64_t args[3], v;
+    if (strcmp(name, "modpow") == 0 || strcmp(name, "mulmod") == 0 || strcmp(name, "modinv") == 0) {
+        for (int i = 0; i < nd->nargs && i < 3; ++i) {
+            if (!big_eval_u64(e, nd->args[i], &args[i])) return false;
+        }
+        return modular(name, nd->nargs, args, &v) && big_from_u64(r, v);
+    }
+
+    if (nd->nargs != 2) return false;
+    if (strcmp(name, "gcd") == 0 || strcmp(name, "lcm") == 0) return big_gcd_lcm(e, nd, name[0] == 'l', r);
+    char op = strcmp(name, "pow") == 0 ? '^' : strcmp(name, "mod") == 0 ? '%' :
+              strcmp(name, "shl") == 0 ? 'L' : strcmp(name, "shr") == 0 ? 'R' :
+              strcmp(name, "band") == 0 ? '&' : strcmp(name, "bor") == 0 ? '|' :
+              strcmp(name, "bxor") == 0 ? 'x' :
+              strcmp(name, "max") == 0 ? '>' : strcmp(name, "min") == 0 ? '<' : 0;
+    if (!op) return false;
+
+    Big a, b;
+    if (!big_eval(e, nd->args[0], &a)) return false;
+    if (!big_eval(e, nd->args[1], &b)) { big_free(&a); return false; }
+    bool ok;
+    if (op == '>' || op == '<') {
+        Big diff;
+        ok = big_sub(&diff, &a, &b);
+        bool a_wins = ok && (op == '>' ? !diff.neg : diff.neg || diff.n == 0);
+        if (ok) big_free(&diff);
+        *r = a_wins ? a : b;
+        big_free(a_wins ? &b : &a);
+        return ok;
+    }
+    ok = big_binary(op, r, &a, &b);
+    big_free(&a);
+    big_free(&b);
+    return ok;
+}
+
+// Exact integer evaluation of a tree; false when it is not integer arithmetic
+static bool big_eval(const Expr *e, int n, Big *out) {
+    const Node *nd = &e->nodes[n];
+    if (g_interrupted) return false;
+
+    switch ((NodeKind)nd->kind) {
+        case N_NUM:
+            return nd->lit && big_parse(out, nd->lit, nd->lit_len);
+        case N_VAR:
+            return big_var(e->names + nd->name, out);
+        case N_NEG:
+            if (!big_eval(e, nd->args[0], out)) return false;
+            out->neg = out->n ? !out->neg : false;
+            return true;
+        case N_NOT: {
+            uint64_t v;
+            return big_eval_u64(e, nd->args[0], &v) && big_from_u64(out, ~v);
+        }
+        case N_BIN: {
+            Big a, b;
+            if (!big_eval(e, nd->args[0], &a)) return false;
+            if (!big_eval(e, nd->args[1], &b)) { big_free(&a); return false; }
+            bool ok = big_binary(nd->op, out, &a, &b);
+            big_free(&a);
+            big_free(&b);
+            return ok;
+        }
+        case N_CALL:
+            return big_call(e, nd, out);
+        case N_MAT:
+        case N_STR:
+            return false;
+    }
+    return false;
+}
+
+// ============================================================================
+// Extended precision
+// ============================================================================
+
+// `--precision dd|qd` re-evaluates results on unevaluated sums of 2 or 4
+// doubles (double-double ~32 digits, quad-double ~64 digits). Sums and
+// products come from the error-free transforms two_sum and two_prod (fma)
+// and are renormalised; division is long division, and the elementary
+// functions use Newton steps or Taylor series on reduced arguments.
+// Bitwise and unit functions run on the leading double.
+
+constexpr int XP_MAX = 4;
+
+typedef struct {
+    double x[XP_MAX];   // non-overlapping parts, largest first
+} Xp;
+
+static int g_xp_len = 0;     // 0 (off), 2 (dd) or 4 (qd)
+
+static Xp g_xp_last;         // extended value of the last result
+static bool g_have_xp = false;
+
+static double two_sum(double a, double b, double *err) {
+    double s = a + b;
+    double bb = s - a;
+    *err = (a - (s - bb)) + (b - bb);
+    return s;
+}
+
+static double two_prod(double a, double b, double *err) {
+    double p = a * b;
+    *err = fma(a, b, -p);
+    return p;
+}
+
+static Xp xp_from(double v) {
+    return (Xp){.x = {v}};
+}
+
+// Exact sum of m terms (roughly largest first), rounded to g_xp_len parts
+static Xp xp_sum(const double *t, int m) {
+    int n = g_xp_len;
+    double r[XP_MAX + 1] = {};
+    double naive = 0.0;
+    for (int i = 0; i < m; ++i) {
+        double c = t[i];
+        naive += c;
+        for (int j = 0; j < n && c != 0.0; ++j) r[j] = two_sum(r[j], c, &c);
+        r[n] += c;
+    }
+    if (!isfinite(naive)) return xp_from(naive);
+
+    // Renormalise: carry up from the bottom, then peel off parts from the top
+    for (int j = n; j > 0; --j) r[j - 1] = two_sum(r[j - 1], r[j], &r[j]);
+    Xp out = {};
+    int k = 0;
+    double s = r[0];
+    for (int j = 1; j <= n && k < n - 1; ++j) {
+        double e;
+        s = two_sum(s, r[j], &e);
+        if (e != 0.0) {
+            out.x[k++] = s;
+            s = e;
+        }
+    }
+    out.x[k] += s;
+    return out;
+}
+
+static Xp xp_add(Xp a, Xp b) {
+    double t[2 * XP_MAX];
+    for (int i = 0; i < g_xp_len; ++i) {
+        t[2 * i] = a.x[i];
+        t[2 * i + 1] = b.x[i];
+    }
+    return xp_sum(t, 2 * g_xp_len);
+}
+
+static Xp xp_neg(Xp a) {
+    for (int i = 0; i < XP_MAX; ++i) a.x[i] = -a.x[i];
+    return a;
+}
+
+static Xp xp_sub(Xp a, Xp b) {
+    return xp_add(a, xp_neg(b));
+}
+
+static Xp xp_mul(Xp a, Xp b) {
+    double p = a.x[0] * b.x[0];
+    if (!isfinite(p) || p == 0.0) return xp_from(p);
+
+    // Partial products by significance; the lowest order keeps only its head
+    double t[2 * XP_MAX * XP_MAX];
+    int m = 0, n = g_xp_len;
+    for (int s = 0; s < n; ++s) {
+        for (int i = 0; i <= s; ++i) {
+            double e;
+            t[m++] = two_prod(a.x[i], b.x[s - i], &e);
+            t[m++] = e;
+        }
+    }
+    return xp_sum(t, m);
+}
+
+static Xp xp_mul_d(Xp a, double b) {
+    return xp_mul(a, xp_from(b));
+}
+
+static Xp xp_div(Xp a, Xp b) {
+    double q0 = a.x[0] / b.x[0];
+    if (!isfinite(q0) || q0 == 0.0) return xp_from(q0);
+
+    // Long division: one quotient digit per part, plus a guard
+    double q[XP_MAX + 1];
+    Xp r = a;
+    for (int i = 0; i <= g_xp_len; ++i) {
+        q[i] = r.x[0] / b.x[0];
+        r = xp_sub(r, xp_mul_d(b, q[i]));
+    }
+    return xp_sum(q, g_xp_len + 1);
+}
+
+static Xp xp_div_d(Xp a, double b) {
+    return xp_div(a, xp_from(b));
+}
+
+static int xp_sign(Xp a) {
+    return a.x[0] > 0 ? 1 : a.x[0] < 0 ? -1 : 0;
+}
+
+// Newton steps needed from a double start (each doubles the digits)
+static int xp_newton_steps(void) {
+    return g_xp_len == 2 ? 2 : 3;
+}
+
+// Series stop once terms fall below the last part
+static bool xp_negligible(Xp term, Xp sum) {
+    return fabs(term.x[0]) <= fabs(sum.x[0]) * ldexp(1.0, -53 * g_xp_len - 4);
+}
+
+static Xp xp_floor(Xp a) {
+    Xp r = {};
+    for (int i = 0; i < g_xp_len; ++i) {
+        r.x[i] = floor(a.x[i]);
+        if (r.x[i] != a.x[i]) break;
+    }
+    return xp_sum(r.x, g_xp_len);
+}
+
+static Xp xp_trunc(Xp a) {
+    return xp_sign(a) < 0 ? xp_neg(xp_floor(xp_neg(a))) : xp_floor(a);
+}
+
+static Xp xp_round(Xp a) {
+    Xp half = xp_from(0.5);
+    return xp_sign(a) < 0 ? xp_neg(xp_floor(xp_add(xp_neg(a), half))) : xp_floor(xp_add(a, half));
+}
+
+static Xp xp_sqrt(Xp a) {
+    double s = sqrt(a.x[0]);
+    if (!(a.x[0] > 0) || !isfinite(s)) return xp_from(s);
+    Xp x = xp_from(s);
+    for (int i = 0; i < xp_newton_steps(); ++i) {
+        x = xp_add(x, xp_div(xp_sub(a, xp_mul(x, x)), xp_mul_d(x, 2.0)));
+    }
+    return x;
+}
+
+static Xp xp_cbrt(Xp a) {
+    double s = cbrt(a.x[0]);
+    if (s == 0.0 || !isfinite(s)) return xp_from(s);
+    Xp x = xp_from(s);
+    for (int i = 0; i < xp_newton_steps(); ++i) {
+        Xp x2 = xp_mul(x, x);
+        x = xp_sub(x, xp_div(xp_sub(xp_mul(x2, x), a), xp_mul_d(x2, 3.0)));
+    }
+    return x;
+}
+
+// --- constants -------------------------------------------------------------
+
+// atan(1/inv) by its Taylor series
+static Xp xp_atan_inv(double inv) {
+    Xp power = xp_div(xp_from(1.0), xp_from(inv));
+    Xp sum = power;
+    for (int k = 1; k < 200; ++k) {
+        power = xp_div_d(power, -inv * inv);
+        Xp term = xp_div_d(power, 2 * k + 1);
+        sum = xp_add(sum, term);
+        if (xp_negligible(term, sum)) break;
+    }
+    return sum;
+}
+
+static Xp xp_pi(void) {
+    static Xp pi;
+    static int len;
+    if (len != g_xp_len) {
+        // Machin: pi = 16 atan(1/5) - 4 atan(1/239)
+        pi = xp_sub(xp_mul_d(xp_atan_inv(5), 16.0), xp_mul_d(xp_atan_inv(239), 4.0));
+        len = g_xp_len;
+    }
+    return pi;
+}
+
+static Xp xp_ln2(void) {
+    static Xp ln2;
+    static int len;
+    if (len != g_xp_len) {
+        // ln 2 = 2 atanh(1/3) = 2 sum 1 / ((2k+1) 3^(2k+1))
+        Xp power = xp_div(xp_from(1.0), xp_from(3.0));
+        Xp sum = power;
+        for (int k = 1; k < 200; ++k) {
+            power = xp_div_d(power, 9.0);
+            Xp term = xp_div_d(power, 2 * k + 1);
+            sum = xp_add(sum, term);
+            if (xp_negligible(term, sum)) break;
+        }
+        ln2 = xp_mul_d(sum, 2.0);
+        len = g_xp_len;
+    }
+    return ln2;
+}
+
+// --- exponential and logarithm ---------------------------------------------
+
+// exp(r) - 1 for |r| <= ln2/2: the series runs on r / 2^10, then
+// (1+s)^2 - 1 = s (2 + s) undoes the scaling without cancellation
+static Xp xp_expm1_reduced(Xp r) {
+    constexpr int SQUARINGS = 10;
+    Xp x = xp_mul_d(r, ldexp(1.0, -SQUARINGS));
+    Xp term = x, sum = x;
+    for (int i = 2; i < 100; ++i) {
+        term = xp_div_d(xp_mul(term, x), i);
+        sum = xp_add(sum, term);
+        if (xp_negligible(term, sum)) break;
+    }
+    for (int i = 0; i < SQUARINGS; ++i) sum = xp_mul(sum, xp_add(sum, xp_from(2.0)));
+    return sum;
+}
+
+static Xp xp_scale2(Xp a, int k) {
+    for (int i = 0; i < XP_MAX; ++i) a.x[i] = ldexp(a.x[i], k);
+    return a;
+}
+
+static Xp xp_exp(Xp a) {
+    double e = exp(a.x[0]);
+    if (!isfinite(e) || e == 0.0) return xp_from(e);
+
+    // exp(a) = 2^k exp(r) with r = a - k ln2
+    double k = nearbyint(a.x[0] / M_LN2);
+    Xp r = xp_sub(a, xp_mul_d(xp_ln2(), k));
+    return xp_scale2(xp_add(xp_expm1_reduced(r), xp_from(1.0)), (int)k);
+}
+
+static Xp xp_expm1(Xp a) {
+    if (fabs(a.x[0]) <= M_LN2 / 2) return xp_expm1_reduced(a);
+    return xp_sub(xp_exp(a), xp_from(1.0));
+}
+
+static Xp xp_log(Xp a) {
+    double l = log(a.x[0]);
+    if (!isfinite(l)) return xp_from(l);
+
+    // Near 1 the Newton correction cancels; log a = 2 atanh f with
+    // f = (a-1)/(a+1) keeps every digit of a-1
+    if (fabs(a.x[0] - 1.0) < 0.125) {
+        Xp f = xp_div(xp_sub(a, xp_from(1.0)), xp_add(a, xp_from(1.0)));
+        Xp f2 = xp_mul(f, f), power = f, sum = f;
+        for (int k = 1; k < 100 && sum.x[0] != 0.0; ++k) {
+            power = xp_mul(power, f2);
+            Xp term = xp_div_d(power, 2 * k + 1);
+            sum = xp_add(sum, term);
+            if (xp_negligible(term, sum)) break;
+        }
+        return xp_mul_d(sum, 2.0);
+    }
+
+    // Newton on exp: x += a exp(-x) - 1
+    Xp x = xp_from(l);
+    for (int i = 0; i < xp_newton_steps(); ++i) {
+        x = xp_add(x, xp_sub(xp_mul(a, xp_exp(xp_neg(x))), xp_from(1.0)));
+    }
+    return x;
+}
+
+static Xp xp_pow(Xp a, Xp b) {
+    // Integer exponents by repeated squaring, exact where the result fits
+    double n = b.x[0];
+    if (n == floor(n) && fabs(n) <= 1 << 20 && b.x[1] == 0.0) {
+        Xp result = xp_from(1.0), base = a;
+        for (uint32_t k = (uint32_t)fabs(n); k; k >>= 1) {
+            if (k & 1) result = xp_mul(result, base);
+            if (k > 1) base = xp_mul(base, base);
+        }
+        return n < 0 ? xp_div(xp_from(1.0), result) : result;
+    }
+    if (a.x[0] > 0) return xp_exp(xp_mul(b, xp_log(a)));
+    return xp_from(pow(a.x[0], b.x[0]));
+}
+
+// --- trigonometry ----------------------------------------------------------
+
+// sin and cos together, after reducing by the nearest multiple of pi/2
+static void xp_sincos(Xp a, Xp *s, Xp *c) {
+    if (!isfinite(a.x[0])) {
+        *s = *c = xp_from(NAN);
+        return;
+    }
+    double k = nearbyint(a.x[0] / (M_PI / 2));
+    Xp r = xp_sub(a, xp_mul_d(xp_pi(), k / 2));
+
+    Xp r2 = xp_mul(r, r);
+    Xp ts = r, tc = xp_from(1.0), ss = ts, cc = tc;
+    for (int i = 1; i < 100; ++i) {
+        tc = xp_div_d(xp_mul(tc, r2), -(double)((2 * i - 1) * (2 * i)));
+        ts = xp_div_d(xp_mul(ts, r2), -(double)((2 * i) * (2 * i + 1)));
+        cc = xp_add(cc, tc);
+        ss = xp_add(ss, ts);
+        if (xp_negligible(tc, cc) && (ss.x[0] == 0.0 || xp_negligible(ts, ss))) break;
+    }
+
+    switch ((int)fmod(fmod(k, 4.0) + 4.0, 4.0)) {
+        case 0: *s = ss; *c = cc; break;
+        case 1: *s = cc; *c = xp_neg(ss); break;
+        case 2: *s = xp_neg(ss); *c = xp_neg(cc); break;
+        default: *s = xp_neg(cc); *c = ss; break;
+    }
+}
+
+static Xp xp_atan(Xp a) {
+    if (isnan(a.x[0])) return a;
+
+    // Newton only converges for small arguments: atan a = ±pi/2 - atan(1/a)
+    if (fabs(a.x[0]) > 1.0) {
+        Xp half_pi = xp_mul_d(xp_pi(), a.x[0] > 0 ? 0.5 : -0.5);
+        return xp_sub(half_pi, xp_atan(xp_div(xp_from(1.0), a)));
+    }
+
+    // Newton on tan: x += (a cos x - sin x) cos x
+    Xp x = xp_from(atan(a.x[0]));
+    for (int i = 0; i < xp_newton_steps(); ++i) {
+        Xp s, c;
+        xp_sincos(x, &s, &c);
+        x = xp_add(x, xp_mul(xp_sub(xp_mul(a, c), s), c));
+    }
+    return x;
+}
+
+// asin a = atan(a / sqrt((1-a)(1+a))); at ±1 the quotient is ±inf and
+// atan gives exactly ±pi/2
+static Xp xp_asin(Xp a) {
+    Xp one = xp_from(1.0);
+    Xp c2 = xp_mul(xp_sub(one, a), xp_add(one, a));
+    if (xp_sign(c2) < 0) return xp_from(NAN);
+    return xp_atan(xp_div(a, xp_sqrt(c2)));
+}
+
+// acos a = 2 atan(sqrt((1-a)/(1+a))), exact at both ends and without the
+// cancellation of pi/2 - asin a near 1
+static Xp xp_acos(Xp a) {
+    Xp one = xp_from(1.0);
+    Xp t2 = xp_div(xp_sub(one, a), xp_add(one, a));
+    if (xp_sign(t2) < 0 || isnan(t2.x[0])) return xp_from(NAN);
+    return xp_mul_d(xp_atan(xp_sqrt(t2)), 2.0);
+}
+
+static Xp xp_atan2(Xp y, Xp x) {
+    if (x.x[0] == 0.0 && y.x[0] != 0.0) return xp_mul_d(xp_pi(), y.x[0] > 0 ? 0.5 : -0.5);
+    if (x.x[0] == 0.0) return fabs(atan2(y.x[0], x.x[0])) > 3.0 ? xp_mul_d(xp_pi(), copysign(1.0, y.x[0]))
+                                                               : xp_from(atan2(y.x[0], x.x[0]));
+    Xp r = xp_atan(xp_div(y, x));
+    if (x.x[0] > 0) return r;
+    return y.x[0] >= 0 ? xp_add(r, xp_pi()) : xp_sub(r, xp_pi());
+}
+
+// --- evaluation ------------------------------------------------------------
+
+static Xp xp_eval(const Expr *e, int n);
+
+// Decimal literal digits scaled by an exact power of ten
+static Xp xp_literal(const Node *nd) {
+    const char *s = nd->lit, *end = nd->lit + nd->lit_len;
+    if (!s || (end - s > 1 && s[0] == '0' && isalpha((unsigned char)s[1]))) return xp_from(nd->num);
+
+    Xp m = {};
+    int exp10 = 0;
+    bool frac = false;
+    for (; s < end && (isdigit((unsigned char)*s) || *s == '.'); ++s) {
+        if (*s == '.') { frac = true; continue; }
+        m = xp_add(xp_mul_d(m, 10.0), xp_from(*s - '0'));
+        if (frac) --exp10;
+    }
+    if (s < end && (*s == 'e' || *s == 'E')) exp10 += atoi(s + 1);
+    if (exp10 == 0) return m;
+
+    Xp scale = xp_pow(xp_from(10.0), xp_from(abs(exp10)));
+    return exp10 > 0 ? xp_mul(m, scale) : xp_div(m, scale);
+}
+
+static Xp xp_var(const char *name) {
+    double v = get_var(name);
+    int i = find_var(name);
+    if (i >= 0 && vars[i].value == v) {
+        Xp r = {.x = {v}};
+        for (int k = 1; k < g_xp_len; ++k) r.x[k] = vars[i].tail[k - 1];
+        return r;
+    }
+    if (i < 0 && (strcmp(name, "pi") == 0 || strcmp(name, "PI") == 0)) return xp_pi();
+    if (i < 0 && (strcmp(name, "e") == 0 || strcmp(name, "E") == 0)) return xp_exp(xp_from(1.0));
+    return xp_from(v);
+}
+
+static Xp xp_call(const Expr *e, const Node *nd) {
+    const char *name = e->names + nd->name;
+    if (nd->nargs == 4 || strcmp(name, "diff") == 0) return xp_from(NAN);  // integrate() etc. stay in double
+    if (data_call(e, nd)) return xp_from(call_data(e, nd));
+    Xp a = xp_eval(e, nd->args[0]);
+
+    if (nd->nargs == 1) {
+        if (strcmp(name, "sqrt") == 0) return xp_sqrt(a);
+        if (strcmp(name, "cbrt") == 0) return xp_cbrt(a);
+        if (strcmp(name, "exp") == 0) return xp_exp(a);
+        if (strcmp(name, "log") == 0 || strcmp(name, "ln") == 0) return xp_log(a);
+        if (strcmp(name, "log10") == 0) return xp_div(xp_log(a), xp_log(xp_from(10.0)));
+        if (strcmp(name, "log2") == 0) return xp_div(xp_log(a), xp_ln2());
+        if (strcmp(name, "abs") == 0) return xp_sign(a) < 0 ? xp_neg(a) : a;
+        if (strcmp(name, "floor") == 0) return xp_floor(a);
+        if (strcmp(name, "ceil") == 0) return xp_neg(xp_floor(xp_neg(a)));
+        if (strcmp(name, "round") == 0) return xp_round(a);
+        if (strcmp(name, "atan") == 0) return xp_atan(a);
+        if (strcmp(name, "asin") == 0) return xp_asin(a);
+        if (strcmp(name, "acos") == 0) return xp_acos(a);
+
+        Xp s, c;
+        if (strcmp(name, "sin") == 0) { xp_sincos(a, &s, &c); return s; }
+        if (strcmp(name, "cos") == 0) { xp_sincos(a, &s, &c); return c; }
+        if (strcmp(name, "tan") == 0) { xp_sincos(a, &s, &c); return xp_div(s, c); }
+
+        // Hyperbolics from expm1 so small arguments keep their digits
+        if (strcmp(name, "sinh") == 0 || strcmp(name, "cosh") == 0) {
+            Xp em1 = xp_expm1(a);
+            Xp inv = xp_div(em1, xp_add(em1, xp_from(1.0)));  // 1 - exp(-a)
+            Xp r = strcmp(name, "sinh") == 0 ? xp_add(em1, inv)
+                                             : xp_add(xp_sub(em1, inv), xp_from(2.0));
+            return xp_mul_d(r, 0.5);
+        }
+        if (strcmp(name, "tanh") == 0) {
+            if (fabs(a.x[0]) > 200) return xp_from(a.x[0] > 0 ? 1.0 : -1.0);
+            Xp em1 = xp_expm1(xp_mul_d(a, 2.0));
+            return xp_div(em1, xp_add(em1, xp_from(2.0)));
+        }
+        if (strcmp(name, "factorial") == 0 && a.x[0] == floor(a.x[0]) && a.x[0] >= 0 && a.x[0] <= 1000) {
+            Xp r = xp_from(1.0);
+            for (int k = 2; k <= (int)a.x[0]; ++k) r = xp_mul_d(r, k);
+            return r;
+        }
+
+        // Format converters keep the value; the rest work on the leading part
+        double v = call_func(name, a.x[0]);
+        if (strcmp(name, "hex") == 0 || strcmp(name, "bin") == 0 ||
+            strcmp(name, "oct") == 0 || strcmp(name, "dec") == 0) {
+            return a;
+        }
+        return xp_from(v);
+    }
+
+    Xp b = xp_eval(e, nd->args[1]);
+    if (nd->nargs == 2) {
+        if (strcmp(name, "pow") == 0) return xp_pow(a, b);
+        if (strcmp(name, "atan2") == 0) return xp_atan2(a, b);
+        if (strcmp(name, "max") == 0) return xp_sign(xp_sub(a, b)) >= 0 || isnan(b.x[0]) ? a : b;
+        if (strcmp(name, "min") == 0) return xp_sign(xp_sub(a, b)) <= 0 || isnan(b.x[0]) ? a : b;
+        if (strcmp(name, "mod") == 0) return xp_sub(a, xp_mul(xp_trunc(xp_div(a, b)), b));
+        return xp_from(call_func2(name, a.x[0], b.x[0]));
+    }
+    if (nd->nargs == 3) return xp_from(call_func3(name, a.x[0], b.x[0], xp_eval(e, nd->args[2]).x[0]));
+    return xp_from(NAN);
+}
+
+static Xp xp_eval(const Expr *e, int n) {
+    const Node *nd = &e->nodes[n];
+    switch ((NodeKind)nd->kind) {
+        case N_NUM:
+            return xp_literal(nd);
+        case N_VAR:
+            return xp_var(e->names + nd->name);
+        case N_NEG:
+            return xp_neg(xp_eval(e, nd->args[0]));
+        case N_NOT:
+            return xp_from((double)(~to_u64(xp_eval(e, nd->args[0]).x[0])));
+        case N_BIN: {
+            Xp a = xp_eval(e, nd->args[0]);
+            Xp b = xp_eval(e, nd->args[1]);
+            switch (nd->op) {
+                case '+': return xp_add(a, b);
+                case '-': return xp_sub(a, b);
+                case '*': return xp_mul(a, b);
+                case '/': return xp_div(a, b);
+                case '%': return xp_sub(a, xp_mul(xp_trunc(xp_div(a, b)), b));
+                case '^': return xp_pow(a, b);
+            }
+            return xp_from(binary_op(nd->op, a.x[0], b.x[0]));
+        }
+        case N_CALL:
+            return xp_call(e, nd);
+        case N_MAT:
+        case N_STR:
+            break;
+    }
+    return xp_from(NAN);
+}
+
+// Evaluate quietly (the double pass has already reported any errors)
+static Xp xp_eval_quiet(const Expr *e, int root) {
+    bool quiet = g_quiet;
+    OutputFormat fmt = g_output_fmt;
+    g_quiet = true;
+    Xp r = xp_eval(e, root);
+    g_quiet = quiet;
+    g_output_fmt = fmt;
+    return r;
+}
+
+// Decimal text with all the digits of the current precision
+static void xp_format(char *out, size_t size, Xp a) {
+    int digits = g_xp_len == 2 ? 31 : 62;
+    if (!isfinite(a.x[0]) || a.x[0] == 0.0) {
+        snprintf(out, size, "%.12g", a.x[0] + 0.0);
+        return;
+    }
+    bool neg = a.x[0] < 0;
+    if (neg) a = xp_neg(a);
+
+    // Scale into [1, 10)
+    int e10 = (int)floor(log10(a.x[0]));
+    Xp scale = xp_pow(xp_from(10.0), xp_from(abs(e10)));
+    Xp y = e10 >= 0 ? xp_div(a, scale) : xp_mul(a, scale);
+    if (xp_sign(xp_sub(y, xp_from(10.0))) >= 0) { y = xp_div_d(y, 10.0); ++e10; }
+    if (xp_sign(xp_sub(y, xp_from(1.0))) < 0) { y = xp_mul_d(y, 10.0); --e10; }
+
+    // One digit at a time, plus one for rounding (the leading part alone
+    // may round up to the next digit, as in 1 - 2^-80)
+    char d[72];
+    for (int i = 0; i <= digits; ++i) {
+        double digit = xp_floor(y).x[0];
+        if (digit > 9) digit = 9;
+        if (digit < 0) digit = 0;
+        d[i] = (char)('0' + (int)digit);
+        y = xp_mul_d(xp_sub(y, xp_from(digit)), 10.0);
+    }
+    if (d[digits] >= '5') {
+        int i = digits - 1;
+        while (i >= 0 && d[i] == '9') d[i--] = '0';
+        if (i >= 0) {
+            ++d[i];
+        } else {
+            d[0] = '1';
+            ++e10;
+        }
+    }
+    int len = digits;
+    while (len > 1 && d[len - 1] == '0') --len;
+
+    // Positional for moderate exponents, otherwise d.ddd e+NN as %g does
+    char buf[128];
+    int n = 0;
+    if (e10 >= 0 && e10 < digits) {
+        for (int i = 0; i <= e10; ++i) buf[n++] = i < len ? d[i] : '0';
+        if (len > e10 + 1) buf[n++] = '.';
+        for (int i = e10 + 1; i < len; ++i) buf[n++] = d[i];
+    } else if (e10 < 0 && e10 >= -5) {
+        buf[n++] = '0';
+        buf[n++] = '.';
+        for (int i = -1; i > e10; --i) buf[n++] = '0';
+        for (int i = 0; i < len; ++i) buf[n++] = d[i];
+    } else {
+        buf[n++] = d[0];
+        if (len > 1) buf[n++] = '.';
+        for (int i = 1; i < len; ++i) buf[n++] = d[i];
+        n += snprintf(buf + n, sizeof(buf) - (size_t)n, "e%+03d", e10);
+    }
+    buf[n] = '\0';
+    snprintf(out, size, "%s%s", neg ? "-" : "", buf);
+}
+
+// Keep the low parts of the last result in a variable just set from it
+static void xp_store_tail(const char *name) {
+    int i = find_var(name);
+    if (!g_have_xp || i < 0 || vars[i].value != g_xp_last.x[0]) return;
+    memcpy(vars[i].tail, &g_xp_last.x[1], sizeof(vars[i].tail));
+}
+
+// ============================================================================
+// Top-level: handle assignment or expression
+// ============================================================================
+
+// Exact value of the last result when it is an integer beyond double
+static Big g_exact;
+static bool g_have_exact = false;
+
+// Parse a whole expression into e; returns the root node
+static int compile(Expr *e, Parser *p) {
+    expr_init(e);
+    p->ex = e;
+    int root = parse_expr(p);
+    if (e->overflow) {
+        eval_error("expression too long\n");
+        return 0;
+    }
+    return root;
+}
+
+// Recompute a binding, recording which vars it reads. An interrupted
+// recomputation keeps the old value and leaves the binding stale.
+static void refresh_binding(Variable *v) {
+    uint64_t deps[DEP_WORDS] = {};
+    uint64_t *saved_track = g_dep_track;
+    OutputFormat saved_fmt = g_output_fmt;
+    g_dep_track = deps;
+    v->busy = true;
+
+    Expr e;
+    Parser p = {.src = v->formula, .pos = v->formula};
+    next_token(&p);
+    int root = compile(&e, &p);
+    double val = eval_node(&e, root);
+    Xp ext = g_xp_len ? xp_eval_quiet(&e, root) : xp_from(val);
+    if (ext.x[0] != val) ext = xp_from(val);
+
+    v->busy = false;
+    g_dep_track = saved_track;
+    g_output_fmt = saved_fmt;
+    if (g_interrupted) return;
+    v->value = val;
+    memcpy(v->tail, &ext.x[1], sizeof(v->tail));
+    memcpy(v->deps, deps, sizeof(deps));
+    v->dirty = false;
+}
+
+// Evaluate a tree, then redo it exactly if an integer result lost precision
+static double evaluate_tree(const Expr *e, int root) {
+    if (mat_tree(e, root)) return mat_evaluate(e, root);
+    if (buf_tree(e, root)) return buf_evaluate(e, root);
+    g_int_overflow = false;
+    g_exact_arg = nullptr;
+    double val = eval_node(e, root);
+    if (g_interrupted) return NAN;
+
+    const Node *top = &e->nodes[root];
+    g_list_primes = !g_quiet && !isnan(val) && top->kind == N_CALL && top->nargs == 2 &&
+                    strcmp(e->names + top->name, "primes") == 0;
+
+    bool big_int = fabs(val) >= 9007199254740992.0 && (isinf(val) || val == floor(val));
+    if ((!g_quiet || g_exact_arg) && (g_int_overflow || big_int)) {
+        OutputFormat fmt = g_output_fmt;
+        char prev_error[sizeof(g_error)];
+        memcpy(prev_error, g_error, sizeof(g_error));
+        g_error[0] = '\0';
+        // Quietly, so an error the double pass reported is not printed
+        // again; one only the exact pass finds is printed here
+        Big exact;
+        bool quiet = g_quiet;
+        g_quiet = true;
+        bool ok = big_eval(e, root, &exact);
+        g_quiet = quiet;
+        if (ok) {
+            g_exact = exact;
+            g_have_exact = true;
+            val = big_to_double(&exact);
+        } else if (prev_error[0] || !g_error[0]) {
+            memcpy(g_error, prev_error, sizeof(g_error));
+        } else if (!g_quiet) {
+            progress_hide();
+            fputs(g_error, stderr);
+        }
+        g_output_fmt = fmt;
+    }
+    if (g_exact_arg && !g_have_exact) {
+        if (!g_error[0]) eval_error("%s: expects a non-negative integer below 2^64\n", g_exact_arg);
+        return NAN;
+    }
+
+    // Extended precision for everything that is not an exact integer; the
+    // low parts of results near the subnormal range would underflow, so
+    // those print at double precision
+    if (g_xp_len && !g_quiet && !g_have_exact && !isnan(val) &&
+        (val == 0.0 || fabs(val) >= ldexp(1.0, -1022 + 53 * g_xp_len))) {
+        Xp ext = xp_eval_quiet(e, root);
+        if (!isnan(ext.x[0])) {
+            g_xp_last = ext;
+            g_have_xp = true;
+            val = ext.x[0];
+        }
+    }
+    return val;
+}
+
+// Clear what the previous expression left behind
+static void evaluate_reset(void) {
+    g_output_fmt = FMT_DEC;  // Reset format for each expression
+    big_free(&g_exact);
+    g_have_exact = false;
+    g_have_xp = false;
+    g_list_primes = false;
+    mat_free(&g_mat_last);
+    g_have_mat = false;
+    g_have_buf = false;
+    g_error[0] = '\0';
+}
+
+static double evaluate(const char *input) {
+    evaluate_reset();
+
+    Expr e;
+    Parser p = {.src = input, .pos = input};
+    next_token(&p);
+
+    // Check for assignment: name = expr
+    if (p.cur.type == TOK_ID) {
+        char name[MAX_NAME];
+        strcpy(name, p.cur.id);
+
+        const char *saved = p.pos;
+        Token saved_tok = p.cur;
+        next_token(&p);
+
+        if (p.cur.type == TOK_OP && p.cur.op == '=') {
+            next_token(&p);
+            double val = evaluate_tree(&e, compile(&e, &p));
+            if (g_interrupted) return NAN;
+            if (g_have_mat) {
+                mat_store(name, &g_mat_last);
+            } else if (g_have_buf) {
+                eval_error("%s: buffers cannot be stored in variables\n", name);
+                g_have_buf = false;
+                return NAN;
+            } else if (!g_quiet) {
+                set_var(name, val);
+                xp_store_tail(name);
+                if (g_have_exact) var_set_exact(name, &g_exact);
+            }
+            return val;
+        }
+
+        // Binding: name := expr (previewed as a plain expression)
+        if (p.cur.type == TOK_OP && p.cur.op == ':') {
+            if (g_quiet) {
+                next_token(&p);
+                return evaluate_tree(&e, compile(&e, &p));
+            }
+            skip_ws(&p);
+            double val = bind_var(name, p.pos);
+            if (fabs(val) >= 9007199254740992.0 && big_var(name, &g_exact)) {
+                g_have_exact = true;
+            } else if (g_xp_len && !isnan(val)) {
+                g_xp_last = xp_var(name);
+                g_have_xp = true;
+            }
+            return val;
+        }
+
+        // Not assignment, backtrack
+        p.pos = saved;
+        p.cur = saved_tok;
+    }
+
+    return evaluate_tree(&e, compile(&e, &p));
+}
+
+// ============================================================================
+// Output formatting
+// ============================================================================
+
+static void format_binary(char *out, size_t size, uint64_t val) {
+    if (val == 0) { snprintf(out, size, "0b0"); return; }
+
+    char buf[65];
+    int i = 64;
+    buf[i--] = '\0';
+
+    while (val && i >= 0) {
+        buf[i--] = '0' + (val & 1);
+        val >>= 1;
+    }
+    snprintf(out, size, "0b%s", &buf[i + 1]);
+}
+
+// Format a result in the current output format; false for NaN (no result)
+static bool format_result(char *out, size_t size, double val) {
+    if (isnan(val)) return false;
+
+    switch (g_output_fmt) {
+        case FMT_HEX:
+            snprintf(out, size, "0x%" PRIX64, to_u64(val));
+            break;
+        case FMT_BIN:
+            format_binary(out, size, to_u64(val));
+            break;
+        case FMT_OCT:
+            snprintf(out, size, "0o%" PRIo64, to_u64(val));
+            break;
+        case FMT_FACTOR:
+            if (val == floor(val) && fabs(val) < 18446744073709551616.0) {
+                format_factors(out, size, (uint64_t)fabs(val), val < 0);
+            } else {
+                snprintf(out, size, "%.12g", val);
+            }
+            break;
+        case FMT_DEC:
+        default:
+            // Check if it's effectively an integer
+            if (fabs(val) < 1e15 && val == floor(val)) {
+                snprintf(out, size, "%.0f", val);
+            } else {
+                snprintf(out, size, "%.12g", val);
+            }
+            break;
+    }
+    return true;
+}
+
+// Printed as a literal that reads back in, columns right-aligned:
+//   [1, 20;
+//    3,  4]
+static void mat_print(const Mat *m) {
+    int *width = calloc((size_t)m->cols, sizeof(int));
+    if (!width) return;
+    char buf[80];
+    for (int pass = 0; pass < 2; ++pass) {
+        for (int i = 0; i < m->rows; ++i) {
+            if (pass) fputs(i ? " " : "[", stdout);
+            for (int j = 0; j < m->cols; ++j) {
+                if (!format_result(buf, sizeof(buf), m->a[(size_t)i * m->cols + j])) strcpy(buf, "nan");
+                int len = (int)strlen(buf);
+                if (!pass) {
+                    if (len > width[j]) width[j] = len;
+                    continue;
+                }
+                const char *sep = j + 1 < m->cols ? ", " : i + 1 < m->rows ? ";\n" : "]\n";
+                printf("%*s%s", width[j], buf, sep);
+            }
+        }
+    }
+    free(width);
+}
+
+// Short buffers as a blob literal, longer ones by their first bytes and size
+static void buf_print(void) {
+    size_t n = g_buf_last.len < BUF_SHOW ? g_buf_last.len : BUF_SHOW;
+    fputs("blob(\"", stdout);
+    for (size_t i = 0; i < n; ++i) printf("%02x", g_buf_last.head[i]);
+    if (g_buf_last.len > n) printf("...\")  (%zu bytes)\n", g_buf_last.len);
+    else puts("\")");
+}
+
+// Print the last result; false when there is none (nan or an error)
+static bool print_result(double val) {
+    if (g_have_mat) {
+        mat_print(&g_mat_last);
+        return true;
+    }
+    if (g_have_buf) {
+        buf_print();
+        return true;
+    }
+    if (g_list_primes) {
+        sieve_each(g_primes_lo, g_primes_hi, false, print_prime, nullptr);
+        return true;
+    }
+    if (g_have_exact) {
+        char *text = big_format(&g_exact, g_output_fmt);
+        if (text) {
+            puts(text);
+            free(text);
+            return true;
+        }
+    }
+    char buf[128];
+    if (g_have_xp && g_output_fmt == FMT_DEC) {
+        xp_format(buf, sizeof(buf), g_xp_last);
+        puts(buf);
+        return true;
+    }
+    if (!format_result(buf, sizeof(buf), val)) return false;
+    puts(buf);
+    return true;
+}
+
+// ============================================================================
+// Session files
+// ============================================================================
+
+// Binary snapshot of all variables, bindings and matrices: a header,
+// fixed-size records, the matrix cells, then the formula and exact-digit
+// text the records point into. Loading maps the file, checks every record
+// and builds the new entries aside, and only then merges them into the var
+// table, so a bad or oversized file changes nothing. Bindings come back
+// dirty and are recomputed on first read, so nothing is re-parsed up front.
+
+typedef struct {
+    char magic[4];          // "TCS2"
+    uint32_t count;         // variable records
+    uint32_t mat_count;     // matrix records
+    uint32_t reserved;
+} SessionHeader;
+
+typedef struct {
+    char name[MAX_NAME];
+    double value;
+    double tail[3];         // --precision dd|qd low parts
+    uint32_t formula_off;   // offset into the text area
+    uint32_t formula_len;   // 0 for plain values
+    uint32_t exact_len;     // exact digits, right after the formula; 0 if none
+    uint32_t reserved;
+} SessionRecord;
+
+typedef struct {
+    char name[MAX_NAME];
+    int32_t rows, cols;
+    uint64_t cell_off;      // first cell in the cell area
+} SessionMatRecord;
+
+static bool session_save(const char *path) {
+    char tmp[512];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    FILE *f = fopen(tmp, "wb");
+    if (!f) { perror(path); return false; }
+
+    SessionHeader hdr = {.magic = "TCS2", .count = (uint32_t)var_count, .mat_count = (uint32_t)mat_var_count};
+    bool ok = fwrite(&hdr, sizeof(hdr), 1, f) == 1;
+
+    uint32_t off = 0;
+    for (int i = 0; i < var_count && ok; ++i) {
+        SessionRecord rec = {.value = vars[i].value, .formula_off = off};
+        memcpy(rec.name, vars[i].name, MAX_NAME);
+        memcpy(rec.tail, vars[i].tail, sizeof(rec.tail));
+        if (vars[i].formula) rec.formula_len = (uint32_t)strlen(vars[i].formula);
+        if (vars[i].exact) rec.exact_len = (uint32_t)strlen(vars[i].exact);
+        off += rec.formula_len + rec.exact_len;
+        ok = fwrite(&rec, sizeof(rec), 1, f) == 1;
+    }
+    uint64_t cells = 0;
+    for (int i = 0; i < mat_var_count && ok; ++i) {
+        SessionMatRecord rec = {.rows = mat_vars[i].m.rows, .cols = mat_vars[i].m.cols, .cell_off = cells};
+        memcpy(rec.name, mat_vars[i].name, MAX_NAME);
+        cells += mat_cells(&mat_vars[i].m);
+        ok = fwrite(&rec, sizeof(rec), 1, f) == 1;
+    }
+    for (int i = 0; i < mat_var_count && ok; ++i) {
+        const Mat *m = &mat_vars[i].m;
+        ok = fwrite(m->a, sizeof(double), mat_cells(m), f) == mat_cells(m);
+    }
+    for (int i = 0; i < var_count && ok; ++i) {
+        if (vars[i].formula) ok = fputs(vars[i].formula, f) >= 0;
+        if (vars[i].exact && ok) ok = fputs(vars[i].exact, f) >= 0;
+    }
+
+    if (fclose(f) != 0) ok = false;
+    if (!ok || rename(tmp, path) != 0) {
+        perror(path);
+        remove(tmp);
+        return false;
+    }
+    return true;
+}
+
+// A record's name, which must be NUL-terminated within MAX_NAME
+static const char *session_name(const char *name) {
+    return memchr(name, '\0', MAX_NAME) && name[0] ? name : nullptr;
+}
+
+// Names in recs[0..n) that are not yet defined and not repeated earlier in
+// the file; stride is the record size
+static int session_new_names(const char *recs, size_t stride, uint32_t n, int (*find)(const char *)) {
+    int fresh = 0;
+    for (uint32_t r = 0; r < n; ++r) {
+        const char *name = recs + r * stride;
+        if (find(name) >= 0) continue;
+        uint32_t k = 0;
+        while (k < r && strcmp(recs + k * stride, name) != 0) ++k;
+        fresh += k == r;
+    }
+    return fresh;
+}
+
+// Merge a saved session into the current variables. A missing file is
+// only an error when `required` is set.
+static bool session_load(const char *path, bool required) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        if (required) perror(path);
+        return !required;
+    }
+    struct stat st;
+    size_t size = fstat(fd, &st) == 0 ? (size_t)st.st_size : 0;
+    const char *map = size >= sizeof(SessionHeader)
+                    ? mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+    close(fd);
+    if (map == MAP_FAILED) {
+        fprintf(stderr, "%s: not a termcalc session file\n", path);
+        return false;
+    }
+
+    // Check the layout and every record before touching anything
+    const SessionHeader *hdr = (const void *)map;
+    const SessionRecord *recs = (const void *)(map + sizeof(SessionHeader));
+    const SessionMatRecord *mrecs = nullptr;
+    uint64_t room = size - sizeof(SessionHeader);
+    bool ok = memcmp(hdr->magic, "TCS2", 4) == 0 &&
+              (uint64_t)hdr->count * sizeof(SessionRecord) + (uint64_t)hdr->mat_count * sizeof(SessionMatRecord) <= room;
+    const char *error = "not a termcalc session file";
+
+    uint64_t cells = 0, cell_start = 0, text_start = 0;
+    if (ok) {
+        mrecs = (const void *)(recs + hdr->count);
+        cell_start = sizeof(SessionHeader) + hdr->count * sizeof(SessionRecord) +
+                     hdr->mat_count * sizeof(SessionMatRecord);
+        for (uint32_t r = 0; r < hdr->mat_count && ok; ++r) {
+            const SessionMatRecord *m = &mrecs[r];
+            ok = session_name(m->name) && m->rows > 0 && m->cols > 0 && m->cell_off == cells &&
+                 (uint64_t)m->rows * (uint64_t)m->cols <= MAT_MAX_CELLS;
+            cells += ok ? (uint64_t)m->rows * (uint64_t)m->cols : 0;
+        }
+        text_start = cell_start + cells * sizeof(double);
+        ok = ok && text_start <= size;
+    }
+    for (uint32_t r = 0; r < hdr->count && ok; ++r) {
+        const SessionRecord *rec = &recs[r];
+        ok = session_name(rec->name) &&
+             (uint64_t)rec->formula_off + rec->formula_len + rec->exact_len <= size - text_start;
+    }
+    if (ok && (var_count + session_new_names((const char *)recs, sizeof(SessionRecord), hdr->count, find_var) > MAX_VARS ||
+               mat_var_count + session_new_names((const char *)mrecs, sizeof(SessionMatRecord), hdr->mat_count, find_mat) > MAX_VARS)) {
+        ok = false;
+        error = "too many variables";
+    }
+
+    // Build the new strings and matrices aside; any failure discards them
+    uint32_t nvars = ok ? hdr->count : 0, nmats = ok ? hdr->mat_count : 0;
+    char **text = calloc(2 * (size_t)nvars + 1, sizeof(char *));
+    Mat *mats = calloc((size_t)nmats + 1, sizeof(Mat));
+    if (ok && (!text || !mats)) {
+        ok = false;
+        error = "out of memory";
+    }
+    for (uint32_t r = 0; r < nvars && ok; ++r) {
+        const SessionRecord *rec = &recs[r];
+        const char *t = map + text_start + rec->formula_off;
+        if (rec->formula_len) ok = (text[2 * r] = strndup(t, rec->formula_len)) != nullptr;
+        if (rec->exact_len && ok) ok = (text[2 * r + 1] = strndup(t + rec->formula_len, rec->exact_len)) != nullptr;
+        if (!ok) error = "out of memory";
+    }
+    for (uint32_t r = 0; r < nmats && ok; ++r) {
+        const SessionMatRecord *m = &mrecs[r];
+        ok = mat_alloc(&mats[r], m->rows, m->cols);
+        if (ok) memcpy(mats[r].a, map + cell_start + m->cell_off * sizeof(double), mat_cells(&mats[r]) * sizeof(double));
+        else error = "out of memory";
+    }
+
+    if (ok) {
+        for (uint32_t r = 0; r < nvars; ++r) {
+            const SessionRecord *rec = &recs[r];
+            int i = intern_var(rec->name);
+            mat_forget(rec->name);
+            free(vars[i].formula);
+            free(vars[i].exact);
+            vars[i].formula = text[2 * r];
+            vars[i].exact = text[2 * r + 1];
+            vars[i].value = rec->value;
+            memcpy(vars[i].tail, rec->tail, sizeof(vars[i].tail));
+            vars[i].dirty = vars[i].formula != nullptr;
+            mark_dependents(i);
+        }
+        for (uint32_t r = 0; r < nmats; ++r) {
+            int i = find_mat(mrecs[r].name);
+            if (i < 0) {
+                i = mat_var_count++;
+                mat_vars[i] = (MatVar){};
+                memcpy(mat_vars[i].name, mrecs[r].name, MAX_NAME);
+            }
+            mat_free(&mat_vars[i].m);
+            mat_vars[i].m = mats[r];
+        }
+    } else {
+        for (uint32_t r = 0; text && r < 2 * nvars; ++r) free(text[r]);
+        for (uint32_t r = 0; mats && r < nmats; ++r) mat_free(&mats[r]);
+        fprintf(stderr, "%s: %s\n", path, error);
+    }
+    free(text);
+    free(mats);
+    munmap((void *)map, size);
+    return ok;
+}
+
+// ============================================================================
+// Constant libraries
+// ============================================================================
+
+// `c --build-lib consts.txt -o consts.tcl` compiles `name = expr` lines into
+// a perfect-hashed table (hash and displace): a header, one seed per
+// bucket, then the slots. Libraries are mmap'd at startup and looked up
+// with two hashes and one strcmp, with no parsing.
+
+constexpr int MAX_LIBS = 8;
+
+typedef struct {
+    char magic[4];          // "TCL1"
+    uint32_t count;
+    uint32_t nbuckets;
+    uint32_t nslots;
+} LibHeader;
+
+typedef struct {
+    char name[MAX_NAME];    // empty for unused slots
+    double value;
+} LibEntry;
+
+typedef struct {
+    const LibHeader *hdr;
+    const uint32_t *seeds;
+    const LibEntry *slots;
+} ConstLib;
+
+static ConstLib libs[MAX_LIBS];
+static int lib_count = 0;
+
+static uint64_t hash_str(const char *s, uint64_t seed) {
+    uint64_t h = 14695981039346656037ULL ^ (seed * 0x9E3779B97F4A7C15ULL);  // FNV-1a
+    while (*s) h = (h ^ (unsigned char)*s++) * 1099511628211ULL;
+    // Final avalanche so differently seeded hashes are independent
+    h ^= h >> 33;
+    h *= 0xFF51AFD7ED558CCDULL;
+    h ^= h >> 33;
+    return h;
+}
+
+static bool lib_lookup(const char *name, double *out) {
+    for (int i = 0; i < lib_count; ++i) {
+        const ConstLib *lib = &libs[i];
+        uint32_t b = (uint32_t)(hash_str(name, 0) % lib->hdr->nbuckets);
+        uint32_t slot = (uint32_t)(hash_str(name, lib->seeds[b]) % lib->hdr->nslots);
+        if (strcmp(lib->slots[slot].name, name) == 0) {
+            *out = lib->slots[slot].value;
+            return true;
+        }
+    }
+    return false;
+}
+
+// Map a compiled library; it stays mapped for the life of the process.
+// Without `required` (the default ~/.c_consts.tcl) a missing file is
+// ignored and a bad one is reported and skipped; returns false only for
+// a required library that could not be loaded.
+static bool lib_load(const char *path, bool required) {
+    const char *skip = required ? "" : ", skipped";
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        if (required || errno != ENOENT) fprintf(stderr, "%s: %s%s\n", path, strerror(errno), skip);
+        return !required;
+    }
+    if (lib_count == MAX_LIBS) {
+        close(fd);
+        fprintf(stderr, "%s: too many libraries%s\n", path, skip);
+        return !required;
+    }
+    struct stat st;
+    size_t size = fstat(fd, &st) == 0 ? (size_t)st.st_size : 0;
+    const char *map = size >= sizeof(LibHeader)
+                    ? mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+    close(fd);
+
+    const LibHeader *hdr = (const void *)map;
+    bool valid = map != MAP_FAILED && memcmp(hdr->magic, "TCL1", 4) == 0 &&
+                 hdr->nbuckets != 0 && hdr->nslots != 0 &&
+                 size == sizeof(LibHeader) + hdr->nbuckets * sizeof(uint32_t)
+                         + (size_t)hdr->nslots * sizeof(LibEntry);
+    const uint32_t *seeds = valid ? (const void *)(map + sizeof(LibHeader)) : nullptr;
+    const LibEntry *slots = valid ? (const void *)(seeds + hdr->nbuckets) : nullptr;
+    // Lookups strcmp slot names, so each must end within its field
+    for (uint32_t i = 0; valid && i < hdr->nslots; ++i)
+        valid = memchr(slots[i].name, '\0', MAX_NAME) != nullptr;
+    if (!valid) {
+        if (map != MAP_FAILED) munmap((void *)map, size);
+        fprintf(stderr, "%s: not a termcalc constant library%s\n", path, skip);
+        return !required;
+    }
+
+    libs[lib_count++] = (ConstLib){ .hdr = hdr, .seeds = seeds, .slots = slots };
+    return true;
+}
+
+static const char *get_lib_path(void) {
+    static char path[512];
+    const char *home = getenv("HOME");
+    if (home) {
+        snprintf(path, sizeof(path), "%s/.c_consts.tcl", home);
+        return path;
+    }
+    return nullptr;
+}
+
+// Hash-and-displace: hash each name into a bucket, then find per bucket
+// (largest first) a seed that sends all its names to free slots.
+static bool place_lib(const LibEntry *entries, uint32_t count, uint32_t nbuckets,
+                      uint32_t nslots, uint32_t *seeds, LibEntry *slots) {
+    uint32_t *start = calloc(nbuckets + 1, sizeof(*start));
+    uint32_t *members = malloc(count * sizeof(*members));
+    uint32_t *bucket = malloc(count * sizeof(*bucket));
+    bool *taken = calloc(nslots, sizeof(*taken));
+    bool ok = start && members && bucket && taken;
+
+    uint32_t max_size = 0;
+    for (uint32_t i = 0; ok && i < count; ++i) {
+        bucket[i] = (uint32_t)(hash_str(entries[i].name, 0) % nbuckets);
+        ++start[bucket[i] + 1];
+    }
+    for (uint32_t b = 0; ok && b < nbuckets; ++b) {
+        if (start[b + 1] > max_size) max_size = start[b + 1];
+        start[b + 1] += start[b];
+    }
+    uint32_t *fill = ok ? calloc(nbuckets, sizeof(*fill)) : nullptr;
+    ok = ok && fill;
+    for (uint32_t i = 0; ok && i < count; ++i) {
+        members[start[bucket[i]] + fill[bucket[i]]++] = i;
+    }
+    free(fill);
+
+    uint32_t pos[64];
+    for (uint32_t size = max_size; ok && size > 0; --size) {
+        for (uint32_t b = 0; ok && b < nbuckets; ++b) {
+            if (start[b + 1] - start[b] != size) continue;
+            if (size > 64) { ok = false; break; }
+
+            uint32_t seed = 1;
+            for (; seed < (1u << 20); ++seed) {
+                uint32_t k = 0;
+                for (; k < size; ++k) {
+                    const char *name = entries[members[start[b] + k]].name;
+                    pos[k] = (uint32_t)(hash_str(name, seed) % nslots);
+                    bool clash = taken[pos[k]];
+                    for (uint32_t j = 0; j < k && !clash; ++j) clash = pos[j] == pos[k];
+                    if (clash) break;
+                }
+                if (k == size) break;
+            }
+            if (seed == (1u << 20)) { ok = false; break; }
+
+            seeds[b] = seed;
+            for (uint32_t k = 0; k < size; ++k) {
+                taken[pos[k]] = true;
+                slots[pos[k]] = entries[members[start[b] + k]];
+            }
+        }
+    }
+
+    free(start);
+    free(members);
+    free(bucket);
+    free(taken);
+    return ok;
+}
+
+static int place_and_write_lib(const LibEntry *entries, uint32_t count, const char *dst) {
+    uint32_t nbuckets = count / 4 + 1;
+    uint32_t nslots = count + count / 4 + 1;
+    uint32_t *seeds = nullptr;
+    LibEntry *slots = nullptr;
+
+    // Retry with a sparser table in the unlikely case placement fails
+    for (int attempt = 0; attempt < 8; ++attempt) {
+        free(seeds);
+        free(slots);
+        seeds = calloc(nbuckets, sizeof(*seeds));
+        slots = calloc(nslots, sizeof(*slots));
+        if (!seeds || !slots) break;
+        if (place_lib(entries, count, nbuckets, nslots, seeds, slots)) {
+            LibHeader hdr = {.magic = "TCL1", .count = count,
+                             .nbuckets = nbuckets, .nslots = nslots};
+            FILE *out = fopen(dst, "wb");
+            bool ok = out &&
+                      fwrite(&hdr, sizeof(hdr), 1, out) == 1 &&
+                      fwrite(seeds, sizeof(*seeds), nbuckets, out) == nbuckets &&
+                      fwrite(slots, sizeof(*slots), nslots, out) == nslots;
+            if (out && fclose(out) != 0) ok = false;
+            free(seeds);
+            free(slots);
+            if (!ok) { perror(dst); return 1; }
+            printf("%s: %" PRIu32 " constants\n", dst, count);
+            return 0;
+        }
+        nbuckets += nbuckets / 2 + 1;
+        nslots += nslots / 4 + 1;
+    }
+    free(seeds);
+    free(slots);
+    fprintf(stderr, "%s: could not build hash table\n", dst);
+    return 1;
+}
+
+// Compile a text library: one `name = expr` per line, '#' starts a comment.
+// Later definitions of the same name win.
+static int build_lib(const char *src, const char *dst) {
+    FILE *in = fopen(src, "r");
+    if (!in) { perror(src); return 1; }
+
+    LibEntry *entries = nullptr;
+    uint32_t count = 0, cap = 0;
+    char line[MAX_INPUT];
+    int lineno = 0;
+    bool ok = true;
+    while (ok && fgets(line, sizeof(line), in)) {
+        ++lineno;
+        char *hash = strchr(line, '#');
+        if (hash) *hash = '\0';
+        char *eq = strchr(line, '=');
+        char *name = line;
+        while (isspace((unsigned char)*name)) ++name;
+        if (!eq) {
+            if (*name == '\0') continue;
+            fprintf(stderr, "%s:%d: expected name = expr\n", src, lineno);
+            ok = false;
+            break;
+        }
+
+        char *end = eq;
+        while (end > name && isspace((unsigned char)end[-1])) --end;
+        *end = '\0';
+        bool valid = (isalpha((unsigned char)*name) || *name == '_') && end - name < MAX_NAME;
+        for (const char *c = name; valid && *c; ++c) {
+            valid = isalnum((unsigned char)*c) || *c == '_';
+        }
+        double val = valid ? evaluate(eq + 1) : NAN;
+        if (!valid || isnan(val)) {
+            fprintf(stderr, "%s:%d: invalid definition of '%s'\n", src, lineno, name);
+            ok = false;
+            break;
+        }
+
+        if (count == cap) {
+            cap = cap ? cap * 2 : 256;
+            LibEntry *grown = realloc(entries, cap * sizeof(*entries));
+            if (!grown) { ok = false; break; }
+            entries = grown;
+        }
+        entries[count] = (LibEntry){.value = val};
+        strcpy(entries[count].name, name);
+        ++count;
+    }
+    fclose(in);
+
+    // Keep the last definition of each name, at its first position
+    uint32_t cap_idx = 16;
+    while (cap_idx < 2 * count) cap_idx <<= 1;
+    uint32_t *index = ok ? calloc(cap_idx, sizeof(*index)) : nullptr;  // entry + 1
+    uint32_t unique = 0;
+    for (uint32_t i = 0; index && i < count; ++i) {
+        uint32_t h = (uint32_t)hash_str(entries[i].name, 0) & (cap_idx - 1);
+        while (index[h] && strcmp(entries[index[h] - 1].name, entries[i].name) != 0) {
+            h = (h + 1) & (cap_idx - 1);
+        }
+        if (index[h]) {
+            entries[index[h] - 1].value = entries[i].value;
+        } else {
+            entries[unique] = entries[i];
+            index[h] = ++unique;
+        }
+    }
+    free(index);
+    if (ok && count > 0 && unique == 0) ok = false;
+    count = unique;
+
+    int rc = ok ? place_and_write_lib(entries, count, dst) : 1;
+    free(entries);
+    return rc;
+}
+
+// ============================================================================
+// History index
+// ============================================================================
+
+// Ctrl+R and prefix search cover the whole history file, however large.
+// The file is cut into blocks of HIDX_BLOCK lines, and a trigram index
+// maps each three-byte sequence to the blocks holding it, so a search
+// scans only blocks that contain every trigram of the query. Fuzzy
+// matching skips blocks missing one of the query's characters.
+//
+// ~/.c_history.idx holds one segment per HIDX_CHUNK bytes of history. It
+// only grows by appending, so other sessions' mappings stay valid, and is
+// rebuilt into a new file renamed over the old one when the history file
+// has been compacted (a different inode or first HIDX_HEAD bytes). The
+// newest partial chunk is indexed in memory. All of it happens on a
+// background thread at startup; until it is done, searches cover the
+// in-memory history only.
+//
+// File: HistIdxHeader, then segments. A segment is a HistSegHeader, then
+//   uint64_t offs[nblocks + 1]      history offset where each block starts
+//   uint64_t masks[nblocks][2]      bytes present in the block (mod 128)
+//   HistKey keys[nkeys + 1]         trigrams, ascending; the last is a sentinel
+//   uint32_t post[npost]            blocks of each trigram, ascending;
+//                                   padded to 8 bytes
+
+constexpr int HIDX_BLOCK = 64;
+constexpr long HIDX_CHUNK = 4L << 20;
+constexpr long HIDX_HEAD = 4096;
+constexpr int HIST_RESULTS = 128;     // matches kept per search
+
+typedef struct {
+    char magic[4];          // "TCH1"
+    uint32_t reserved;
+    uint64_t ino;           // history file indexed
+    uint64_t head;          // crc32c of its first HIDX_HEAD bytes
+} HistIdxHeader;
+
+typedef struct {
+    uint32_t nblocks;
+    uint32_t nkeys;
+    uint64_t npost;
+    uint64_t size;          // whole segment, header included
+} HistSegHeader;
+
+typedef struct {
+    uint32_t tri;
+    uint32_t first;         // postings are post[first] .. post[next key's first]
+} HistKey;
+
+typedef struct {
+    const HistSegHeader *hdr;
+    const uint64_t *offs;
+    const uint64_t (*masks)[2];
+    const HistKey *keys;
+    const uint32_t *post;
+} HistSeg;
+
+typedef struct {
+    const char *text;       // the history file, mapped
+    size_t text_len;
+    HistSeg *segs;          // oldest first
+    int nseg;
+} HistIndex;
+
+static _Atomic(HistIndex *) g_hidx = nullptr;
+
+// True when path still names the file st describes (compaction replaces it)
+static bool same_file(const char *path, const struct stat *st) {
+    struct stat cur;
+    return stat(path, &cur) == 0 && cur.st_dev == st->st_dev && cur.st_ino == st->st_ino;
+}
+
+typedef enum { HS_SUBSTR, HS_PREFIX, HS_FUZZY } HistSearchMode;
+
+constexpr int HS_EXACT = 1 << 30;    // score of a substring or prefix match
+
+// Distinct matching lines, best first
+typedef struct {
+    char *line[HIST_RESULTS];
+    int score[HIST_RESULTS];
+    int n;
+} HistMatches;
+
+static bool hm_has(const HistMatches *m, const char *s, size_t len) {
+    for (int i = 0; i < m->n; ++i) {
+        if (strncmp(m->line[i], s, len) == 0 && m->line[i][len] == '\0') return true;
+    }
+    return false;
+}
+
+// Insert keeping scores descending; equal scores keep the order found
+static void hm_add(HistMatches *m, const char *s, size_t len, int score) {
+    if (m->n == HIST_RESULTS && score <= m->score[m->n - 1]) return;
+    if (hm_has(m, s, len)) return;
+    char *copy = strndup(s, len);
+    if (!copy) return;
+    if (m->n == HIST_RESULTS) free(m->line[--m->n]);
+    int i = m->n++;
+    for (; i > 0 && m->score[i - 1] < score; --i) {
+        m->line[i] = m->line[i - 1];
+        m->score[i] = m->score[i - 1];
+    }
+    m->line[i] = copy;
+    m->score[i] = score;
+}
+
+static void hm_free(HistMatches *m) {
+    for (int i = 0; i < m->n; ++i) free(m->line[i]);
+    m->n = 0;
+}
+
+// How well q matches s as a subsequence, or -1 when it does not. Each
+// matched character scores, more when it continues the previous match or
+// starts a word, and gaps cost. The window scored is the shortest one
+// ending where the leftmost match ends.
+static int fuzzy_score(const char *s, size_t len, const char *q, size_t qlen) {
+    const char *p = s, *end = s + len;
+    for (size_t k = 0; k < qlen; ++k, ++p) {
+        if (!(p = memchr(p, q[k], (size_t)(end - p)))) return -1;
+    }
+    size_t i, k, start = (size_t)(p - s);
+    for (k = qlen; k > 0; ) k -= s[--start] == q[k - 1];
+
+    int score = 0;
+    size_t prev = start;
+    for (i = start, k = 0; k < qlen; ++i) {
+        if (s[i] != q[k]) continue;
+        score += 16;
+        if (k > 0 && i == prev + 1) score += 24;
+        if (i == 0 || !(isalnum((unsigned char)s[i - 1]) || s[i - 1] == '_')) score += 16;
+        score -= (int)(i - prev) - (k > 0);
+        prev = i;
+        ++k;
+    }
+    return score > 0 ? score : 0;
+}
+
+static size_t hseg_size(uint64_t nblocks, uint64_t nkeys, uint64_t npost) {
+    return sizeof(HistSegHeader) + (nblocks + 1) * sizeof(uint64_t) + nblocks * 2 * sizeof(uint64_t)
+         + (nkeys + 1) * sizeof(HistKey) + (npost * sizeof(uint32_t) + 7) / 8 * 8;
+}
+
+static HistSeg hseg_layout(const HistSegHeader *h) {
+    HistSeg seg = {.hdr = h, .offs = (const void *)(h + 1)};
+    seg.masks = (const void *)(seg.offs + h->nblocks + 1);
+    seg.keys = (const void *)(seg.masks + h->nblocks);
+    seg.post = (const void *)(seg.keys + h->nkeys + 1);
+    return seg;
+}
+
+static bool hseg_view(const void *p, size_t avail, HistSeg *seg) {
+    const HistSegHeader *h = p;
+    if (avail < sizeof(*h) || h->nblocks == 0 || h->size > avail ||
+        h->size != hseg_size(h->nblocks, h->nkeys, h->npost)) return false;
+    *seg = hseg_layout(h);
+    return seg->keys[h->nkeys].first == h->npost;
+}
+
+static uint32_t trigram(const char *s) {
+    return (uint32_t)(unsigned char)s[0] << 16 | (uint32_t)(unsigned char)s[1] << 8 | (unsigned char)s[2];
+}
+
+// Index the lines of text[start, end) (end follows a newline) as a
+// malloc'd segment
+static HistSegHeader *hseg_build(const char *text, uint64_t start, uint64_t end) {
+    uint64_t nlines = 0;
+    for (const char *p = text + start; (p = memchr(p, '\n', (size_t)(text + end - p))); ++p) ++nlines;
+    uint64_t nblocks = (nlines + HIDX_BLOCK - 1) / HIDX_BLOCK;
+    uint64_t *offs = malloc((nblocks + 1) * sizeof(*offs));
+    uint64_t (*masks)[2] = calloc(nblocks + 1, sizeof(*masks));
+    uint64_t *seen = calloc((1 << 24) / 64, sizeof(*seen));
+    size_t npairs = 0, cap = 1 << 16;
+    uint64_t *pairs = malloc(cap * sizeof(*pairs)), *sorted = nullptr;
+    HistSegHeader *h = nullptr;
+    if (!offs || !masks || !seen || !pairs || nblocks == 0) goto done;
+
+    // (trigram, block) pairs, each once per block, in block order
+    uint64_t b = 0, line = 0;
+    size_t block_first = 0;
+    offs[0] = start;
+    for (uint64_t i = start; i < end; ) {
+        uint64_t e = (uint64_t)((const char *)memchr(text + i, '\n', end - i) - text);
+        for (uint64_t k = i; k < e; ++k) {
+            unsigned char c = (unsigned char)text[k];
+            masks[b][c >> 6 & 1] |= 1ULL << (c & 63);
+            if (k + 3 > e) continue;
+            uint32_t tri = trigram(text + k);
+            if (seen[tri >> 6] >> (tri & 63) & 1) continue;
+            seen[tri >> 6] |= 1ULL << (tri & 63);
+            if (npairs == cap) {
+                uint64_t *grown = realloc(pairs, 2 * cap * sizeof(*pairs));
+                if (!grown) goto done;
+                pairs = grown;
+                cap *= 2;
+            }
+            pairs[npairs++] = (uint64_t)tri << 32 | b;
+        }
+        i = e + 1;
+        if (++line % HIDX_BLOCK == 0 || i >= end) {
+            for (size_t p = block_first; p < npairs; ++p) {
+                uint32_t tri = (uint32_t)(pairs[p] >> 32);
+                seen[tri >> 6] &= ~(1ULL << (tri & 63));
+            }
+            block_first = npairs;
+            offs[++b] = i;
+        }
+    }
+
+    // Stable radix sort by trigram, 12 bits at a time, keeps blocks ascending
+    sorted = malloc(npairs * sizeof(*sorted));
+    if (!sorted) goto done;
+    for (int shift = 32; shift < 56; shift += 12) {
+        size_t count[4097] = {};
+        for (size_t p = 0; p < npairs; ++p) ++count[(pairs[p] >> shift & 4095) + 1];
+        for (int d = 0; d < 4096; ++d) count[d + 1] += count[d];
+        for (size_t p = 0; p < npairs; ++p) sorted[count[pairs[p] >> shift & 4095]++] = pairs[p];
+        uint64_t *t = pairs;
+        pairs = sorted;
+        sorted = t;
+    }
+
+    uint64_t nkeys = 0;
+    for (size_t p = 0; p < npairs; ++p) nkeys += p == 0 || pairs[p] >> 32 != pairs[p - 1] >> 32;
+    size_t size = hseg_size(nblocks, nkeys, npairs);
+    h = calloc(1, size);
+    if (!h) goto done;
+    *h = (HistSegHeader){.nblocks = (uint32_t)nblocks, .nkeys = (uint32_t)nkeys, .npost = npairs, .size = size};
+    HistSeg seg = hseg_layout(h);
+    memcpy((void *)seg.offs, offs, (nblocks + 1) * sizeof(*offs));
+    memcpy((void *)seg.masks, masks, nblocks * sizeof(*masks));
+    HistKey *keys = (HistKey *)seg.keys;
+    uint32_t *post = (uint32_t *)seg.post;
+    nkeys = 0;
+    for (size_t p = 0; p < npairs; ++p) {
+        if (p == 0 || pairs[p] >> 32 != pairs[p - 1] >> 32) {
+            keys[nkeys++] = (HistKey){.tri = (uint32_t)(pairs[p] >> 32), .first = (uint32_t)p};
+        }
+        post[p] = (uint32_t)pairs[p];
+    }
+    keys[nkeys] = (HistKey){.tri = UINT32_MAX, .first = (uint32_t)npairs};
+
+done:
+    free(offs);
+    free(masks);
+    free(seen);
+    free(pairs);
+    free(sorted);
+    return h;
+}
+
+// End of the last complete line in text[from, to), or from when none
+static uint64_t line_end_before(const char *text, uint64_t from, uint64_t to) {
+    const char *nl = memrchr(text + from, '\n', to - from);
+    return nl ? (uint64_t)(nl - text) + 1 : from;
+}
+
+static bool hidx_add(HistIndex *ix, const void *p, size_t avail, uint64_t covered) {
+    HistSeg seg;
+    if (!hseg_view(p, avail, &seg) || seg.offs[0] != covered ||
+        seg.offs[seg.hdr->nblocks] <= covered || seg.offs[seg.hdr->nblocks] > ix->text_len) return false;
+    HistSeg *segs = realloc(ix->segs, (size_t)(ix->nseg + 1) * sizeof(*segs));
+    if (!segs) return false;
+    ix->segs = segs;
+    ix->segs[ix->nseg++] = seg;
+    return true;
+}
+
+// Append segments for each full chunk past *covered at *at in fd
+static void hidx_append(int fd, const char *text, uint64_t text_len, uint64_t *covered, off_t *at) {
+    while (text_len - *covered >= (uint64_t)HIDX_CHUNK) {
+        uint64_t end = line_end_before(text, *covered, *covered + HIDX_CHUNK);
+        HistSegHeader *h = end > *covered ? hseg_build(text, *covered, end) : nullptr;
+        bool ok = h && pwrite(fd, h, h->size, *at) == (ssize_t)h->size;
+        if (ok) {
+            *at += (off_t)h->size;
+            *covered = end;
+        }
+        free(h);
+        if (!ok) return;
+    }
+}
+
+// Bring ~/.c_history.idx up to date with the history text and map its
+// segments into ix; returns the history bytes they cover
+static uint64_t hidx_update(HistIndex *ix, const char *path, const struct stat *hist_st) {
+    char idx_path[520], tmp[528];
+    snprintf(idx_path, sizeof(idx_path), "%s.idx", path);
+    int fd = open(idx_path, O_RDWR | O_CREAT, 0600);
+    if (fd < 0) return 0;
+
+    // Another session may have rebuilt it meanwhile; follow the name
+    struct stat st;
+    for (flock(fd, LOCK_EX); fstat(fd, &st) == 0 && !same_file(idx_path, &st); flock(fd, LOCK_EX)) {
+        flock(fd, LOCK_UN);
+        close(fd);
+        fd = open(idx_path, O_RDWR | O_CREAT, 0600);
+        if (fd < 0) return 0;
+    }
+
+    HistIdxHeader hdr = {.magic = "TCH1", .ino = (uint64_t)hist_st->st_ino,
+                         .head = crc32c((const uint8_t *)ix->text, HIDX_HEAD)};
+    HistIdxHeader old;
+    bool valid = pread(fd, &old, sizeof(old), 0) == (ssize_t)sizeof(old) &&
+                 memcmp(&old, &hdr, sizeof(hdr)) == 0;
+
+    // Walk the segment headers to find where the valid part ends. Segments
+    // past our view of the history (another session saw more) are kept.
+    uint64_t covered = 0;
+    off_t at = sizeof(hdr);
+    HistSegHeader sh;
+    bool ahead = false;
+    while (valid && pread(fd, &sh, sizeof(sh), at) == (ssize_t)sizeof(sh) && sh.nblocks &&
+           sh.size == hseg_size(sh.nblocks, sh.nkeys, sh.npost) && at + (off_t)sh.size <= st.st_size) {
+        uint64_t first, last;
+        if (pread(fd, &first, 8, at + (off_t)sizeof(sh)) != 8 ||
+            pread(fd, &last, 8, at + (off_t)(sizeof(sh) + 8 * sh.nblocks)) != 8 ||
+            first != covered || last <= covered) break;
+        if ((ahead = last > ix->text_len)) break;
+        covered = last;
+        at += (off_t)sh.size;
+    }
+
+    int map_fd = fd;
+    if (valid && !ahead) {
+        // Drop what a crashed writer left half done, then add new chunks
+        if (at < st.st_size && ftruncate(fd, at) != 0) perror("history index");
+        hidx_append(fd, ix->text, ix->text_len, &covered, &at);
+    } else if (!valid) {
+        // Rebuild into a new file and rename it over the old one
+        snprintf(tmp, sizeof(tmp), "%s.tmp", idx_path);
+        map_fd = open(tmp, O_RDWR | O_CREAT | O_TRUNC, 0600);
+        covered = 0;
+        at = sizeof(hdr);
+        if (map_fd >= 0 && pwrite(map_fd, &hdr, sizeof(hdr), 0) == (ssize_t)sizeof(hdr)) {
+            hidx_append(map_fd, ix->text, ix->text_len, &covered, &at);
+        }
+        if (map_fd < 0 || rename(tmp, idx_path) != 0) {
+            if (map_fd >= 0) { close(map_fd); remove(tmp); }
+            map_fd = -1;
+        }
+    }
+
+    const char *map = map_fd >= 0 && at > (off_t)sizeof(hdr)
+                    ? mmap(nullptr, (size_t)at, PROT_READ, MAP_PRIVATE, map_fd, 0) : MAP_FAILED;
+    flock(fd, LOCK_UN);
+    close(fd);
+    if (map_fd != fd && map_fd >= 0) close(map_fd);
+    if (map == MAP_FAILED) return 0;
+
+    uint64_t mapped = 0;
+    for (size_t off = sizeof(hdr); off < (size_t)at; off += ix->segs[ix->nseg - 1].hdr->size) {
+        if (!hidx_add(ix, map + off, (size_t)at - off, mapped)) break;
+        mapped = ix->segs[ix->nseg - 1].offs[ix->segs[ix->nseg - 1].hdr->nblocks];
+    }
+    return mapped;
+}
+
+static void *hidx_main(void *arg) {
+    const char *path = arg;
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0 || st.st_size == 0) {
+        if (fd >= 0) close(fd);
+        return nullptr;
+    }
+
+    // Complete lines only: another session may be halfway through a write
+    HistIndex *ix = calloc(1, sizeof(*ix));
+    const char *text = mmap(nullptr, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (!ix || text == MAP_FAILED) {
+        free(ix);
+        if (text != MAP_FAILED) munmap((void *)text, (size_t)st.st_size);
+        return nullptr;
+    }
+    ix->text = text;
+    ix->text_len = line_end_before(text, 0, (uint64_t)st.st_size);
+
+    uint64_t covered = ix->text_len >= (uint64_t)HIDX_CHUNK ? hidx_update(ix, path, &st) : 0;
+    if (covered < ix->text_len) {
+        HistSegHeader *tail = hseg_build(text, covered, ix->text_len);
+        if (tail && !hidx_add(ix, tail, tail->size, covered)) free(tail);
+    }
+    atomic_store(&g_hidx, ix);
+    return nullptr;
+}
+
+// Build or update the index in the background; path must stay valid
+static void hidx_start(const char *path) {
+    pthread_t tid;
+    if (pthread_create(&tid, nullptr, hidx_main, (void *)path) == 0) pthread_detach(tid);
+}
+
+// Postings of one trigram in seg: [*lo, *hi)
+static void hseg_lookup(const HistSeg *seg, uint32_t tri, uint64_t *lo, uint64_t *hi) {
+    uint32_t a = 0, b = seg->hdr->nkeys;
+    while (a < b) {
+        uint32_t mid = a + (b - a) / 2;
+        if (seg->keys[mid].tri < tri) a = mid + 1; else b = mid;
+    }
+    *lo = *hi = 0;
+    if (a < seg->hdr->nkeys && seg->keys[a].tri == tri) {
+        *lo = seg->keys[a].first;
+        *hi = seg->keys[a + 1].first;
+        if (*hi > seg->hdr->npost || *lo > *hi) *lo = *hi = 0;
+    }
+}
+
+static bool post_has(const uint32_t *post, uint64_t lo, uint64_t hi, uint32_t block) {
+    uint64_t end = hi;
+    while (lo < hi) {
+        uint64_t mid = lo + (hi - lo) / 2;
+        if (post[mid] < block) lo = mid + 1; else hi = mid;
+    }
+    return lo < end && post[lo] == block;
+}
+
+// Feed the matching lines of one block to m, newest first, until it holds
+// `need` entries
+static void hidx_scan_block(const HistIndex *ix, const HistSeg *seg, uint32_t b, const char *q,
+                            size_t qlen, HistSearchMode mode, int need, HistMatches *m) {
+    uint64_t from = seg->offs[b], to = seg->offs[b + 1];
+    if (from >= to || to > ix->text_len) return;
+    const char *line[HIDX_BLOCK + 1];
+    int n = 0;
+    for (const char *p = ix->text + from; p < ix->text + to && n < HIDX_BLOCK; ) {
+        line[n++] = p;
+        const char *nl = memchr(p, '\n', (size_t)(ix->text + to - p));
+        p = nl ? nl + 1 : ix->text + to;
+    }
+    line[n] = ix->text + to;
+    for (int i = n - 1; i >= 0; --i) {
+        size_t len = (size_t)(line[i + 1] - line[i]) - 1;
+        if (mode == HS_FUZZY) {
+            int score = fuzzy_score(line[i], len, q, qlen);
+            if (score >= 0) hm_add(m, line[i], len, score);
+        } else if (mode == HS_PREFIX ? len >= qlen && memcmp(line[i], q, qlen) == 0
+                                     : memmem(line[i], len, q, qlen) != nullptr) {
+            hm_add(m, line[i], len, HS_EXACT);
+            if (m->n >= need) return;
+        }
+    }
+}
+
+// Add the index's matches for q to m, newest first. Exact modes stop once
+// m holds `need` entries; any mode stops when the deadline passes.
+static void hidx_search(const char *q, HistSearchMode mode, int need, HistMatches *m) {
+    const HistIndex *ix = atomic_load(&g_hidx);
+    size_t qlen = strlen(q);
+    if (!ix || (mode == HS_FUZZY && qlen == 0)) return;
+
+    uint32_t tris[MAX_INPUT];
+    int ntri = 0;
+    uint64_t qmask[2] = {};
+    for (size_t k = 0; k < qlen; ++k) {
+        unsigned char c = (unsigned char)q[k];
+        qmask[c >> 6 & 1] |= 1ULL << (c & 63);
+        if (mode == HS_FUZZY || k + 3 > qlen) continue;
+        uint32_t tri = trigram(q + k);
+        int j = 0;
+        while (j < ntri && tris[j] != tri) ++j;
+        if (j == ntri) tris[ntri++] = tri;
+    }
+
+    for (int s = ix->nseg - 1; s >= 0 && !g_deadline_hit; --s) {
+        const HistSeg *seg = &ix->segs[s];
+        uint32_t nblocks = seg->hdr->nblocks;
+        if (ntri == 0) {
+            for (uint32_t b = nblocks; b-- > 0 && !g_deadline_hit; ) {
+                if ((seg->masks[b][0] & qmask[0]) != qmask[0] || (seg->masks[b][1] & qmask[1]) != qmask[1]) continue;
+                hidx_scan_block(ix, seg, b, q, qlen, mode, need, m);
+                if (mode != HS_FUZZY && m->n >= need) return;
+            }
+            continue;
+        }
+
+        // Walk the rarest trigram's blocks, keeping those that have the rest
+        uint64_t lo[MAX_INPUT], hi[MAX_INPUT];
+        int rare = 0;
+        for (int t = 0; t < ntri; ++t) {
+            hseg_lookup(seg, tris[t], &lo[t], &hi[t]);
+            if (hi[t] - lo[t] < hi[rare] - lo[rare]) rare = t;
+        }
+        for (uint64_t p = hi[rare]; p-- > lo[rare] && !g_deadline_hit; ) {
+            uint32_t b = seg->post[p];
+            bool all = b < nblocks;
+            for (int t = 0; t < ntri && all; ++t) all = t == rare || post_has(seg->post, lo[t], hi[t], b);
+            if (!all) continue;
+            hidx_scan_block(ix, seg, b, q, qlen, mode, need, m);
+            if (m->n >= need) return;
+        }
+    }
+}
+
+// ============================================================================
+// Line editor
+// ============================================================================
+
+// Small raw-mode editor covering what the REPL needs (history, prefix
+// search, Ctrl+R, emacs-style movement), so no terminal library is linked.
+
+static char **hist = nullptr;
+static int hist_len = 0;
+static int hist_cap = 0;
+
+static void hist_push(const char *line) {
+    if (hist_len == HIST_MAX_LINES) {
+        free(hist[0]);
+        memmove(hist, hist + 1, (size_t)--hist_len * sizeof(*hist));
+    }
+    if (hist_len == hist_cap) {
+        int cap = hist_cap ? hist_cap * 2 : 256;
+        char **h = realloc(hist, (size_t)cap * sizeof(*h));
+        if (!h) return;
+        hist = h;
+        hist_cap = cap;
+    }
+    char *copy = strdup(line);
+    if (copy) hist[hist_len++] = copy;
+}
+
+enum {
+    KEY_CTRL_A = 1, KEY_CTRL_B = 2, KEY_CTRL_C = 3, KEY_CTRL_D = 4,
+    KEY_CTRL_E = 5, KEY_CTRL_F = 6, KEY_CTRL_G = 7, KEY_CTRL_H = 8,
+    KEY_TAB = 9, KEY_CTRL_K = 11, KEY_CTRL_L = 12, KEY_ENTER = 13,
+    KEY_CTRL_N = 14, KEY_CTRL_P = 16, KEY_CTRL_R = 18, KEY_CTRL_U = 21,
+    KEY_CTRL_W = 23, KEY_ESC = 27, KEY_BACKSPACE = 127,
+    // Decoded escape sequences
+    KEY_UP = 1000, KEY_DOWN, KEY_LEFT, KEY_RIGHT, KEY_HOME, KEY_END, KEY_DEL,
+};
+
+typedef struct {
+    char buf[MAX_INPUT];
+    int len;
+    int pos;
+    const char *prompt;
+    bool show_preview;   // draw a result preview line below the prompt
+    char preview[96];
+} LineState;
+
+// Live result preview while typing (toggled with the `preview` command)
+static bool g_preview = true;
+constexpr long PREVIEW_BUDGET_MS = 500;   // longest a preview may delay the next key
+
+static struct termios orig_termios;
+
+static bool raw_enable(void) {
+    if (tcgetattr(STDIN_FILENO, &orig_termios) != 0) return false;
+    struct termios raw = orig_termios;
+    raw.c_iflag &= ~(tcflag_t)(BRKINT | ICRNL | INPCK | ISTRIP | IXON);
+    raw.c_oflag &= ~(tcflag_t)OPOST;
+    raw.c_cflag |= CS8;
+    raw.c_lflag &= ~(tcflag_t)(ECHO | ICANON | IEXTEN | ISIG);
+    raw.c_cc[VMIN] = 1;
+    raw.c_cc[VTIME] = 0;
+    return tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw) == 0;
+}
+
+static void raw_disable(void) {
+    tcsetattr(STDIN_FILENO, TCSAFLUSH, &orig_termios);
+}
+
+static void term_write(const char *s, size_t n) {
+    while (n > 0) {
+        ssize_t w = write(STDOUT_FILENO, s, n);
+        if (w <= 0) return;
+        s += w;
+        n -= (size_t)w;
+    }
+}
+
+static int term_cols(void) {
+    struct winsize ws;
+    if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == 0 && ws.ws_col > 0) return ws.ws_col;
+    return 80;
+}
+
+// Read one key, decoding the escape sequences terminals send for arrows etc.
+static int read_key(void) {
+    unsigned char c;
+    if (read(STDIN_FILENO, &c, 1) != 1) return -1;
+    if (c != KEY_ESC) return c;
+
+    unsigned char seq[8];
+    if (read(STDIN_FILENO, &seq[0], 1) != 1) return KEY_ESC;
+    if (seq[0] == 'O') {
+        if (read(STDIN_FILENO, &seq[1], 1) != 1) return KEY_ESC;
+        return seq[1] == 'H' ? KEY_HOME : seq[1] == 'F' ? KEY_END : KEY_ESC;
+    }
+    if (seq[0] != '[') return KEY_ESC;
+
+    // CSI: optional numeric parameters, then a final byte
+    int n = 0;
+    do {
+        if (read(STDIN_FILENO, &seq[n], 1) != 1) return KEY_ESC;
+    } while (!(seq[n] >= 0x40 && seq[n] <= 0x7E) && ++n < (int)sizeof(seq) - 1);
+
+    switch (seq[n]) {
+        case 'A': return KEY_UP;
+        case 'B': return KEY_DOWN;
+        case 'C': return KEY_RIGHT;
+        case 'D': return KEY_LEFT;
+        case 'H': return KEY_HOME;
+        case 'F': return KEY_END;
+        case '~':
+            switch (seq[0]) {
+                case '1': case '7': return KEY_HOME;
+                case '4': case '8': return KEY_END;
+                case '3': return KEY_DEL;
+            }
+    }
+    return KEY_ESC;
+}
+
+// UTF-8: the editor keeps the cursor on character boundaries and counts
+// one column per character
+static bool utf8_cont(char c) {
+    return ((unsigned char)c & 0xC0) == 0x80;
+}
+
+static int utf8_cols(const char *s, int n) {
+    int cols = 0;
+    for (int i = 0; i < n; ++i) cols += !utf8_cont(s[i]);
+    return cols;
+}
+
+static int utf8_next(const char *s, int len, int pos) {
+    if (pos < len) ++pos;
+    while (pos < len && utf8_cont(s[pos])) ++pos;
+    return pos;
+}
+
+static int utf8_prev(const char *s, int pos) {
+    if (pos > 0) --pos;
+    while (pos > 0 && utf8_cont(s[pos])) --pos;
+    return pos;
+}
+
+// The text a key types into out: a printable ASCII character, or a whole
+// UTF-8 character whose remaining bytes are read here. Returns its length,
+// 0 for keys that type nothing (or a malformed sequence).
+static int key_text(int key, char out[static 4]) {
+    int n = key >= 32 && key < 127 ? 1
+          : key >= 0xC2 && key <= 0xDF ? 2
+          : key >= 0xE0 && key <= 0xEF ? 3
+          : key >= 0xF0 && key <= 0xF4 ? 4 : 0;
+    out[0] = (char)key;
+    for (int i = 1; i < n; ++i) {
+        if (read(STDIN_FILENO, &out[i], 1) != 1 || !utf8_cont(out[i])) return 0;
+    }
+    return n;
+}
+
+// Redraw prompt and buffer, scrolling horizontally to keep the cursor
+// visible, plus the preview line underneath when enabled
+static void refresh_line(const LineState *ls) {
+    int cols = term_cols();
+    int plen = utf8_cols(ls->prompt, (int)strlen(ls->prompt));
+    int avail = cols - plen - 1;
+    if (avail < 1) avail = 1;
+    // Skip whole characters until the cursor column fits, then show what fits
+    int col = utf8_cols(ls->buf, ls->pos);
+    int skip = col > avail ? col - avail : 0;
+    int off = 0;
+    for (int i = 0; i < skip; ++i) off = utf8_next(ls->buf, ls->len, off);
+    int end = off;
+    for (int i = 0; i < avail && end < ls->len; ++i) end = utf8_next(ls->buf, ls->len, end);
+    int shown = end - off;
+
+    char out[MAX_INPUT + 256];
+    int n = snprintf(out, sizeof(out), "\r%s%.*s\x1b[0K", ls->prompt, shown, ls->buf + off);
+    if (ls->show_preview) {
+        n += snprintf(out + n, sizeof(out) - (size_t)n, "\r\n\x1b[2m%.*s\x1b[0m\x1b[0K\x1b[1A",
+                      cols - 1, ls->preview);
+    }
+    n += snprintf(out + n, sizeof(out) - (size_t)n, "\r");
+    if (plen + col - skip > 0) {
+        n += snprintf(out + n, sizeof(out) - (size_t)n, "\x1b[%dC", plen + col - skip);
+    }
+    term_write(out, (size_t)n);
+}
+
+// True when more keystrokes are already queued (typing fast or pasting)
+static bool input_pending(void) {
+    struct pollfd pfd = {.fd = STDIN_FILENO, .events = POLLIN};
+    return poll(&pfd, 1, 0) > 0;
+}
+
+// Evaluate the line quietly for the preview; true when there is one to
+// show. Skipped while more input is queued, so a burst of keys costs one
+// evaluation instead of one per key, and abandoned as soon as a key
+// arrives or PREVIEW_BUDGET_MS runs out.
+static bool update_preview(LineState *ls) {
+    ls->preview[0] = '\0';
+    if (!ls->show_preview || ls->len == 0 || input_pending()) return false;
+
+    g_quiet = g_in_preview = true;
+    deadline_arm(PREVIEW_BUDGET_MS, true);
+    double val = evaluate(ls->buf);
+    deadline_arm(0, false);
+    g_quiet = g_in_preview = false;
+    bool cancelled = g_deadline_hit;
+    g_interrupted = g_deadline_hit = 0;
+
+    char res[80];
+    if (cancelled || !format_result(res, sizeof(res), val)) return false;
+    snprintf(ls->preview, sizeof(ls->preview), "= %s", res);
+    return true;
+}
+
+static void set_line(LineState *ls, const char *text, int pos) {
+    ls->len = (int)strlen(text);
+    if (ls->len > MAX_INPUT - 1) ls->len = MAX_INPUT - 1;
+    memcpy(ls->buf, text, (size_t)ls->len);
+    ls->buf[ls->len] = '\0';
+    ls->pos = pos < ls->len ? pos : ls->len;
+}
+
+// Add history entries matching q to m: this session's list first, then
+// the index of the whole file. Substring and prefix matches come newest
+// first, stopping at `need`; fuzzy ones rank below them by score. Gives up
+// when a key arrives or PREVIEW_BUDGET_MS runs out, so typing never waits
+// on a search.
+static void hist_search(const char *q, HistSearchMode mode, int need, HistMatches *m) {
+    size_t qlen = strlen(q);
+    deadline_arm(PREVIEW_BUDGET_MS, true);
+    for (int i = hist_len - 1; i >= 0 && m->n < need && !g_deadline_hit; --i) {
+        size_t len = strlen(hist[i]);
+        if (mode == HS_FUZZY) {
+            int score = fuzzy_score(hist[i], len, q, qlen);
+            if (score >= 0) hm_add(m, hist[i], len, score);
+        } else if (mode == HS_PREFIX ? strncmp(hist[i], q, qlen) == 0 : strstr(hist[i], q) != nullptr) {
+            hm_add(m, hist[i], len, HS_EXACT);
+        }
+    }
+    if (mode == HS_FUZZY || m->n < need) hidx_search(q, mode, need, m);
+    deadline_arm(0, false);
+    g_interrupted = g_deadline_hit = 0;
+}
+
+// Incremental reverse search (Ctrl+R). Loads the match into ls and returns
+// the key that ended the search so the caller can act on it, or 0 when
+// the search was cancelled and the original line restored. Ctrl+R again
+// steps to the next match; the prompt says "failing" when there is none.
+// The newest match shows at once; the rest of the substring matches, then
+// fuzzy ones, are found while no key waits.
+static int reverse_search(LineState *ls) {
+    char query[MAX_INPUT] = {};
+    int qlen = 0;
+    HistMatches m = {};
+    int match = 0;
+    int stage = 0;      // searches left: 2 more substring matches, 1 fuzzy
+    bool past_end = false;  // Ctrl+R found no further match
+    LineState saved = *ls;
+
+    for (;;) {
+        bool failing = past_end || (qlen > 0 && m.n == 0 && stage == 0);
+        char out[2 * MAX_INPUT + 64];
+        int n = snprintf(out, sizeof(out), "\r(%sreverse-i-search)`%s': %s\x1b[0K",
+                         failing ? "failing " : "", query, match < m.n ? m.line[match] : "");
+        term_write(out, (size_t)(n < (int)sizeof(out) ? n : (int)sizeof(out) - 1));
+
+        // While no key waits, find the remaining matches (fuzzy ones rank
+        // below substring ones, so none fit once m is full). Redraw for
+        // the first match, or to say there is none.
+        bool found = false, searched = false;
+        while (stage > 0 && m.n < HIST_RESULTS && !found && !input_pending()) {
+            int before = m.n;
+            hist_search(query, stage-- == 2 ? HS_SUBSTR : HS_FUZZY, HIST_RESULTS, &m);
+            found = before == 0 && m.n > 0;
+            searched = true;
+        }
+        if (found || (searched && stage == 0 && qlen > 0 && m.n == 0)) continue;
+
+        int key = read_key();
+        char text[4];
+        int tlen;
+        if (key == KEY_CTRL_R) {
+            while (match + 1 >= m.n && m.n < HIST_RESULTS && stage > 0) {
+                hist_search(query, stage-- == 2 ? HS_SUBSTR : HS_FUZZY, HIST_RESULTS, &m);
+            }
+            if (match + 1 < m.n) ++match;
+            else past_end = true;
+            continue;
+        } else if (key == KEY_BACKSPACE || key == KEY_CTRL_H) {
+            qlen = utf8_prev(query, qlen);
+            query[qlen] = '\0';
+        } else if ((tlen = key_text(key, text)) > 0) {
+            if (qlen + tlen < MAX_INPUT) {
+                memcpy(query + qlen, text, (size_t)tlen);
+                qlen += tlen;
+            }
+        } else if (key >= 0x80 && key < 0x100) {
+            continue;   // malformed UTF-8
+        } else if (key == KEY_CTRL_G || key == KEY_CTRL_C || key == -1) {
+            hm_free(&m);
+            *ls = saved;
+            return 0;
+        } else {
+            if (match < m.n) set_line(ls, m.line[match], MAX_INPUT);
+            hm_free(&m);
+            return key;
+        }
+
+        hm_free(&m);
+        match = 0;
+        past_end = false;
+        if (qlen > 0) hist_search(query, HS_SUBSTR, 1, &m);
+        stage = qlen > 0 ? 2 : 0;
+    }
+}
+
+// Read a line of input; returns a malloc'd string or nullptr on EOF.
+// Falls back to plain line reads when stdin is not a terminal.
+static char *read_line(const char *prompt) {
+    if (!isatty(STDIN_FILENO) || !raw_enable()) {
+        char *line = nullptr;
+        size_t cap = 0;
+        ssize_t n = getline(&line, &cap, stdin);
+        if (n < 0) { free(line); return nullptr; }
+        while (n > 0 && (line[n - 1] == '\n' || line[n - 1] == '\r')) line[--n] = '\0';
+        return line;
+    }
+
+    LineState ls = {.prompt = prompt, .show_preview = g_preview};
+    char scratch[MAX_INPUT] = {};   // line being edited before history browsing
+    int hist_idx = -1;              // entries back from the newest; -1 is the edited line
+    int prefix_len = 0;
+    HistMatches found = {};         // prefix matches while browsing with a prefix
+    int last_key = 0;
+    bool done = false, eof = false;
+
+    refresh_line(&ls);
+    while (!done) {
+        int key = read_key();
+        if (key == KEY_CTRL_R) {
+            key = reverse_search(&ls);
+            hist_idx = -1;
+        }
+
+        switch (key) {
+            case -1:
+                eof = true;
+                done = true;
+                break;
+            case 0:
+                break;
+            case KEY_ENTER:
+            case '\n':
+                done = true;
+                break;
+            case KEY_CTRL_C:
+                term_write("^C", 2);
+                ls.len = ls.pos = 0;
+                done = true;
+                break;
+            case KEY_CTRL_D:
+                if (ls.len == 0) { eof = true; done = true; break; }
+                [[fallthrough]];
+            case KEY_DEL: {
+                int next = utf8_next(ls.buf, ls.len, ls.pos);
+                memmove(ls.buf + ls.pos, ls.buf + next, (size_t)(ls.len - next));
+                ls.len -= next - ls.pos;
+                break;
+            }
+            case KEY_BACKSPACE:
+            case KEY_CTRL_H: {
+                int prev = utf8_prev(ls.buf, ls.pos);
+                memmove(ls.buf + prev, ls.buf + ls.pos, (size_t)(ls.len - ls.pos));
+                ls.len -= ls.pos - prev;
+                ls.pos = prev;
+                break;
+            }
+            case KEY_CTRL_A: case KEY_HOME: ls.pos = 0; break;
+            case KEY_CTRL_E: case KEY_END:  ls.pos = ls.len; break;
+            case KEY_CTRL_B: case KEY_LEFT:  ls.pos = utf8_prev(ls.buf, ls.pos); break;
+            case KEY_CTRL_F: case KEY_RIGHT: ls.pos = utf8_next(ls.buf, ls.len, ls.pos); break;
+            case KEY_CTRL_K:
+                ls.len = ls.pos;
+                break;
+            case KEY_CTRL_U:
+                memmove(ls.buf, ls.buf + ls.pos, (size_t)(ls.len - ls.pos));
+                ls.len -= ls.pos;
+                ls.pos = 0;
+                break;
+            case KEY_CTRL_W: {
+                int start = ls.pos;
+                while (start > 0 && ls.buf[start - 1] == ' ') --start;
+                while (start > 0 && ls.buf[start - 1] != ' ') --start;
+                memmove(ls.buf + start, ls.buf + ls.pos, (size_t)(ls.len - ls.pos));
+                ls.len -= ls.pos - start;
+                ls.pos = start;
+                break;
+            }
+            case KEY_CTRL_L:
+                term_write("\x1b[H\x1b[2J", 7);
+                break;
+            case KEY_UP:
+            case KEY_CTRL_P:
+            case KEY_DOWN:
+            case KEY_CTRL_N: {
+                // Prefix search: match history entries starting with the
+                // text before the cursor when browsing began
+                bool up = key == KEY_UP || key == KEY_CTRL_P;
+                bool browsing = last_key == KEY_UP || last_key == KEY_CTRL_P ||
+                                last_key == KEY_DOWN || last_key == KEY_CTRL_N;
+                if (!browsing) {
+                    ls.buf[ls.len] = '\0';
+                    memcpy(scratch, ls.buf, (size_t)ls.len + 1);
+                    prefix_len = ls.pos;
+                    hist_idx = -1;
+                    hm_free(&found);
+                    if (prefix_len > 0) {
+                        char prefix[MAX_INPUT];
+                        snprintf(prefix, sizeof(prefix), "%.*s", prefix_len, scratch);
+                        hist_search(prefix, HS_PREFIX, HIST_RESULTS, &found);
+                    }
+                }
+
+                // Without a prefix step through the session's list; with
+                // one, through the (newest first) matches from the whole file
+                int n = prefix_len ? found.n : hist_len;
+                int i = hist_idx;
+                const char *entry = nullptr;
+                for (;;) {
+                    i += up ? 1 : -1;
+                    if (i < 0 || i >= n) break;
+                    entry = prefix_len ? found.line[i] : hist[hist_len - 1 - i];
+                    if (strcmp(entry, ls.buf) != 0) break;
+                }
+                if (i >= 0 && i < n) {
+                    hist_idx = i;
+                    set_line(&ls, entry, prefix_len ? prefix_len : MAX_INPUT);
+                } else if (!up) {
+                    hist_idx = -1;
+                    set_line(&ls, scratch, prefix_len);
+                }
+                break;
+            }
+            default: {
+                // Printable ASCII or a whole UTF-8 character
+                char text[4];
+                int n = key_text(key, text);
+                if (n > 0 && ls.len + n < MAX_INPUT) {
+                    memmove(ls.buf + ls.pos + n, ls.buf + ls.pos, (size_t)(ls.len - ls.pos));
+                    memcpy(ls.buf + ls.pos, text, (size_t)n);
+                    ls.pos += n;
+                    ls.len += n;
+                }
+                break;
+            }
+        }
+        last_key = key;
+        ls.buf[ls.len] = '\0';
+        if (!done) {
+            // Echo the key first; a slow preview then only delays itself
+            ls.preview[0] = '\0';
+            refresh_line(&ls);
+            if (update_preview(&ls)) refresh_line(&ls);
+        }
+    }
+
+    // Final redraw with the cursor at the end, clearing the preview line,
+    // before moving to a fresh line
+    ls.pos = ls.len;
+    ls.show_preview = false;
+    refresh_line(&ls);
+    term_write("\x1b[0J\r\n", 6);
+    raw_disable();
+    hm_free(&found);
+    return eof ? nullptr : strdup(ls.buf);
+}
+
+// ============================================================================
+// Interactive mode
+// ============================================================================
+
+static const char *get_history_path(void) {
+    static char path[512];
+    const char *home = getenv("HOME");
+    if (home) {
+        snprintf(path, sizeof(path), "%s/.c_history", home);
+        return path;
+    }
+    return nullptr;
+}
+
+// Read up to `max` bytes from the end of fd into a malloc'd buffer, starting
+// at a line boundary. Returns the number of bytes in *out (0 on failure).
+static size_t read_tail(int fd, long max, char **out) {
+    *out = nullptr;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size == 0) return 0;
+
+    off_t off = st.st_size > max ? st.st_size - max : 0;
+    size_t len = (size_t)(st.st_size - off);
+    char *buf = malloc(len + 1);
+    if (!buf) return 0;
+
+    ssize_t n = pread(fd, buf, len, off);
+    if (n <= 0) { free(buf); return 0; }
+    len = (size_t)n;
+    buf[len] = '\0';
+
+    // Drop the partial first line when starting mid-file
+    size_t skip = 0;
+    if (off > 0) {
+        char *nl = memchr(buf, '\n', len);
+        skip = nl ? (size_t)(nl - buf) + 1 : len;
+    }
+    memmove(buf, buf + skip, len - skip + 1);
+    *out = buf;
+    return len - skip;
+}
+
+// Load the newest HIST_MAX_LINES distinct entries without reading the whole
+// file. Calculator histories are mostly repeats, so deduplicating here keeps
+// the list that prefix search and Ctrl+R walk small.
+static void history_load(const char *path) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return;
+    flock(fd, LOCK_SH);
+    char *buf;
+    size_t len = read_tail(fd, HIST_LOAD_BYTES, &buf);
+    flock(fd, LOCK_UN);
+    close(fd);
+    if (len == 0) return;
+
+    size_t nlines = 0;
+    for (size_t i = 0; i < len; ++i) nlines += buf[i] == '\n';
+    char **lines = malloc((nlines + 1) * sizeof(*lines));
+    size_t cap = 16;
+    while (cap < 2 * (size_t)HIST_MAX_LINES && cap < 2 * nlines) cap <<= 1;
+    const char **seen = calloc(cap, sizeof(*seen));
+    if (!lines || !seen) { free(lines); free(seen); free(buf); return; }
+
+    nlines = 0;
+    for (char *line = strtok(buf, "\n"); line; line = strtok(nullptr, "\n")) {
+        lines[nlines++] = line;
+    }
+
+    // Newest first: keep the most recent occurrence of each entry
+    int kept = 0;
+    size_t first = nlines;
+    while (first > 0 && kept < HIST_MAX_LINES) {
+        char *line = lines[--first];
+        size_t slot = hash_str(line, 0) & (cap - 1);
+        while (seen[slot] && strcmp(seen[slot], line) != 0) slot = (slot + 1) & (cap - 1);
+        if (seen[slot]) {
+            lines[first] = nullptr;
+        } else {
+            seen[slot] = line;
+            ++kept;
+        }
+    }
+
+    for (size_t i = first; i < nlines; ++i) {
+        if (lines[i]) hist_push(lines[i]);
+    }
+    free(seen);
+    free(lines);
+    free(buf);
+}
+
+// Add an entry, dropping any older copy so each line appears once
+static void history_add(const char *line) {
+    for (int i = hist_len - 1; i >= 0; --i) {
+        if (strcmp(hist[i], line) == 0) {
+            free(hist[i]);
+            memmove(hist + i, hist + i + 1, (size_t)(hist_len - i - 1) * sizeof(*hist));
+            --hist_len;
+            break;
+        }
+    }
+    hist_push(line);
+}
+
+// Append one entry with a single write under an exclusive lock, so
+// concurrent sessions never interleave and a crash loses nothing. If
+// another session compacted the file meanwhile, reopen it by name first.
+static void history_append(int *fd, const char *path, const char *line) {
+    if (*fd < 0) return;
+    char buf[MAX_INPUT + 1];
+    int n = snprintf(buf, sizeof(buf), "%s\n", line);
+    if (n < 0 || n >= (int)sizeof(buf)) return;
+
+    struct stat st;
+    for (flock(*fd, LOCK_EX); fstat(*fd, &st) == 0 && !same_file(path, &st); flock(*fd, LOCK_EX)) {
+        flock(*fd, LOCK_UN);
+        close(*fd);
+        *fd = open(path, O_WRONLY | O_APPEND | O_CREAT, 0600);
+        if (*fd < 0) { perror("history"); return; }
+    }
+    if (write(*fd, buf, (size_t)n) != n) perror("history");
+    flock(*fd, LOCK_UN);
+}
+
+// Retention limit in bytes: $C_HISTORY_SIZE with an optional K/M/G suffix,
+// 0 for unlimited, or HIST_MAX_BYTES when unset
+static long history_limit(void) {
+    const char *s = getenv("C_HISTORY_SIZE");
+    if (!s || !*s) return HIST_MAX_BYTES;
+    char *end;
+    double v = strtod(s, &end);
+    int shift = !*end ? 0 : strchr("kK", *end) ? 10 : strchr("mM", *end) ? 20 : strchr("gG", *end) ? 30 : 0;
+    double unit = ldexp(1, shift);
+    if (shift) ++end;
+    if (*end || !(v >= 0 && v * unit < 0x1p62)) {
+        fprintf(stderr, "C_HISTORY_SIZE: invalid size '%s'\n", s);
+        return HIST_MAX_BYTES;
+    }
+    return (long)(v * unit);
+}
+
+// Copy bytes [from, to) of in to the end of out
+static bool copy_range(int in, int out, off_t from, off_t to) {
+    char buf[1 << 16];
+    while (from < to) {
+        size_t want = to - from < (off_t)sizeof(buf) ? (size_t)(to - from) : sizeof(buf);
+        ssize_t n = pread(in, buf, want, from);
+        if (n <= 0 || write(out, buf, (size_t)n) != n) return false;
+        from += n;
+    }
+    return true;
+}
+
+// Once the file exceeds the retention limit, replace it with its newest
+// half: the tail is copied to a temporary file, synced and renamed over
+// the original, so a crash leaves either the old file or the new one.
+// Other sessions' appends wait on the old file's lock and then reopen.
+static void history_compact(const char *path) {
+    long limit = history_limit();
+    int fd = limit > 0 ? open(path, O_RDONLY) : -1;
+    if (fd < 0) return;
+    flock(fd, LOCK_EX);
+
+    struct stat st;
+    if (fstat(fd, &st) == 0 && st.st_size > limit && same_file(path, &st)) {
+        // Start at the first full line of the newest half
+        off_t from = st.st_size - limit / 2;
+        char probe[MAX_INPUT + 1];
+        ssize_t n = pread(fd, probe, sizeof(probe), from - 1);
+        char *nl = n > 0 ? memchr(probe, '\n', (size_t)n) : nullptr;
+        from = nl ? from + (nl - probe) : st.st_size;
+
+        char tmp[520];
+        snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+        int out = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+        bool ok = out >= 0 && copy_range(fd, out, from, st.st_size) && fsync(out) == 0;
+        if (out >= 0 && close(out) != 0) ok = false;
+        if (!ok || rename(tmp, path) != 0) {
+            perror("history");
+            if (out >= 0) remove(tmp);
+        }
+    }
+
+    flock(fd, LOCK_UN);
+    close(fd);
+}
+
+static void on_sigint(int sig) {
+    (void)sig;
+    g_interrupted = 1;
+}
+
+// :grad EXPR - the value and its sensitivity to each input, largest first
+static void print_gradient(const char *input) {
+    Expr e;
+    Parser p = {.src = input, .pos = input};
+    g_error[0] = '\0';
+    next_token(&p);
+    int root = compile(&e, &p);
+    if (!root || g_error[0]) return;
+
+    DualCtx c = {};
+    dual_seed_inputs(&c, &e, root, 0);
+    double out[DUAL_MAX + 1];
+    if (!dual_run(&c, &e, root, out)) return;
+
+    g_output_fmt = FMT_DEC;
+    char buf[80];
+    if (!format_result(buf, sizeof(buf), out[0])) strcpy(buf, "nan");
+    printf("%s\n", buf);
+
+    // Elasticity: percent change in the result per percent change in the input
+    int order[DUAL_MAX];
+    double elast[DUAL_MAX];
+    for (int i = 0; i < c.k; ++i) {
+        order[i] = i;
+        elast[i] = out[0] != 0 ? out[i + 1] * get_var(c.seed[i]) / out[0] : NAN;
+    }
+    for (int i = 1; i < c.k; ++i) {
+        for (int j = i; j > 0 && !(fabs(elast[order[j]]) <= fabs(elast[order[j - 1]])); --j) {
+            int t = order[j];
+            order[j] = order[j - 1];
+            order[j - 1] = t;
+        }
+    }
+    for (int i = 0; i < c.k; ++i) {
+        int v = order[i];
+        if (!format_result(buf, sizeof(buf), out[v + 1])) strcpy(buf, "nan");
+        printf("  d/d%-12s %-16s 1%% -> %+.3g%%\n", c.seed[v], buf, elast[v]);
+    }
+}
+
+static void repl(void) {
+    // Ctrl+C cancels the running evaluation instead of ending the session.
+    // At the prompt the editor reads it as a key (raw mode disables ISIG).
+    struct sigaction sa = {.sa_handler = on_sigint};
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGINT, &sa, nullptr);
+
+    // Load history
+    const char *hist_path = get_history_path();
+    int hist_fd = -1;
+    if (hist_path) {
+        history_load(hist_path);
+        if (isatty(STDIN_FILENO)) hidx_start(hist_path);
+        hist_fd = open(hist_path, O_WRONLY | O_APPEND | O_CREAT, 0600);
+    }
+
+    char *line;
+    while ((line = read_line("> ")) != nullptr) {
+        // Skip empty lines
+        if (line[0] == '\0') {
+            free(line);
+            continue;
+        }
+
+        // Exit commands
+        if (strcmp(line, "q") == 0 || strcmp(line, "quit") == 0 ||
+            strcmp(line, "exit") == 0) {
+            free(line);
+            break;
+        }
+
+        // List variables and bindings
+        if (strcmp(line, "vars") == 0) {
+            g_output_fmt = FMT_DEC;
+            for (int i = 0; i < var_count; ++i) {
+                char buf[80];
+                if (find_mat(vars[i].name) >= 0) continue;   // shadowed by a matrix
+                double val = get_var(vars[i].name);
+                if (vars[i].exact) snprintf(buf, sizeof(buf), "%.79s", vars[i].exact);
+                else if (!format_result(buf, sizeof(buf), val)) strcpy(buf, "nan");
+                if (vars[i].formula) {
+                    printf("%s := %s  -> %s\n", vars[i].name, vars[i].formula, buf);
+                } else {
+                    printf("%s = %s\n", vars[i].name, buf);
+                }
+            }
+            for (int i = 0; i < mat_var_count; ++i) {
+                printf("%s = [%dx%d matrix]\n", mat_vars[i].name, mat_vars[i].m.rows, mat_vars[i].m.cols);
+            }
+            free(line);
+            continue;
+        }
+
+        // Session snapshot
+        if (strncmp(line, ":save ", 6) == 0 || strncmp(line, ":load ", 6) == 0) {
+            const char *path = line + 6;
+            while (*path == ' ') ++path;
+            if (line[1] == 's') {
+                session_save(path);
+            } else {
+                session_load(path, true);
+            }
+            free(line);
+            continue;
+        }
+
+        // Sensitivities to the inputs
+        if (strncmp(line, ":grad ", 6) == 0) {
+            print_gradient(line + 6);
+            free(line);
+            continue;
+        }
+
+        // Toggle live result preview
+        if (strcmp(line, "preview") == 0) {
+            g_preview = !g_preview;
+            printf("preview %s\n", g_preview ? "on" : "off");
+            free(line);
+            continue;
+        }
+
+        // Help
+        if (strcmp(line, "help") == 0 || strcmp(line, "?") == 0) {
             puts("termcalc - fast terminal calculator");
             puts("");
             puts("OPERATORS");
@@ -590,18 +7736,37 @@ static void repl(void) {
             puts("  hex:         0xFF, 0x1A2B");
             puts("  binary:      0b1010, 0b11110000");
             puts("  octal:       0o755, 0o644");
+            puts("  integers past 2^53 or 64 bits are exact: 2^200, factorial(100)");
+            puts("  --precision dd|qd    ~32 / ~64 significant digits");
+            puts("  --mc N EXPR [NAME=DIST ...]  Monte Carlo summary; DIST is uniform(a,b),");
+            puts("                       normal(mu,s), lognormal(mu,s) or poisson(l)");
             puts("");
             puts("FUNCTIONS");
             puts("  math:        sin cos tan asin acos atan sinh cosh tanh");
-            puts("               exp log log10 log2 ln sqrt cbrt abs floor ceil round");
+            puts("               exp log log10 log2 ln sqrt cbrt abs floor ceil round factorial");
             puts("               pow(x,y) atan2(y,x) max(a,b) min(a,b) mod(a,b)");
             puts("  bitwise:     popcount clz ctz bnot not8 not16 not32");
             puts("               bxor(a,b) band(a,b) bor(a,b) shl(x,n) shr(x,n)");
-            puts("  format:      hex() bin() oct() dec()");
+            puts("               bswap16 bswap32 bswap64 parity bitrev(x[,w])");
+            puts("               rotl(x,n[,w]) rotr(x,n[,w]) pext(x,m) pdep(x,m)");
+            puts("               bextr(x,start,len) bitfield(x,hi,lo)");
+            puts("  hashes:      crc32c(x) xxh3(x[,seed]) murmur3(x[,seed])  (8 bytes of x)");
+            puts("               crc32c_file(\"path\") xxh3_file(\"path\")");
+            puts("  buffers:     file(\"path\") blob(\"hex\")  (& | ~ band bor bxor bytewise)");
+            puts("               popcount(buf) hamming(a,b)");
+            puts("  integers:    isprime nextprime totient gcd(a,b) lcm(a,b)");
+            puts("               modpow(b,e,m) mulmod(a,b,m) modinv(a,m)");
+            puts("               primepi nthprime primes(a,b)");
+            puts("  calculus:    integrate(expr,x,a,b)   (a, b may be -inf/inf)");
+            puts("               solve(expr,x,lo,hi) minimize(expr,x,lo,hi)");
+            puts("               diff(expr,x) diff(expr,x,at)");
+            puts("  matrices:    [1,2;3,4] (elementwise + - * / ^ and math functions)");
+            puts("               matmul(A,B) dot(a,b) transpose inv det solve(A,b)");
+            puts("  format:      hex() bin() oct() dec() factor()");
             puts("  bytes:       toKiB toMiB toGiB toTiB toKB toMB toGB toTB");
             puts("");
             puts("CONSTANTS");
-            puts("  pi e ans");
+            puts("  pi e inf ans");
             puts("  KiB MiB GiB TiB  (1024-based)");
             puts("  KB MB GB TB     (1000-based)");
             puts("");
@@ -614,22 +7779,1236 @@ static void repl(void) {
             puts("  4*GiB                -> 4294967296");
             puts("  toMiB(4*GiB)         -> 4096");
             puts("");
+            puts("VARIABLES");
+            puts("  x = expr             assign a value");
+            puts("  y := expr            bind a formula, recomputed when its inputs change");
+            puts("  vars                 list variables and bindings");
+            puts("  :save FILE           save variables and bindings");
+            puts("  :load FILE           restore a saved session");
+            puts("  :grad EXPR           sensitivity of EXPR to each input variable");
+            puts("");
+            puts("preview: toggle the live result shown while typing");
             puts("exit: q, quit, exit, or Ctrl+D");
             free(line);
             continue;
         }
 
-        // Add to history
-        add_history(line);
+        // Add to history
+        history_add(line);
+        history_append(&hist_fd, hist_path, line);
+
+        progress_begin("working");
+        double result = evaluate(line);
+        progress_end();
+        free(line);
+        if (g_interrupted) {
+            g_interrupted = 0;
+            fputs("interrupted\n", stderr);
+            continue;
+        }
+        print_result(result);
+        if (g_have_mat) {
+            mat_store("ans", &g_mat_last);
+        } else if (!g_have_buf) {
+            set_var("ans", result);
+            xp_store_tail("ans");
+            if (g_have_exact) var_set_exact("ans", &g_exact);
+        }
+    }
+
+    // History is already on disk; just keep the file bounded
+    if (hist_fd >= 0) close(hist_fd);
+    if (hist_path) history_compact(hist_path);
+}
+
+// ============================================================================
+// Compiled expressions
+// ============================================================================
+
+// The services let a request name its expression by a nonzero handle: the
+// text is sent once with the handle, later requests send only the handle
+// and skip parsing. Text that differs from what the handle holds
+// recompiles it; a handle no longer kept (up to CACHED_HANDLES of them)
+// fails with "unknown handle", and the client resends the text.
+
+constexpr int CACHED_HANDLES = 256;
+
+// In the slot handle % CACHED_HANDLES
+typedef struct {
+    uint32_t handle;                 // 0 while the slot is empty
+    char *src;                       // literals in the tree point into it
+    Expr *e;
+    int root;
+} CachedExpr;
+
+static CachedExpr expr_cache[CACHED_HANDLES];
+
+// The tree for a handle: cached when the text is empty or unchanged,
+// otherwise compiled from the text and cached
+static const CachedExpr *cached_expr(uint32_t handle, const char *expr) {
+    CachedExpr *c = &expr_cache[handle % CACHED_HANDLES];
+    if (c->handle == handle && (expr[0] == '\0' || strcmp(c->src, expr) == 0)) return c;
+    if (expr[0] == '\0') {
+        eval_error("unknown handle %" PRIu32 "\n", handle);
+        return nullptr;
+    }
+    c->handle = 0;
+    free(c->src);
+    c->src = strdup(expr);
+    if (!c->e) c->e = malloc(sizeof(*c->e));
+    if (!c->src || !c->e) {
+        eval_error("out of memory\n");
+        return nullptr;
+    }
+
+    Parser p = {.src = c->src, .pos = c->src};
+    g_error[0] = '\0';
+    next_token(&p);
+    c->root = compile(c->e, &p);
+    if (p.cur.type == TOK_OP && (p.cur.op == '=' || p.cur.op == ':')) {
+        eval_error("a handle names an expression, not an assignment\n");
+    }
+    if (!c->root || g_error[0]) return nullptr;
+    c->handle = handle;
+    return c;
+}
+
+static double evaluate_handle(uint32_t handle, const char *expr) {
+    const CachedExpr *c = cached_expr(handle, expr);
+    if (!c) return NAN;
+    evaluate_reset();
+    return evaluate_tree(c->e, c->root);
+}
+
+// ============================================================================
+// NDJSON service
+// ============================================================================
+
+// `c --serve-ndjson ADDR` answers one JSON request per line on a Unix socket
+// (ADDR contains '/') or a TCP port (PORT or HOST:PORT, default 127.0.0.1):
+//
+//   {"id":7,"expr":"a*b","vars":{"a":2,"b":3}}  ->  {"id":7,"result":6,"text":"6"}
+//
+// A request may add "handle":N to name its expression (see Compiled
+// expressions); later ones send {"handle":N,"vars":...} without "expr".
+// Each request starts from a clean variable table plus its "vars"; loaded
+// constant libraries stay visible. Requests are pipelined and answered in
+// order. `GET /metrics` on the same socket returns counters and latency
+// quantiles as plain text. Each request gets SERVE_TIME_LIMIT_MS, builtins
+// that read files are disabled, and a client that lets SERVE_MAX_OUT of
+// responses pile up unread is dropped. The event loop is a single epoll
+// thread since the evaluator is not thread-safe; TCP listeners set
+// SO_REUSEPORT so several server processes can share a port to use more
+// cores.
+
+#ifdef __linux__
+
+constexpr size_t SERVE_MAX_LINE = 64 * 1024;
+constexpr size_t SERVE_MAX_OUT = 1 << 20;   // unread responses before a client is dropped
+constexpr long SERVE_TIME_LIMIT_MS = 2000;  // per request
+constexpr int SERVE_MAX_EVENTS = 256;
+constexpr int LAT_SUB = 8;        // histogram sub-buckets per power of two
+constexpr int LAT_BUCKETS = 64 * LAT_SUB;
+
+typedef struct {
+    int fd;
+    char *in;
+    size_t in_len, in_cap;
+    char *out;
+    size_t out_len, out_off, out_cap;
+    bool close_after_write;
+    bool dropped;           // stopped reading its responses
+} Conn;
+
+static struct {
+    uint64_t requests;
+    uint64_t errors;
+    uint64_t connections;
+    uint64_t active;
+    uint64_t latency[LAT_BUCKETS];   // request latency in ns, log-linear buckets
+} stats;
+
+static int lat_bucket(uint64_t ns) {
+    if (ns < LAT_SUB) return (int)ns;
+    int exp = 63 - __builtin_clzll(ns);
+    int sub = (int)((ns >> (exp - 3)) & (LAT_SUB - 1));
+    return (exp - 2) * LAT_SUB + sub;
+}
+
+static uint64_t lat_bucket_ns(int b) {
+    if (b < LAT_SUB) return (uint64_t)b;
+    int exp = b / LAT_SUB + 2;
+    return ((uint64_t)(LAT_SUB + b % LAT_SUB)) << (exp - 3);
+}
+
+static double lat_quantile_us(double q) {
+    uint64_t total = 0;
+    for (int b = 0; b < LAT_BUCKETS; ++b) total += stats.latency[b];
+    if (total == 0) return 0.0;
+    uint64_t rank = (uint64_t)ceil(q * (double)total), seen = 0;
+    for (int b = 0; b < LAT_BUCKETS; ++b) {
+        seen += stats.latency[b];
+        if (seen >= rank) return (double)lat_bucket_ns(b) / 1000.0;
+    }
+    return 0.0;
+}
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+static bool conn_reserve(char **buf, size_t *cap, size_t need) {
+    if (need <= *cap) return true;
+    size_t cap2 = *cap ? *cap : 4096;
+    while (cap2 < need) cap2 *= 2;
+    char *grown = realloc(*buf, cap2);
+    if (!grown) return false;
+    *buf = grown;
+    *cap = cap2;
+    return true;
+}
+
+[[gnu::format(printf, 2, 3)]]
+static void conn_printf(Conn *c, const char *fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    int n = vsnprintf(nullptr, 0, fmt, ap);
+    va_end(ap);
+    if (n < 0 || !conn_reserve(&c->out, &c->out_cap, c->out_len + (size_t)n + 1)) return;
+    va_start(ap, fmt);
+    vsnprintf(c->out + c->out_len, (size_t)n + 1, fmt, ap);
+    va_end(ap);
+    c->out_len += (size_t)n;
+}
+
+// Minimal JSON reader: just enough for the request object
+
+static const char *json_ws(const char *s) {
+    while (*s == ' ' || *s == '\t' || *s == '\r' || *s == '\n') ++s;
+    return s;
+}
+
+// Parse a string into out (ASCII escapes only); returns the end, or nullptr
+// if it is malformed or does not fit
+static const char *json_string(const char *s, char *out, size_t size) {
+    if (*s != '"') return nullptr;
+    size_t n = 0;
+    for (++s; *s != '"'; ++s) {
+        if (*s == '\0') return nullptr;
+        char c = *s;
+        if (c == '\\') {
+            switch (*++s) {
+                case 'n': c = '\n'; break;
+                case 't': c = '\t'; break;
+                case 'r': c = '\r'; break;
+                case 'b': c = '\b'; break;
+                case 'f': c = '\f'; break;
+                case 'u': {
+                    unsigned code;
+                    if (sscanf(s + 1, "%4x", &code) != 1 || code > 0x7F) return nullptr;
+                    c = (char)code;
+                    s += 4;
+                    break;
+                }
+                case '\0': return nullptr;
+                default: c = *s; break;
+            }
+        }
+        if (n + 1 >= size) return nullptr;  // too long: no silent truncation
+        out[n++] = c;
+    }
+    out[n] = '\0';
+    return s + 1;
+}
+
+// Skip any JSON value; returns the end or nullptr
+static const char *json_skip(const char *s) {
+    s = json_ws(s);
+    if (*s == '"') {
+        for (++s; *s != '"'; ++s) {
+            if (*s == '\0') return nullptr;
+            if (*s == '\\' && *++s == '\0') return nullptr;
+        }
+        return s + 1;
+    }
+    if (*s == '{' || *s == '[') {
+        char close = *s == '{' ? '}' : ']';
+        s = json_ws(s + 1);
+        if (*s == close) return s + 1;
+        for (;;) {
+            if (close == '}') {
+                if (!(s = json_skip(s))) return nullptr;
+                s = json_ws(s);
+                if (*s++ != ':') return nullptr;
+            }
+            if (!(s = json_skip(s))) return nullptr;
+            s = json_ws(s);
+            if (*s == close) return s + 1;
+            if (*s++ != ',') return nullptr;
+        }
+    }
+    const char *start = s;
+    while (*s && !strchr(",}] \t\r\n", *s)) ++s;
+    return s > start ? s : nullptr;
+}
 
-        double result = evaluate(line);
-        print_result(result);
-        set_var("ans", result);
-        free(line);
+// Parse {"name": number, ...} into variables; returns the end or nullptr
+static const char *json_vars(const char *s) {
+    if (*s++ != '{') return nullptr;
+    s = json_ws(s);
+    if (*s == '}') return s + 1;
+    for (;;) {
+        char name[MAX_NAME];
+        if (!(s = json_string(json_ws(s), name, sizeof(name)))) return nullptr;
+        s = json_ws(s);
+        if (*s++ != ':') return nullptr;
+        s = json_ws(s);
+        char *end;
+        double val = strtod(s, &end);
+        if (end == s) return nullptr;
+        set_var(name, val);
+        s = json_ws(end);
+        if (*s == '}') return s + 1;
+        if (*s++ != ',') return nullptr;
+    }
+}
+
+static void clear_vars(void) {
+    for (int i = 0; i < var_count; ++i) {
+        free(vars[i].formula);
+        free(vars[i].exact);
+    }
+    var_count = 0;
+}
+
+// Handle one request line, appending the response to c->out
+static void serve_request(Conn *c, const char *line) {
+    char expr[MAX_INPUT] = {};
+    uint32_t handle = 0;
+    const char *id = nullptr;
+    size_t id_len = 0;
+    const char *err = nullptr;
+
+    clear_vars();
+    const char *s = json_ws(line);
+    if (*s++ != '{') err = "expected a JSON object";
+    s = json_ws(s);
+    if (!err && *s == '}') err = "missing expr";
+    while (!err) {
+        char key[MAX_NAME];
+        if (!(s = json_string(json_ws(s), key, sizeof(key)))) { err = "bad key"; break; }
+        s = json_ws(s);
+        if (*s++ != ':') { err = "expected ':'"; break; }
+        s = json_ws(s);
+
+        if (strcmp(key, "expr") == 0) {
+            const char *end = json_string(s, expr, sizeof(expr));
+            if (!end) err = *s == '"' && json_skip(s) ? "expr too long" : "expr must be a string";
+            s = end;
+        } else if (strcmp(key, "id") == 0) {
+            id = s;
+            if ((s = json_skip(s))) id_len = (size_t)(s - id);
+            else err = "bad id";
+        } else if (strcmp(key, "handle") == 0) {
+            char *end;
+            double h = strtod(s, &end);
+            if (end == s || !(h >= 1 && h <= UINT32_MAX) || h != floor(h)) err = "handle must be a positive integer";
+            else handle = (uint32_t)h;
+            s = end;
+        } else if (strcmp(key, "vars") == 0) {
+            if (!(s = json_vars(s))) err = "vars must map names to numbers";
+        } else if (!(s = json_skip(s))) {
+            err = "bad value";
+        }
+        if (err) break;
+
+        s = json_ws(s);
+        if (*s == '}') break;
+        if (*s++ != ',') err = "expected ','";
+    }
+    if (!err && expr[0] == '\0' && !handle) err = "missing expr";
+
+    double val = NAN;
+    if (!err) {
+        g_error[0] = '\0';
+        deadline_arm(SERVE_TIME_LIMIT_MS, false);
+        val = handle ? evaluate_handle(handle, expr) : evaluate(expr);
+        deadline_arm(0, false);
+        if (g_deadline_hit) err = "time limit exceeded";
+        else if (isnan(val)) err = g_error[0] ? g_error : "no result";
+        g_interrupted = g_deadline_hit = 0;
+    }
+
+    conn_printf(c, "{");
+    if (id) conn_printf(c, "\"id\":%.*s,", (int)id_len, id);
+    if (err) {
+        ++stats.errors;
+        // Error messages end in a newline and contain no quotes
+        conn_printf(c, "\"error\":\"%.*s\"}\n", (int)strcspn(err, "\n\""), err);
+    } else {
+        char text[80], num[32] = "null";
+        format_result(text, sizeof(text), val);
+        if (isfinite(val)) snprintf(num, sizeof(num), "%.17g", val);
+        conn_printf(c, "\"result\":%s,\"text\":\"%s\"}\n", num, text);
+    }
+}
+
+static void serve_metrics(Conn *c) {
+    char body[512];
+    int n = snprintf(body, sizeof(body),
+                     "requests_total %" PRIu64 "\n"
+                     "errors_total %" PRIu64 "\n"
+                     "connections_total %" PRIu64 "\n"
+                     "connections_active %" PRIu64 "\n"
+                     "latency_p50_us %.3f\n"
+                     "latency_p99_us %.3f\n"
+                     "latency_p999_us %.3f\n",
+                     stats.requests, stats.errors, stats.connections, stats.active,
+                     lat_quantile_us(0.50), lat_quantile_us(0.99), lat_quantile_us(0.999));
+    conn_printf(c, "HTTP/1.0 200 OK\r\nContent-Type: text/plain\r\n"
+                   "Content-Length: %d\r\n\r\n%s", n, body);
+    c->close_after_write = true;
+}
+
+// Process every complete line in the input buffer
+static void conn_process(Conn *c) {
+    size_t start = 0;
+    for (;;) {
+        char *nl = memchr(c->in + start, '\n', c->in_len - start);
+        if (!nl) break;
+        *nl = '\0';
+        const char *line = c->in + start;
+        start = (size_t)(nl - c->in) + 1;
+
+        if (strncmp(line, "GET ", 4) == 0) {
+            serve_metrics(c);
+            start = c->in_len;   // ignore the rest of the HTTP request
+            break;
+        }
+        if (*json_ws(line) == '\0') continue;
+        if (c->out_len - c->out_off >= SERVE_MAX_OUT) {
+            c->dropped = true;
+            break;
+        }
+
+        uint64_t t0 = now_ns();
+        serve_request(c, line);
+        ++stats.requests;
+        ++stats.latency[lat_bucket(now_ns() - t0)];
+    }
+    memmove(c->in, c->in + start, c->in_len - start);
+    c->in_len -= start;
+    if (c->in_len >= SERVE_MAX_LINE) {
+        conn_printf(c, "{\"error\":\"request too long\"}\n");
+        c->close_after_write = true;
+        c->in_len = 0;
+    }
+}
+
+static void conn_close(int ep, Conn *c) {
+    epoll_ctl(ep, EPOLL_CTL_DEL, c->fd, nullptr);
+    close(c->fd);
+    free(c->in);
+    free(c->out);
+    free(c);
+    --stats.active;
+}
+
+// Returns false when the connection should be closed
+static bool conn_flush(int ep, Conn *c) {
+    while (c->out_off < c->out_len) {
+        ssize_t n = write(c->fd, c->out + c->out_off, c->out_len - c->out_off);
+        if (n < 0 && errno == EAGAIN) break;
+        if (n <= 0) return false;
+        c->out_off += (size_t)n;
+    }
+    bool pending = c->out_off < c->out_len;
+    if (!pending) {
+        c->out_off = c->out_len = 0;
+        if (c->close_after_write) return false;
+    } else if (c->out_off > 0) {
+        memmove(c->out, c->out + c->out_off, c->out_len - c->out_off);
+        c->out_len -= c->out_off;
+        c->out_off = 0;
+    }
+    struct epoll_event ev = {.events = EPOLLIN | (pending ? EPOLLOUT : 0), .data.ptr = c};
+    epoll_ctl(ep, EPOLL_CTL_MOD, c->fd, &ev);
+    return true;
+}
+
+static int serve_listen(const char *addr) {
+    int fd;
+    if (strchr(addr, '/')) {
+        struct sockaddr_un sun = {.sun_family = AF_UNIX};
+        if (strlen(addr) >= sizeof(sun.sun_path)) {
+            fprintf(stderr, "%s: socket path too long\n", addr);
+            return -1;
+        }
+        strcpy(sun.sun_path, addr);
+        unlink(addr);
+        fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (fd < 0 || bind(fd, (struct sockaddr *)&sun, sizeof(sun)) != 0) {
+            perror(addr);
+            if (fd >= 0) close(fd);
+            return -1;
+        }
+    } else {
+        char host[64] = "127.0.0.1";
+        const char *port = strrchr(addr, ':');
+        if (port) {
+            snprintf(host, sizeof(host), "%.*s", (int)(port - addr), addr);
+            ++port;
+        } else {
+            port = addr;
+        }
+        struct sockaddr_in sin = {.sin_family = AF_INET, .sin_port = htons((uint16_t)atoi(port))};
+        if (inet_pton(AF_INET, host, &sin.sin_addr) != 1) {
+            fprintf(stderr, "%s: bad address\n", addr);
+            return -1;
+        }
+        fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        int one = 1;
+        if (fd >= 0) {
+            setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+            setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one));
+        }
+        if (fd < 0 || bind(fd, (struct sockaddr *)&sin, sizeof(sin)) != 0) {
+            perror(addr);
+            if (fd >= 0) close(fd);
+            return -1;
+        }
+    }
+    if (listen(fd, SOMAXCONN) != 0) {
+        perror(addr);
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static int serve_ndjson(const char *addr) {
+    int lfd = serve_listen(addr);
+    if (lfd < 0) return 1;
+    int ep = epoll_create1(EPOLL_CLOEXEC);
+    struct epoll_event lev = {.events = EPOLLIN, .data.ptr = nullptr};
+    if (ep < 0 || epoll_ctl(ep, EPOLL_CTL_ADD, lfd, &lev) != 0) {
+        perror("epoll");
+        return 1;
+    }
+    signal(SIGPIPE, SIG_IGN);
+    g_quiet = true;   // errors go into responses, not stderr
+    g_no_files = true;
+    fprintf(stderr, "serving on %s\n", addr);
+
+    struct epoll_event events[SERVE_MAX_EVENTS];
+    for (;;) {
+        int n = epoll_wait(ep, events, SERVE_MAX_EVENTS, -1);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) { perror("epoll_wait"); return 1; }
+
+        for (int i = 0; i < n; ++i) {
+            Conn *c = events[i].data.ptr;
+            if (!c) {
+                // Accept everything pending on the listener
+                int cfd;
+                while ((cfd = accept4(lfd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+                    Conn *nc = calloc(1, sizeof(*nc));
+                    struct epoll_event ev = {.events = EPOLLIN, .data.ptr = nc};
+                    if (!nc || epoll_ctl(ep, EPOLL_CTL_ADD, cfd, &ev) != 0) {
+                        free(nc);
+                        close(cfd);
+                        continue;
+                    }
+                    nc->fd = cfd;
+                    ++stats.connections;
+                    ++stats.active;
+                }
+                continue;
+            }
+
+            bool keep = true;
+            if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+                // Read what is available, answer complete lines, then flush
+                for (;;) {
+                    if (!conn_reserve(&c->in, &c->in_cap, c->in_len + 4096)) { keep = false; break; }
+                    ssize_t r = read(c->fd, c->in + c->in_len, c->in_cap - c->in_len);
+                    if (r < 0 && errno == EAGAIN) break;
+                    if (r <= 0) { keep = false; break; }
+                    c->in_len += (size_t)r;
+                    if (c->in_len >= SERVE_MAX_LINE / 2) break;
+                }
+                conn_process(c);
+            }
+            if (c->dropped || !conn_flush(ep, c) || (!keep && c->out_len == 0)) {
+                conn_close(ep, c);
+            }
+        }
+    }
+}
+
+#else
+
+static int serve_ndjson(const char *addr) {
+    (void)addr;
+    fputs("--serve-ndjson requires Linux (epoll)\n", stderr);
+    return 1;
+}
+
+#endif
+
+// ============================================================================
+// Shared-memory service
+// ============================================================================
+
+// `c --serve-shm FD|PATH` serves requests from a ring of fixed-size slots in
+// shared memory: an inherited memfd (FD, e.g. created by the caller before
+// spawning the worker, which then exits with its parent) or a file such as
+// /dev/shm/termcalc (created at SHM_SLOTS slots if new). Callers on the same
+// host evaluate with no socket syscalls and no process spawn:
+//
+//   client: CAS a slot FREE -> CLAIMED, fill expr/vars, store READY,
+//           increment req_seq and FUTEX_WAKE it if worker_sleeping;
+//           spin (then set waiting and FUTEX_WAIT on state) until DONE,
+//           read result/status/error, store FREE.
+//   worker: claim READY -> BUSY, evaluate, store DONE and FUTEX_WAKE
+//           state if the client is waiting; sleeps on req_seq when idle.
+//   stop:   set shutdown, then increment req_seq and FUTEX_WAKE it like a
+//           request would; a sleeping worker does not see the flag alone.
+//
+// A nonzero handle names a compiled expression the worker keeps (see
+// Compiled expressions): send the text once with the handle, then only the
+// handle with an empty expr, and the request skips parsing.
+//
+// All shared words are 32-bit atomics so the layout is the same from any
+// language; futexes are process-shared (no FUTEX_PRIVATE_FLAG).
+
+#ifdef __linux__
+
+constexpr uint32_t SHM_SLOTS = 64;
+constexpr int SHM_EXPR = 256;
+constexpr int SHM_VARS = 8;
+constexpr int SHM_SPIN = 20000;   // polls before sleeping on a futex
+
+enum { SLOT_FREE, SLOT_CLAIMED, SLOT_READY, SLOT_BUSY, SLOT_DONE };
+
+typedef struct {
+    char magic[4];                   // "TCR2"
+    uint32_t slots;
+    _Atomic uint32_t req_seq;        // bumped by clients after publishing
+    _Atomic uint32_t worker_sleeping;
+    _Atomic uint32_t shutdown;       // set by a client to stop the worker
+    uint32_t reserved[11];           // pad to one cache line
+} ShmHeader;
+
+typedef struct {
+    _Atomic uint32_t state;          // SLOT_*
+    _Atomic uint32_t waiting;        // client is blocked in FUTEX_WAIT
+    uint32_t nvars;
+    int32_t status;                  // 0 ok, 1 error
+    uint32_t handle;                 // compiled expression to use; 0 for none
+    uint32_t reserved;
+    double result;
+    char expr[SHM_EXPR];
+    struct { char name[MAX_NAME]; double value; } vars[SHM_VARS];
+    char error[64];
+} ShmSlot;
+
+static_assert(sizeof(ShmHeader) == 64, "header is one cache line");
+
+static void futex_wait(_Atomic uint32_t *addr, uint32_t expected) {
+    syscall(SYS_futex, addr, FUTEX_WAIT, expected, nullptr, nullptr, 0);
+}
+
+static void futex_wake(_Atomic uint32_t *addr) {
+    syscall(SYS_futex, addr, FUTEX_WAKE, INT32_MAX, nullptr, nullptr, 0);
+}
+
+static void shm_eval(ShmSlot *slot) {
+    clear_vars();
+    uint32_t nvars = slot->nvars < SHM_VARS ? slot->nvars : SHM_VARS;
+    for (uint32_t v = 0; v < nvars; ++v) {
+        slot->vars[v].name[MAX_NAME - 1] = '\0';
+        set_var(slot->vars[v].name, slot->vars[v].value);
+    }
+    slot->expr[SHM_EXPR - 1] = '\0';
+
+    g_error[0] = '\0';
+    double val = slot->handle ? evaluate_handle(slot->handle, slot->expr) : evaluate(slot->expr);
+    slot->result = val;
+    slot->status = isnan(val) ? 1 : 0;
+    snprintf(slot->error, sizeof(slot->error), "%.*s",
+             (int)strcspn(g_error, "\n"), slot->status ? (g_error[0] ? g_error : "no result") : "");
+}
+
+static int serve_shm(const char *target) {
+    bool inherited = target[0] != '\0' && strspn(target, "0123456789") == strlen(target);
+    int fd = inherited ? atoi(target) : open(target, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        perror(target);
+        return 1;
+    }
+
+    size_t size = (size_t)st.st_size;
+    if (size == 0) {
+        size = sizeof(ShmHeader) + SHM_SLOTS * sizeof(ShmSlot);
+        if (ftruncate(fd, (off_t)size) != 0) { perror(target); return 1; }
+    }
+    void *map = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) { perror(target); return 1; }
+
+    ShmHeader *hdr = map;
+    ShmSlot *slots = (ShmSlot *)(hdr + 1);
+    if (hdr->magic[0] == '\0') {
+        memcpy(hdr->magic, "TCR2", 4);
+        hdr->slots = (uint32_t)((size - sizeof(ShmHeader)) / sizeof(ShmSlot));
+    }
+    if (memcmp(hdr->magic, "TCR2", 4) != 0 ||
+        hdr->slots > (size - sizeof(ShmHeader)) / sizeof(ShmSlot)) {
+        fprintf(stderr, "%s: not a termcalc ring\n", target);
+        return 1;
+    }
+
+    // A worker fed through an inherited memfd belongs to its caller
+    if (inherited) prctl(PR_SET_PDEATHSIG, SIGTERM);
+    g_quiet = true;
+
+    // Spinning only helps when the client runs on another core
+    int spin = sysconf(_SC_NPROCESSORS_ONLN) > 1 ? SHM_SPIN : 0;
+    int idle = 0;
+    while (!atomic_load(&hdr->shutdown)) {
+        uint32_t seq = atomic_load(&hdr->req_seq);
+        bool served = false;
+        for (uint32_t i = 0; i < hdr->slots; ++i) {
+            ShmSlot *slot = &slots[i];
+            uint32_t expected = SLOT_READY;
+            if (!atomic_compare_exchange_strong(&slot->state, &expected, SLOT_BUSY)) continue;
+
+            shm_eval(slot);
+            atomic_store(&slot->state, SLOT_DONE);
+            if (atomic_load(&slot->waiting)) futex_wake(&slot->state);
+            served = true;
+        }
+
+        if (served) {
+            idle = 0;
+        } else if (++idle > spin) {
+            // Either we see the new sequence number or the client sees us
+            // sleeping
+            atomic_store(&hdr->worker_sleeping, 1);
+            if (atomic_load(&hdr->req_seq) == seq) futex_wait(&hdr->req_seq, seq);
+            atomic_store(&hdr->worker_sleeping, 0);
+            idle = 0;
+        }
+    }
+    return 0;
+}
+
+#else
+
+static int serve_shm(const char *target) {
+    (void)target;
+    fputs("--serve-shm requires Linux (futex)\n", stderr);
+    return 1;
+}
+
+#endif
+
+// ============================================================================
+// Monte Carlo
+// ============================================================================
+
+// c --mc N [--seed S] EXPR [NAME=DIST ...] evaluates EXPR for N random
+// samples and prints the mean, standard deviation and quantiles. DIST is
+// uniform(a, b), normal(mu, sigma), lognormal(mu, sigma) (parameters of the
+// underlying normal) or poisson(lambda). NAME=DIST gives NAME one draw per
+// sample; a DIST call written inside EXPR draws on its own. NAME=expr sets a
+// plain variable.
+//
+// Samples come in fixed blocks, each with its own xoshiro256++ generators
+// seeded from (seed, block) and stepped as MC_LANES interleaved streams, so
+// results depend on the seed but not on the number of threads. Blocks are
+// spread over threads and their sums merged in block order. Quantiles take
+// a second pass over the same samples: the first histograms the top 16 bits
+// of an order-preserving key of each value, the second the next 16 bits
+// within the bins that hold the quantiles, which fixes them to about 6
+// significant digits without storing the samples.
+
+constexpr int MC_LANES = 8;
+constexpr uint64_t MC_BLOCK = 1 << 16;       // samples per block
+constexpr int MC_THREADS = 64;
+constexpr int MC_HIST = 1 << 16;
+constexpr int MC_NQ = 7;
+static const double mc_q[MC_NQ] = {0.01, 0.05, 0.25, 0.5, 0.75, 0.95, 0.99};
+static const char *const mc_q_name[MC_NQ] = {"p1", "p5", "p25", "p50", "p75", "p95", "p99"};
+
+typedef enum { DIST_UNIFORM, DIST_NORMAL, DIST_LOGNORMAL, DIST_POISSON } DistKind;
+
+static const struct { const char *name; int nargs; } mc_dists[] = {
+    [DIST_UNIFORM] = {"uniform", 2},
+    [DIST_NORMAL] = {"normal", 2},
+    [DIST_LOGNORMAL] = {"lognormal", 2},
+    [DIST_POISSON] = {"poisson", 1},
+};
+
+typedef struct {
+    DistKind kind;
+    double a, b;
+} Dist;
+
+typedef struct {
+    uint64_t s[4][MC_LANES];
+    uint64_t buf[MC_LANES];    // for draws taken one at a time
+    int used;
+} McRng;
+
+typedef struct {
+    uint64_t n, nan;
+    double mean, m2, min, max;
+} McMoments;
+
+typedef struct {
+    VarFn fn;
+    Dist dists[VARFN_MAX_COLS];
+    int ncols;
+    uint64_t samples, seed, nblocks;
+    McMoments *blocks;         // pass 0 results, one per block
+    int pass;                  // 0: moments and coarse histogram, 1: refine
+    uint16_t target[MC_NQ];    // pass 1: coarse bin of each quantile
+    int8_t slot[MC_HIST];      // pass 1: fine histogram of each coarse bin, or -1
+} McRun;
+
+typedef struct {
+    McRun *run;
+    uint64_t first, stride;
+    uint64_t *hist;            // pass 0: MC_HIST bins, pass 1: MC_NQ * MC_HIST
+} McJob;
+
+static uint64_t splitmix64(uint64_t *x) {
+    uint64_t z = (*x += 0x9E3779B97F4A7C15ULL);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return z ^ (z >> 31);
+}
+
+static void mc_rng_seed(McRng *r, uint64_t seed, uint64_t block) {
+    uint64_t x = seed ^ (block * 0xD1B54A32D192ED03ULL);
+    for (int l = 0; l < MC_LANES; ++l) {
+        for (int w = 0; w < 4; ++w) r->s[w][l] = splitmix64(&x);
+    }
+    r->used = MC_LANES;
+}
+
+// One xoshiro256++ step of every lane
+static void mc_rng_step(McRng *r, uint64_t *out) {
+    for (int l = 0; l < MC_LANES; ++l) {
+        uint64_t s0 = r->s[0][l], s1 = r->s[1][l], s2 = r->s[2][l], s3 = r->s[3][l];
+        uint64_t sum = s0 + s3;
+        out[l] = ((sum << 23) | (sum >> 41)) + s0;
+        uint64_t t = s1 << 17;
+        s2 ^= s0;
+        s3 ^= s1;
+        s1 ^= s2;
+        s0 ^= s3;
+        s2 ^= t;
+        s3 = (s3 << 45) | (s3 >> 19);
+        r->s[0][l] = s0;
+        r->s[1][l] = s1;
+        r->s[2][l] = s2;
+        r->s[3][l] = s3;
+    }
+}
+
+// Uniform doubles in (0, 1); n is a multiple of MC_LANES
+HOT_LOOP
+static void mc_uniform(McRng *r, double *u, int n) {
+    for (int j = 0; j < n; j += MC_LANES) {
+        uint64_t v[MC_LANES];
+        mc_rng_step(r, v);
+        for (int l = 0; l < MC_LANES; ++l) u[j + l] = ((double)(v[l] >> 11) + 0.5) * 0x1p-53;
+    }
+}
+
+static double mc_uniform1(McRng *r) {
+    if (r->used == MC_LANES) {
+        mc_rng_step(r, r->buf);
+        r->used = 0;
+    }
+    return ((double)(r->buf[r->used++] >> 11) + 0.5) * 0x1p-53;
+}
+
+// Poisson by Hormann's transformed rejection (PTRS), for large means
+static double mc_poisson(McRng *r, double lambda) {
+    double slam = sqrt(lambda), loglam = log(lambda);
+    double b = 0.931 + 2.53 * slam, a = -0.059 + 0.02483 * b;
+    double inv_alpha = 1.1239 + 1.1328 / (b - 3.4), vr = 0.9277 - 3.6224 / (b - 2);
+    for (;;) {
+        double u = mc_uniform1(r) - 0.5, v = mc_uniform1(r), us = 0.5 - fabs(u);
+        double k = floor((2 * a / us + b) * u + lambda + 0.43);
+        if (us >= 0.07 && v <= vr) return k;
+        if (k < 0 || (us < 0.013 && v > us)) continue;
+        int sign;
+        if (log(v) + log(inv_alpha) - log(a / (us * us) + b) <= -lambda + k * loglam - lgamma_r(k + 1, &sign)) {
+            return k;
+        }
+    }
+}
+
+// VARFN_BATCH draws
+static void mc_draw(const Dist *d, McRng *r, double *out) {
+    switch (d->kind) {
+        case DIST_UNIFORM:
+            mc_uniform(r, out, VARFN_BATCH);
+            for (int i = 0; i < VARFN_BATCH; ++i) out[i] = d->a + (d->b - d->a) * out[i];
+            return;
+        case DIST_NORMAL:
+        case DIST_LOGNORMAL: {
+            double u[VARFN_BATCH];
+            mc_uniform(r, u, VARFN_BATCH);
+            for (int i = 0; i < VARFN_BATCH; i += 2) {    // Box-Muller
+                double rad = d->b * sqrt(-2 * log(u[i])), th = 2 * PI * u[i + 1];
+                out[i] = d->a + rad * cos(th);
+                out[i + 1] = d->a + rad * sin(th);
+            }
+            if (d->kind == DIST_LOGNORMAL) {
+                for (int i = 0; i < VARFN_BATCH; ++i) out[i] = exp(out[i]);
+            }
+            return;
+        }
+        case DIST_POISSON:
+            if (d->a >= 10) {
+                for (int i = 0; i < VARFN_BATCH; ++i) out[i] = mc_poisson(r, d->a);
+                return;
+            }
+            // Small means: invert the CDF, one uniform per draw
+            mc_uniform(r, out, VARFN_BATCH);
+            double p0 = exp(-d->a);
+            for (int i = 0; i < VARFN_BATCH; ++i) {
+                double p = p0, cdf = p0;
+                int k = 0;
+                while (out[i] > cdf && k < 200) {
+                    p *= d->a / ++k;
+                    cdf += p;
+                }
+                out[i] = k;
+            }
+            return;
+    }
+}
+
+static int mc_dist_kind(const Expr *e, int n) {
+    const Node *nd = &e->nodes[n];
+    if (nd->kind != N_CALL) return -1;
+    for (int k = 0; k < (int)(sizeof(mc_dists) / sizeof(mc_dists[0])); ++k) {
+        if (strcmp(e->names + nd->name, mc_dists[k].name) == 0) return k;
+    }
+    return -1;
+}
+
+// A distribution call, with its parameters evaluated once
+static bool mc_dist(const Expr *e, int n, Dist *d) {
+    const Node *nd = &e->nodes[n];
+    int kind = mc_dist_kind(e, n);
+    const char *name = mc_dists[kind].name;
+    if (nd->nargs != mc_dists[kind].nargs) {
+        eval_error("%s: expects %d argument%s\n", name, mc_dists[kind].nargs,
+                   mc_dists[kind].nargs == 1 ? "" : "s");
+        return false;
+    }
+    double a = eval_node(e, nd->args[0]), b = nd->nargs > 1 ? eval_node(e, nd->args[1]) : 0;
+    if (isnan(a) || isnan(b)) return false;
+    bool ok = kind == DIST_UNIFORM ? a <= b : kind == DIST_POISSON ? a >= 0 && a < 1e15 : b >= 0;
+    if (!ok || isinf(a) || isinf(b)) {
+        eval_error("%s: invalid parameters\n", name);
+        return false;
+    }
+    *d = (Dist){.kind = (DistKind)kind, .a = a, .b = b};
+    return true;
+}
+
+// Distribution calls inside the expression become columns of their own
+static bool mc_mark(McRun *run, const Expr *e, int n) {
+    const Node *nd = &e->nodes[n];
+    if (mc_dist_kind(e, n) >= 0) {
+        if (run->ncols == VARFN_MAX_COLS) {
+            eval_error("--mc: too many random variables\n");
+            return false;
+        }
+        if (!mc_dist(e, n, &run->dists[run->ncols])) return false;
+        run->fn.nodes[n].col = run->ncols++;
+        return true;
+    }
+    for (int i = 0; i < nd->nargs; ++i) {
+        if (!mc_mark(run, e, nd->args[i])) return false;
+    }
+    return true;
+}
+
+// Order-preserving integer key of a double, and back
+static uint64_t mc_key(double v) {
+    uint64_t u;
+    memcpy(&u, &v, sizeof(u));
+    return u >> 63 ? ~u : u | 1ULL << 63;
+}
+
+static double mc_unkey(uint64_t k) {
+    uint64_t u = k >> 63 ? k & ~(1ULL << 63) : ~k;
+    double v;
+    memcpy(&v, &u, sizeof(v));
+    return v;
+}
+
+static void mc_merge(McMoments *m, const McMoments *b) {
+    uint64_t n = m->n + b->n;
+    if (b->n) {
+        double delta = b->mean - m->mean;
+        m->mean += delta * (double)b->n / (double)n;
+        m->m2 += b->m2 + delta * delta * (double)m->n * (double)b->n / (double)n;
+    }
+    m->n = n;
+    m->nan += b->nan;
+    m->min = fmin(m->min, b->min);
+    m->max = fmax(m->max, b->max);
+}
+
+static void mc_accumulate(McMoments *m, uint64_t *hist, const double *y, int count) {
+    McMoments batch = {.min = INFINITY, .max = -INFINITY};
+    double sum = 0;
+    for (int i = 0; i < count; ++i) {
+        if (isnan(y[i])) continue;
+        sum += y[i];
+        ++batch.n;
+        batch.min = fmin(batch.min, y[i]);
+        batch.max = fmax(batch.max, y[i]);
+        ++hist[mc_key(y[i]) >> 48];
+    }
+    batch.nan = (uint64_t)count - batch.n;
+    if (batch.n) {
+        batch.mean = sum / (double)batch.n;
+        for (int i = 0; i < count; ++i) {
+            if (!isnan(y[i])) batch.m2 += (y[i] - batch.mean) * (y[i] - batch.mean);
+        }
+    }
+    mc_merge(m, &batch);
+}
+
+static void mc_refine(const McRun *run, uint64_t *hist, const double *y, int count) {
+    for (int i = 0; i < count; ++i) {
+        if (isnan(y[i])) continue;
+        uint64_t k = mc_key(y[i]);
+        int slot = run->slot[k >> 48];
+        if (slot >= 0) ++hist[slot * MC_HIST + ((k >> 32) & 0xFFFF)];
+    }
+}
+
+static void *mc_worker(void *arg) {
+    McJob *job = arg;
+    McRun *run = job->run;
+    double cols[VARFN_MAX_COLS][VARFN_BATCH], y[VARFN_BATCH];
+    const double *colp[VARFN_MAX_COLS];
+    for (int c = 0; c < run->ncols; ++c) colp[c] = cols[c];
+
+    for (uint64_t blk = job->first; blk < run->nblocks && !g_interrupted; blk += job->stride) {
+        McRng rng;
+        mc_rng_seed(&rng, run->seed, blk);
+        uint64_t start = blk * MC_BLOCK;
+        uint64_t end = run->samples - start < MC_BLOCK ? run->samples : start + MC_BLOCK;
+        McMoments m = {.min = INFINITY, .max = -INFINITY};
+        for (uint64_t i = start; i < end; i += VARFN_BATCH) {
+            int count = end - i < VARFN_BATCH ? (int)(end - i) : VARFN_BATCH;
+            for (int c = 0; c < run->ncols; ++c) mc_draw(&run->dists[c], &rng, cols[c]);
+            varfn_batch(&run->fn, run->fn.root, count, colp, y);
+            if (run->pass == 0) {
+                mc_accumulate(&m, job->hist, y, count);
+            } else {
+                mc_refine(run, job->hist, y, count);
+            }
+        }
+        if (run->pass == 0) run->blocks[blk] = m;
+        progress_set(run->pass * run->nblocks + blk, 2 * run->nblocks);
+    }
+    return nullptr;
+}
+
+// One pass over all samples; hist receives the summed histograms
+static bool mc_pass(McRun *run, int pass, uint64_t *hist) {
+    size_t bins = pass == 0 ? MC_HIST : (size_t)MC_NQ * MC_HIST;
+    // Blocks are seeded by index, so one thread gives the same results
+    long cpus = run->fn.serial ? 1 : sysconf(_SC_NPROCESSORS_ONLN);
+    uint64_t nthreads = cpus < 1 ? 1 : cpus > MC_THREADS ? MC_THREADS : (uint64_t)cpus;
+    if (nthreads > run->nblocks) nthreads = run->nblocks;
+    run->pass = pass;
+
+    McJob jobs[MC_THREADS];
+    pthread_t tids[MC_THREADS];
+    bool started[MC_THREADS] = {}, ok = true;
+    for (uint64_t t = 0; t < nthreads; ++t) {
+        jobs[t] = (McJob){.run = run, .first = t, .stride = nthreads, .hist = calloc(bins, sizeof(uint64_t))};
+        if (!jobs[t].hist) ok = false;
+    }
+    if (ok) {
+        for (uint64_t t = 1; t < nthreads; ++t) {
+            started[t] = pthread_create(&tids[t], nullptr, mc_worker, &jobs[t]) == 0;
+            if (!started[t]) mc_worker(&jobs[t]);
+        }
+        mc_worker(&jobs[0]);
+        for (uint64_t t = 1; t < nthreads; ++t) {
+            if (started[t]) pthread_join(tids[t], nullptr);
+        }
+    }
+    memset(hist, 0, bins * sizeof(uint64_t));
+    for (uint64_t t = 0; t < nthreads; ++t) {
+        for (size_t i = 0; ok && i < bins; ++i) hist[i] += jobs[t].hist[i];
+        free(jobs[t].hist);
+    }
+    if (!ok) fprintf(stderr, "--mc: out of memory\n");
+    return ok && !g_interrupted;
+}
+
+// Bin holding the value of the given rank, and the rank within that bin
+static int mc_find_bin(const uint64_t *hist, uint64_t rank, uint64_t *rest) {
+    for (int b = 0; b < MC_HIST; ++b) {
+        if (rank < hist[b]) {
+            *rest = rank;
+            return b;
+        }
+        rank -= hist[b];
+    }
+    *rest = 0;
+    return MC_HIST - 1;
+}
+
+static bool mc_setup(McRun *run, Expr *e, int argc, char **argv) {
+    static char names[VARFN_MAX_COLS][MAX_NAME];
+
+    // NAME=DIST and NAME=expr arguments
+    for (int i = 1; i < argc; ++i) {
+        const char *eq = strchr(argv[i], '=');
+        size_t len = eq ? (size_t)(eq - argv[i]) : 0;
+        bool valid = len > 0 && len < MAX_NAME && (isalpha((unsigned char)argv[i][0]) || argv[i][0] == '_');
+        for (size_t c = 0; valid && c < len; ++c) valid = isalnum((unsigned char)argv[i][c]) || argv[i][c] == '_';
+        if (!valid) {
+            fprintf(stderr, "--mc: expected NAME=DIST or NAME=expr, got '%s'\n", argv[i]);
+            return false;
+        }
+        char name[MAX_NAME];
+        memcpy(name, argv[i], len);
+        name[len] = '\0';
+
+        Parser p = {.src = eq + 1, .pos = eq + 1};
+        next_token(&p);
+        int root = compile(e, &p);
+        if (mc_dist_kind(e, root) >= 0) {
+            if (run->ncols == VARFN_MAX_COLS) {
+                fprintf(stderr, "--mc: too many random variables\n");
+                return false;
+            }
+            if (!mc_dist(e, root, &run->dists[run->ncols])) return false;
+            strcpy(names[run->ncols++], name);
+        } else {
+            double val = eval_node(e, root);
+            if (isnan(val)) return false;
+            set_var(name, val);
+        }
+    }
+
+    Parser p = {.src = argv[0], .pos = argv[0]};
+    g_error[0] = '\0';
+    next_token(&p);
+    int root = compile(e, &p);
+    if (g_error[0] || !varfn_init(&run->fn, e, root)) return false;
+    run->fn.nvars = run->ncols;
+    for (int c = 0; c < run->ncols; ++c) run->fn.vars[c] = names[c];
+    if (!mc_mark(run, e, root) || !varfn_prepare(&run->fn, root)) return false;
+
+    // One sample first, so errors in the expression are reported once
+    double cols[VARFN_MAX_COLS][VARFN_BATCH], y;
+    const double *colp[VARFN_MAX_COLS];
+    McRng rng;
+    mc_rng_seed(&rng, run->seed, 0);
+    for (int c = 0; c < run->ncols; ++c) {
+        mc_draw(&run->dists[c], &rng, cols[c]);
+        colp[c] = cols[c];
+    }
+    varfn_batch(&run->fn, root, 1, colp, &y);
+    return !g_error[0];
+}
+
+static int monte_carlo(const char *count, uint64_t seed, int argc, char **argv) {
+    char *end;
+    double n = strtod(count, &end);
+    if (*end || !(n >= 1 && n <= 9007199254740992.0)) {
+        fprintf(stderr, "--mc: invalid sample count '%s'\n", count);
+        return 1;
+    }
+    if (argc < 1) {
+        fprintf(stderr, "usage: c --mc N [--seed S] EXPR [NAME=DIST ...]\n");
+        return 1;
+    }
+
+    McRun *run = calloc(1, sizeof *run);
+    Expr *e = malloc(sizeof *e);
+    int status = 1;
+    if (!run || !e) {
+        fprintf(stderr, "--mc: out of memory\n");
+        goto done;
+    }
+    run->samples = (uint64_t)n;
+    run->seed = seed;
+    run->nblocks = (run->samples + MC_BLOCK - 1) / MC_BLOCK;
+    if (!mc_setup(run, e, argc, argv)) goto done;
+
+    run->blocks = malloc(run->nblocks * sizeof *run->blocks);
+    uint64_t *hist = malloc((size_t)MC_NQ * MC_HIST * sizeof *hist);
+    bool quiet = g_quiet;
+    g_quiet = true;
+    progress_begin("--mc");
+    bool ok = run->blocks && hist && mc_pass(run, 0, hist);
+
+    // Moments in block order; coarse bins of the quantiles
+    McMoments all = {.min = INFINITY, .max = -INFINITY};
+    uint64_t rest[MC_NQ];
+    for (uint64_t b = 0; ok && b < run->nblocks; ++b) mc_merge(&all, &run->blocks[b]);
+    ok = ok && all.n > 0;
+    memset(run->slot, -1, sizeof(run->slot));
+    for (int q = 0, nslots = 0; ok && q < MC_NQ; ++q) {
+        run->target[q] = (uint16_t)mc_find_bin(hist, (uint64_t)(mc_q[q] * (double)(all.n - 1)), &rest[q]);
+        if (run->slot[run->target[q]] < 0) run->slot[run->target[q]] = (int8_t)nslots++;
     }
+    ok = ok && mc_pass(run, 1, hist);
+    progress_end();
+    g_quiet = quiet;
 
-    // Save history
-    if (hist_path) write_history(hist_path);
+    if (ok) {
+        printf("samples  %" PRIu64 "  (seed %" PRIu64 ")\n", run->samples, seed);
+        double var = all.n > 1 ? all.m2 / (double)(all.n - 1) : 0;
+        printf("mean     %.10g  +- %.2g\n", all.mean, sqrt(var / (double)all.n));
+        printf("stddev   %.10g\n", sqrt(var));
+        printf("min      %.10g\n", all.min);
+        for (int q = 0; q < MC_NQ; ++q) {
+            uint64_t r;
+            int low = mc_find_bin(hist + (size_t)run->slot[run->target[q]] * MC_HIST, rest[q], &r);
+
+            // The end of the fine bin nearest zero, exact for integer samples
+            uint64_t key = (uint64_t)run->target[q] << 48 | (uint64_t)low << 32;
+            double v = mc_unkey(key >> 63 ? key : key | 0xFFFFFFFFu);
+            printf("%-8s %.6g\n", mc_q_name[q], fmin(fmax(v, all.min), all.max));
+        }
+        printf("max      %.10g\n", all.max);
+        if (all.nan) printf("undefined  %" PRIu64 " samples\n", all.nan);
+        status = 0;
+    } else if (!g_interrupted && run->blocks && hist && all.n == 0) {
+        fprintf(stderr, "--mc: the expression is undefined for every sample\n");
+    }
+    free(hist);
+    free(run->blocks);
+done:
+    if (run) free(run->fn.nodes);
+    free(run);
+    free(e);
+    return status;
 }
 
 // ============================================================================
@@ -637,8 +9016,57 @@ static void repl(void) {
 // ============================================================================
 
 int main(int argc, char *argv[]) {
+    bits_init();
+    hash_init();
+
+    // --build-lib SRC -o DST: compile a constant library and exit
+    if (argc == 5 && strcmp(argv[1], "--build-lib") == 0 && strcmp(argv[3], "-o") == 0) {
+        return build_lib(argv[2], argv[4]);
+    }
+
+    // Options before the expression:
+    //   --lib FILE      load a compiled constant library (repeatable)
+    //   --session FILE  restore variables first, save them back at the end
+    //   --precision dd|qd  print results to ~32 or ~64 digits (see above)
+    //   --serve-ndjson ADDR  run the JSON-lines service (see above)
+    //   --serve-shm FD|PATH  run the shared-memory ring worker (see above)
+    //   --mc N, --seed S  Monte Carlo over N samples (see above)
+    const char *lib_path = get_lib_path();
+    if (lib_path) lib_load(lib_path, false);
+
+    const char *session = nullptr, *mc_samples = nullptr;
+    uint64_t mc_seed = 0;
+    while (argc >= 3) {
+        if (strcmp(argv[1], "--lib") == 0) {
+            if (!lib_load(argv[2], true)) return 1;
+        } else if (strcmp(argv[1], "--session") == 0) {
+            session = argv[2];
+        } else if (strcmp(argv[1], "--precision") == 0) {
+            g_xp_len = strcmp(argv[2], "dd") == 0 ? 2 : strcmp(argv[2], "qd") == 0 ? 4 : 0;
+            if (!g_xp_len) {
+                fprintf(stderr, "--precision: expected dd or qd, got '%s'\n", argv[2]);
+                return 1;
+            }
+        } else if (strcmp(argv[1], "--serve-ndjson") == 0) {
+            return serve_ndjson(argv[2]);
+        } else if (strcmp(argv[1], "--serve-shm") == 0) {
+            return serve_shm(argv[2]);
+        } else if (strcmp(argv[1], "--mc") == 0) {
+            mc_samples = argv[2];
+        } else if (strcmp(argv[1], "--seed") == 0) {
+            mc_seed = strtoull(argv[2], nullptr, 0);
+        } else {
+            break;
+        }
+        argc -= 2;
+        argv += 2;
+    }
+    if (session && !session_load(session, false)) return 1;
+    if (mc_samples) return monte_carlo(mc_samples, mc_seed, argc - 1, argv + 1);
+
     if (argc == 1) {
         repl();
+        if (session) session_save(session);
         return 0;
     }
 
@@ -649,8 +9077,11 @@ int main(int argc, char *argv[]) {
         strcat(expr, argv[i]);
     }
 
-    double result = evaluate(expr);
-    print_result(result);
+    progress_begin("working");
+    double val = evaluate(expr);
+    progress_end();
+    bool printed = print_result(val);
+    if (session) session_save(session);
 
-    return isnan(result) ? 1 : 0;
+    return printed ? 0 : 1;
 }
@@ -0,0 +1,203 @@
+#!/bin/sh
+# Regression tests, run by ctest (see CMakeLists.txt).
+#
+#   regress.sh BIN
+#       Check one-shot results and exit codes, and REPL sessions piped
+#       through stdin, against known answers.
+set -u
+
+bin=$1
+work=$(mktemp -d)
+trap 'rm -rf "$work"' EXIT
+
+# Keep the user's history, sessions and constant libraries out of it
+export HOME="$work"
+failed=0
+
+fail() {
+    printf 'FAIL: %s\n  expected: %s\n  got:      %s\n' "$1" "$2" "$3" >&2
+    failed=$((failed + 1))
+}
+
+# expect EXPR OUTPUT [ARGS...]: one-shot result, exit code 0
+expect() {
+    expr=$1 want=$2
+    shift 2
+    got=$("$bin" "$@" "$expr" 2>/dev/null)
+    rc=$?
+    [ "$got" = "$want" ] || fail "$expr" "$want" "$got"
+    [ "$rc" -eq 0 ] || fail "$expr (exit code)" 0 "$rc"
+}
+
+# expect_fail EXPR [ARGS...]: prints no result and exits 1
+expect_fail() {
+    expr=$1
+    shift
+    got=$("$bin" "$@" "$expr" 2>/dev/null)
+    rc=$?
+    [ -z "$got" ] && [ "$rc" -eq 1 ] || fail "$expr" "no result, exit 1" "'$got', exit $rc"
+}
+
+# expect_stderr EXPR MESSAGE [ARGS...]: exits 1 with exactly MESSAGE on stderr
+expect_stderr() {
+    expr=$1 want=$2
+    shift 2
+    got=$("$bin" "$@" "$expr" 2>&1 >/dev/null)
+    rc=$?
+    [ "$got" = "$want" ] && [ "$rc" -eq 1 ] || fail "$expr (stderr)" "'$want', exit 1" "'$got', exit $rc"
+}
+
+# expect_repl INPUT OUTPUT: last line printed for a piped session
+expect_repl() {
+    got=$(printf '%s\n' "$1" | "$bin" 2>/dev/null | tail -n 1)
+    [ "$got" = "$2" ] || fail "$(printf '%s' "$1" | tr '\n' ';')" "$2" "$got"
+}
+
+# --- exact integers ----------------------------------------------------------
+
+expect '9007199254740993 - 9007199254740992' 1
+expect '0x20000000000001 - 0x20000000000000' 1
+expect '1004104503974078835 % 10536113516190163' 3173719936013350
+expect 'factorial(200)/factorial(198)' 39800
+expect 'gcd(factorial(200), 2^300)' 200867255532373784442745261542645325315275374222849104412672
+expect '2^64 + 1' 18446744073709551617
+# 634 sevens mod 10^300 leaves the last 300 sevens
+sevens() { printf '7%.0s' $(seq "$1"); }
+expect "$(sevens 634) % 1$(printf '0%.0s' $(seq 300))" "$(sevens 300)"
+expect_fail 'undefined_name + 1'
+expect_repl 'x = 3^50
+x - 3^50' 0
+expect_repl '2^64+1
+ans - 2^64' 1
+expect_repl 'x = 3^50
+y := x * 3
+y - 3^51' 0
+
+# --- error messages ----------------------------------------------------------
+
+# each error is reported once, even when the exact pass redoes the call
+expect_stderr 'modinv(2, 10)' 'modinv: 2 has no inverse mod 10'
+expect_stderr 'nthprime(0)' 'nthprime: argument out of range'
+expect_stderr 'isprime(2^70)' 'isprime: expects a non-negative integer below 2^64'
+got=$(printf 'modpow(2, 3, 0)\n' | "$bin" 2>&1 >/dev/null)
+[ "$got" = 'modpow: modulus must be positive' ] || fail 'modpow(2, 3, 0) (REPL stderr)' 'modpow: modulus must be positive' "$got"
+
+# --- variables and bindings --------------------------------------------------
+
+# bindings track reads past the first 64 variables
+expect_repl "$(seq 0 299 | sed 's/.*/v& = &/')
+b := v299 * 2 + v3
+v299 = 1000
+b" 2003
+
+# sessions keep exact integers, matrices and extended-precision tails
+printf 'x = 3^50\nm = [1,2;3,4]\nz = 1/3\n' | "$bin" --precision dd --session "$work/s" > /dev/null 2>&1
+expect 'x - 3^50' 0 --session "$work/s"
+expect 'm * 2' '[2, 4;
+ 6, 8]' --session "$work/s"
+expect 'z' 0.3333333333333333333333333333333 --precision dd --session "$work/s"
+head -c 40 "$work/s" > "$work/bad"
+expect_fail '1 + 1' --session "$work/bad"
+
+# --- bit operations above 2^53 -----------------------------------------------
+
+expect 'popcount(0xFFFFFFFFFFFFFFFF)' 64
+expect 'popcount(2^63+1)' 2
+expect 'clz(2^64-1)' 0
+expect 'ctz(2^63+2)' 1
+expect 'clz(0)' 64
+expect 'ctz(2^60)' 60
+expect_fail 'popcount(2^64)'
+
+# --- extended precision ------------------------------------------------------
+
+expect 'pi' 3.1415926535897932384626433832795028841971693993751058209749446 --precision qd
+expect 'atan(1e20)' 1.5707963267948966192213216916397514420985846996875529104874726 --precision qd
+expect 'asin(1)' 1.5707963267948966192313216916397514420985846996875529104874723 --precision qd
+expect 'acos(-1)' 3.141592653589793238462643383279 --precision dd
+expect 'atan2(1, 0)' 1.57079632679489661923132169164 --precision dd
+expect 'log(10)' 2.3025850929940456840179914546843642076011014886287729760333279 --precision qd
+expect 'log(1 + 2^-90)' 8.077935669463160887416100505233e-28 --precision dd
+expect '1e-25 - 5e-51' 9.9999999999999999999999995e-26 --precision dd
+expect '2^-1074' 4.94065645841e-324 --precision qd
+expect 'exp(-745)' 4.94065645841e-324 --precision dd
+
+# --- Monte Carlo -------------------------------------------------------------
+
+# a seed fixes the output (several blocks, so any thread count); an
+# expression using shared state runs on one thread with the same promise
+got=$("$bin" --mc 2e5 --seed 42 'x * y' x='uniform(0, 1)' y='normal(10, 2)' 2>/dev/null)
+want='samples  200000  (seed 42)
+mean     5.001563546  +- 0.0069
+stddev   3.105376147
+min      3.499966893e-05
+p1       0.0965663
+p5       0.475313
+p25      2.39553
+p50      4.7979
+p75      7.3032
+p95      10.3521
+p99      12.1796
+max      16.95341114'
+[ "$got" = "$want" ] || fail '--mc x * y' "$want" "$got"
+got=$("$bin" --mc 2e5 --seed 42 'modpow(floor(n), 3, 1000003) / 1000003' n='uniform(1, 1e6)' 2>/dev/null)
+want='samples  200000  (seed 42)
+mean     0.4995759046  +- 0.00065
+stddev   0.2894008553
+min      9.99997e-07
+p1       0.010068
+p5       0.0492298
+p25      0.24786
+p50      0.499636
+p75      0.751266
+p95      0.949752
+p99      0.989442
+max      0.999997'
+[ "$got" = "$want" ] || fail '--mc modpow' "$want" "$got"
+
+# --- sessions ----------------------------------------------------------------
+
+# :save keeps bindings, exact integers and matrices; --session restores them
+printf 'x = 3^50\nb := x + 1\nm = [1, 2; 3, 4]\n:save %s\n' "$work/s.tcs" | "$bin" >/dev/null 2>&1
+expect 'x' 717897987691852588770249 --session "$work/s.tcs"
+expect 'b - 3^50' 1 --session "$work/s.tcs"
+expect 'det(m)' -2 --session "$work/s.tcs"
+# --session saves back at the end, and the binding follows the new x
+printf 'x = 5\n' | "$bin" --session "$work/s.tcs" >/dev/null 2>&1
+expect 'b' 6 --session "$work/s.tcs"
+# a truncated snapshot is rejected as a whole
+head -c 100 "$work/s.tcs" > "$work/short.tcs"
+expect_fail '1' --session "$work/short.tcs"
+expect_repl "y = 7
+:load $work/short.tcs
+y" 7
+
+# --- constant libraries ------------------------------------------------------
+
+printf 'g0 = 9.80665\nau = 149597870700\n' > "$work/consts.txt"
+"$bin" --build-lib "$work/consts.txt" -o "$work/consts.tcl" >/dev/null 2>&1
+expect 'au / 1e9' 149.5978707 --lib "$work/consts.tcl"
+# a slot name without its terminating NUL makes the library invalid
+size=$(wc -c < "$work/consts.tcl")
+head -c $((size - 40)) "$work/consts.tcl" > "$work/bad.tcl"
+printf 'A%.0s' $(seq 40) >> "$work/bad.tcl"
+expect_fail 'g0' --lib "$work/bad.tcl"
+# a bad default library is skipped, not fatal
+cp "$work/bad.tcl" "$HOME/.c_consts.tcl"
+expect '1 + 2' 3
+cp "$work/consts.tcl" "$HOME/.c_consts.tcl"
+expect 'g0' 9.80665
+rm -f "$HOME/.c_consts.tcl"
+
+# --- history -----------------------------------------------------------------
+
+# compaction keeps the newest half of C_HISTORY_SIZE and the newest entries
+seq 3000 | sed 's/$/ + 0.5/' > "$HOME/.c_history"
+printf '1+1\n' | C_HISTORY_SIZE=10k "$bin" >/dev/null 2>&1
+size=$(wc -c < "$HOME/.c_history")
+[ "$size" -le 5120 ] && [ "$size" -gt 4096 ] || fail "history compaction" "4097..5120 bytes" "$size"
+[ "$(tail -n 1 "$HOME/.c_history")" = '1+1' ] || fail "history compaction" '1+1' "$(tail -n 1 "$HOME/.c_history")"
+[ ! -e "$HOME/.c_history.tmp" ] || fail "history compaction" "no temp file" "$(ls -A "$HOME")"
+rm -f "$HOME/.c_history"
+
+[ "$failed" -eq 0 ] && echo "all tests passed" || { echo "$failed failed" >&2; exit 1; }
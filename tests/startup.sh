@@ -0,0 +1,42 @@
+#!/bin/sh
+# Startup benchmark (not run by ctest).
+#
+#   startup.sh [-n RUNS] BIN...
+#       Run `BIN 1+1` RUNS times in a row (default 2000) for each binary and
+#       print the average wall time per run, best of three rounds.
+set -eu
+
+runs=2000
+if [ "${1:-}" = -n ]; then
+    runs=$2
+    shift 2
+fi
+if [ $# -eq 0 ]; then
+    echo "usage: $0 [-n RUNS] BIN..." >&2
+    exit 2
+fi
+
+work=$(mktemp -d)
+trap 'rm -rf "$work"' EXIT
+# Keep the user's history and constant libraries out of it
+export HOME="$work"
+
+now_ns() {
+    date +%s%N
+}
+
+for bin in "$@"; do
+    "$bin" 1+1 > /dev/null      # warm the page cache
+    best=''
+    for round in 1 2 3; do
+        t0=$(now_ns)
+        i=0
+        while [ "$i" -lt "$runs" ]; do
+            "$bin" 1+1 > /dev/null
+            i=$((i + 1))
+        done
+        t=$(($(now_ns) - t0))
+        [ -z "$best" ] || [ "$t" -lt "$best" ] && best=$t
+    done
+    awk "BEGIN { printf \"%-40s %.2f ms\\n\", \"$bin\", $best / $runs / 1e6 }"
+done